@@ -32,7 +32,7 @@ int y = 0;
 unsigned long errorCount = 0;
 
 
-void BitStreamHandler(unsigned long incomingBits)
+void BitStreamHandler(void* context, unsigned long incomingBits)
 {
     //noInterrupts();   // disable interrupts here, but shouldn't affect next dcc pulse, since this will be right after one
     bits = incomingBits;
@@ -42,7 +42,7 @@ void BitStreamHandler(unsigned long incomingBits)
 }
 
 
-void BitErrorHandler(byte errorCode)
+void BitErrorHandler(void* context, byte errorCode)
 {
     errorCount++;
 }
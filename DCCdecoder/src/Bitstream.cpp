@@ -20,9 +20,27 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include "Bitstream.h"
 
+// the count and overflow flag of the capture timer. the flag is cleared at each edge, so that a flag
+// that is still clear shows that the timer hasn't wrapped since the last edge was captured.
+#if defined (TIMER1_HW_0PS) || defined(TIMER1_ICR_0PS) || defined(TIMER1_HW_8PS) || defined(TIMER1_ICR_8PS)
+#define TIMER_COUNT() TCNT1
+#define TIMER_OVERFLOWED() (TIFR1 & (1 << TOV1))
+#define CLEAR_TIMER_OVERFLOW() TIFR1 = (1 << TOV1)                  // the flag is cleared by writing a 1
+#endif
+#if defined(TIMER2_HW_8PS) || defined(TIMER2_HW_32PS)
+#define TIMER_COUNT() TCNT2
+#define TIMER_OVERFLOWED() (TIFR2 & (1 << TOV2))
+#define CLEAR_TIMER_OVERFLOW() TIFR2 = (1 << TOV2)
+#endif
+#if defined(TIMER_ARM_HW_8PS)
+#define TIMER_COUNT() (((TcCount16*)TC3)->COUNT.reg)
+#define TIMER_OVERFLOWED() (((TcCount16*)TC3)->INTFLAG.bit.OVF)
+#define CLEAR_TIMER_OVERFLOW() ((TcCount16*)TC3)->INTFLAG.reg = TC_INTFLAG_OVF
+#endif
+
 // define/initialize static vars
 boolean BitStream::lastPinState = 0;
-SimpleQueue BitStream::simpleQueue;
+BitStream* BitStream::captureInstance = 0;
 
 BitStream::BitStream()
 {
@@ -32,16 +50,18 @@ BitStream::BitStream()
 
 
 // set the handler for the data full event
-void BitStream::SetDataFullHandler(DataFullHandler Handler)
+void BitStream::SetDataFullHandler(DataFullHandler Handler, void* Context)
 {
 	dataFullHandler = Handler;
+	dataFullContext = Context;
 }
 
 
 // set the handler for error events
-void BitStream::SetErrorHandler(ErrorHandler Handler)
+void BitStream::SetErrorHandler(ErrorHandler Handler, void* Context)
 {
 	errorHandler = Handler;
+	errorContext = Context;
 }
 
 
@@ -52,6 +72,14 @@ void BitStream::Suspend()
 
 	stateFunctionPointer = 0;
 
+	// leave the capture running if it is filling the queue of another instance
+	if (captureInstance && captureInstance != this)
+	{
+		interrupts();
+		return;
+	}
+	captureInstance = 0;
+
 #if defined(TIMER1_ICR_0PS) || defined(TIMER1_ICR_8PS)
 	TIMSK1 = 0;                                             // disable input capture interrupt
 #else
@@ -73,7 +101,9 @@ void BitStream::Resume()
 
 	// set the startup state
 	simpleQueue.Reset();    // reset the queue of DCC timestamps
+	anchorValid = false;    // and the time base, until an edge is anchored
 	stateFunctionPointer = &BitStream::StateStartup;
+	captureInstance = this; // have the capture ISR fill our queue
 
 #if defined(TIMER1_HW_0PS)
 	TCCR1A = 0;    // reset the registers initially
@@ -232,7 +262,7 @@ void BitStream::HandleError()
 
 	// callback error handler
 	if (errorHandler)
-		errorHandler(errorNum);
+		errorHandler(errorContext, errorNum);
 
 	bitErrorCount++;        // increment error count
 	if (bitErrorCount > maxBitErrors)
@@ -242,7 +272,7 @@ void BitStream::HandleError()
 
 		// callback error handler
 		if (errorHandler)
-			errorHandler(ERR_SEQUENTIAL_ERROR_LIMIT);
+			errorHandler(errorContext, ERR_SEQUENTIAL_ERROR_LIMIT);
 	}
 }
 
@@ -258,6 +288,8 @@ void BitStream::ProcessTimestamps()
 	}
 #endif // DEBUG
 
+	if (simpleQueue.Size() == 0) return;
+
 	while (simpleQueue.Size() > 0)
 	{
 		// get the current timestamp to check
@@ -276,6 +308,13 @@ void BitStream::ProcessTimestamps()
 		isOne = (period >= timeOneMin && period <= timeOneMax);
 		isZero = (period >= timeZeroMin && period <= timeZeroMax);
 
+		// carry the time forward to this edge. a longer period may have wrapped the timer, so the time
+		// is not known again until the next anchor.
+		if (isOne || isZero)
+			anchorCounts += period;
+		else
+			anchorValid = false;
+
 		// perform the current state function
 		if (stateFunctionPointer)
 			(*this.*stateFunctionPointer)();
@@ -283,6 +322,35 @@ void BitStream::ProcessTimestamps()
 		// save the time of the last interrupt
 		lastInterruptCount = currentCount;
 	}
+
+	UpdateAnchor();
+}
+
+
+// take the last processed edge as the anchor for the time base, if it is the last edge captured and
+// the timer hasn't wrapped since, so that its count can be converted to micros()
+void BitStream::UpdateAnchor()
+{
+	noInterrupts();
+
+	if (simpleQueue.Size() == 0 && !TIMER_OVERFLOWED())
+	{
+		const unsigned long now = micros();
+#if defined(TIMER2_HW_8PS) || defined(TIMER2_HW_32PS)
+		const byte elapsed = TIMER_COUNT() - lastInterruptCount;
+#else
+		const unsigned int elapsed = TIMER_COUNT() - lastInterruptCount;
+#endif
+		anchorMicros = now - COUNTS_TO_MICROS(elapsed);
+		anchorCounts = 0;
+		anchorValid = true;
+	}
+
+	interrupts();
+
+	// move the anchor time on by the whole microseconds counted, so the count stays small
+	anchorMicros += COUNTS_TO_MICROS(anchorCounts);
+	anchorCounts = COUNTS_REMAINDER(anchorCounts);
 }
 
 
@@ -299,14 +367,19 @@ void BitStream::QueuePut(boolean newBit)
 	queueSize++;
 	if (queueSize > maxBitIndex)
 	{
+		lastBitTime = anchorValid ? anchorMicros + COUNTS_TO_MICROS(anchorCounts) : 0;
 		if (dataFullHandler)
-			dataFullHandler(bitData);
+			dataFullHandler(dataFullContext, bitData);
 		queueSize = 0;
 		bitData = 0;
 	}
 }
 
 
+// get the time of the edge ending the last bit delivered to the data full handler
+unsigned long BitStream::LastBitTime() { return lastBitTime; }
+
+
 // get pulse timings using hardware interrupt
 void BitStream::GetTimestamp()    // static
 {
@@ -332,8 +405,9 @@ void BitStream::GetTimestamp()    // static
 	lastPinState = pinState;
 	#endif
 	
-	// add the timestamp to the queue
-	simpleQueue.Put(count);
+	// add the timestamp to the queue, and mark that the timer hasn't wrapped since it
+	if (captureInstance) captureInstance->simpleQueue.Put(count);
+	CLEAR_TIMER_OVERFLOW();
 
 	// 2.5 microseconds, with pin state check, to add new timestamp to queue
 }
@@ -347,7 +421,9 @@ ISR(TIMER1_CAPT_vect)        // static, global
 	const unsigned int capture = ICR1;    // store the capture register before we do anything else
 	TCCR1B ^= 0x40;                 // toggle the edge select bit,  (1<<6) = 0x40
 
-	BitStream::simpleQueue.Put(capture);      // add the value in the input capture register to the queue
+	if (BitStream::captureInstance)
+		BitStream::captureInstance->simpleQueue.Put(capture);      // add the value in the input capture register to the queue
+	CLEAR_TIMER_OVERFLOW();         // the timer hasn't wrapped since this edge
 }
 #endif
 
@@ -79,6 +79,23 @@ The output queue is an unsigned long, into which 32 bits are stored as they are
 shifted left each time a bit is added, so the bits are stored left to right in the order in which
 the are received. After 32 bits have been stored, a callback is triggered, and the queue is reset.
 
+Several BitStream objects may exist, for example to run a number of simulated decoders side by side.
+Each has its own timestamp queue, and passes each handler the context given with it, typically its owner.
+Since there is only one capture pin, the capture ISR fills the queue of the instance that was most
+recently resumed. Other instances may be fed timestamps through their own queue.
+
+Before the callback, the time of the edge that completed the last bit is found in the micros() time
+base. This is available from the LastBitTime method during the callback, and allows downstream
+classes to measure latency from the DCC signal itself. A timer count can only be converted by
+comparing it with the current count while the timer has not wrapped since the count was captured,
+which is less than 127.5 us for timer2 with the 8 prescaler, and about 4 ms for timer1 with no
+prescaler, longer than a pass of the main loop may take. The time is instead carried forward from an
+anchor edge, by adding the period of each valid half bit, which is always shorter than the timer
+period. When the queue has been emptied, the last edge becomes the new anchor if the timer overflow
+flag, which the capture ISR clears at each edge, shows that the timer hasn't wrapped since it. An
+invalid half bit, such as a gap in the signal, may have wrapped the timer, so it drops the anchor,
+and LastBitTime returns 0 until the next anchor is taken.
+
 */
 
 
@@ -115,16 +132,28 @@ enum : byte
 	ERR_SEQUENTIAL_ERROR_LIMIT = 10,
 };
 
-// set the timer/prescaler combination to use
-#if !defined(ADAFRUIT_METRO_M0_EXPRESS)
+// set the timer/prescaler combination to use. the timer1 input capture on pin 8 is the default, for
+// the most accurate timing. a board with the dcc signal wired to pin 2 can opt in to the timer2 irq by
+// defining BITSTREAM_TIMER2 in its build flags, since the library is compiled apart from the sketch.
+// the capture then keeps running while the servos move, so an emergency stop is seen during the motion,
+// but the edge times pick up jitter from any other interrupt that delays the irq.
+#if defined(ADAFRUIT_METRO_M0_EXPRESS)
+#define TIMER_ARM_HW_8PS   // use timer on arm with hardware irq with 8 prescaler
+#elif defined(BITSTREAM_TIMER2)
+#define TIMER2_HW_8PS    // use timer2 hardware irq with 8 prescaler
+#else
 //#define TIMER1_HW_0PS    // use timer1 hardware irq with no prescaler
 //#define TIMER1_HW_8PS    // use timer1 hardware irq with 8 prescaler
 #define TIMER1_ICR_0PS   // use timer1 input capture register with no prescaler
 //#define TIMER1_ICR_8PS   // use timer1 input capture register with 8 prescaler
 //#define TIMER2_HW_8PS    // use timer2 hardware irq with 8 prescaler
 //#define TIMER2_HW_32PS   // use timer2 hardware irq with 32 prescaler
-#else
-#define TIMER_ARM_HW_8PS   // use timer on arm with hardware irq with 8 prescaler
+#endif
+
+// timer1 is also used by the servo library, so a timer1 capture must be suspended while servos are running,
+// and emergency stops are then not seen until the motion is done
+#if defined(TIMER1_HW_0PS) || defined(TIMER1_HW_8PS) || defined(TIMER1_ICR_0PS) || defined(TIMER1_ICR_8PS)
+#define BITSTREAM_USES_TIMER1
 #endif
 
 // use standard DCC timings for ICR
@@ -167,19 +196,29 @@ enum : uint16_t { CLOCK_SCALE_FACTOR = 2U };    // 8 prescaler at 16 Mhz gives a
 enum : uint16_t { CLOCK_SCALE_FACTOR = 6U };   // 8 prescaler at 48 MHz gives a 0.167 us interval
 #endif
 
+// convert timer counts to whole microseconds, and get the counts left over, in integer math. with the
+// 32 prescaler, each count is two whole microseconds, so nothing is left over.
+#if defined(TIMER2_HW_32PS)
+#define COUNTS_TO_MICROS(counts) ((unsigned long)(counts) * 2UL)
+#define COUNTS_REMAINDER(counts) 0UL
+#else
+#define COUNTS_TO_MICROS(counts) ((unsigned long)(counts) / CLOCK_SCALE_FACTOR)
+#define COUNTS_REMAINDER(counts) ((unsigned long)(counts) % CLOCK_SCALE_FACTOR)
+#endif
+
 
 class BitStream
 {
 public:
-	typedef void(*DataFullHandler)(unsigned long BitData);
-	typedef void(*ErrorHandler)(byte ErrorCode);
+	typedef void(*DataFullHandler)(void* Context, unsigned long BitData);
+	typedef void(*ErrorHandler)(void* Context, byte ErrorCode);
 
 	// create the bitstream object
 	BitStream();
 
 	// configure the callback handlers
-	void SetDataFullHandler(DataFullHandler Handler);
-	void SetErrorHandler(ErrorHandler Handler);
+	void SetDataFullHandler(DataFullHandler Handler, void* Context = 0);
+	void SetErrorHandler(ErrorHandler Handler, void* Context = 0);
 
 	// suspend or resume the bitstream capture
 	void Suspend();
@@ -188,7 +227,11 @@ public:
 	// process the raw timestamp queue
 	void ProcessTimestamps();
 
-	static SimpleQueue simpleQueue;         // queue for the DCC timestamps
+	// time (micros) of the final edge of the last bit provided to the data full handler
+	unsigned long LastBitTime();
+
+	SimpleQueue simpleQueue;                // queue for the DCC timestamps
+	static BitStream* captureInstance;      // the instance receiving timestamps from the capture ISR
 
 private:
 	// Hardware assignments
@@ -215,7 +258,7 @@ private:
 	#if defined(TIMER2_HW_8PS) || defined(TIMER2_HW_32PS)
 	byte currentCount = 0;          // timer count for the last pulse
 	byte period = 0;                // period of the current pulse
-	byte lastInterruptCount = 0;    // Timer1 count at the last interrupt
+	byte lastInterruptCount = 0;    // Timer2 count at the last interrupt
 	#endif
 
 		// bitstream capture vars
@@ -224,18 +267,20 @@ private:
 	boolean lastHalfBit = 0;                // the last half bit captured
 	boolean endOfBit = false;               // second half-bit indicator
 
-	// DCC microsecond 0 & 1 timings
+	// DCC microsecond 0 & 1 timings, in whole counts for the fractional scale factor of the 32 prescaler
 	enum : uint16_t
 	{
-		timeOneMin = DCC_DEFAULT_ONE_MIN * CLOCK_SCALE_FACTOR,
-		timeOneMax = DCC_DEFAULT_ONE_MAX * CLOCK_SCALE_FACTOR,
-		timeZeroMin = DCC_DEFAULT_ZERO_MIN * CLOCK_SCALE_FACTOR,
-		timeZeroMax = DCC_DEFAULT_ZERO_MAX * CLOCK_SCALE_FACTOR,
+		timeOneMin = (uint16_t)(DCC_DEFAULT_ONE_MIN * CLOCK_SCALE_FACTOR),
+		timeOneMax = (uint16_t)(DCC_DEFAULT_ONE_MAX * CLOCK_SCALE_FACTOR),
+		timeZeroMin = (uint16_t)(DCC_DEFAULT_ZERO_MIN * CLOCK_SCALE_FACTOR),
+		timeZeroMax = (uint16_t)(DCC_DEFAULT_ZERO_MAX * CLOCK_SCALE_FACTOR),
 	};
 
 	// Event handlers
 	DataFullHandler dataFullHandler = 0;    // handler for the data full event
+	void* dataFullContext = 0;              // context passed to the data full handler, e.g. the owning instance
 	ErrorHandler errorHandler = 0;          // handler for errors
+	void* errorContext = 0;                 // context passed to the error handler
 
 	// Interrupt and error variables
 	byte bitErrorCount = 0;                 // current number of sequential bit errors
@@ -246,10 +291,17 @@ private:
 	enum : byte { maxBitIndex = 31 };            // 32 bits total to store in unsigned long
 	byte queueSize = 0;                     // current size of the queue
 	unsigned long bitData = 0;              // stores the bitstream
+	unsigned long lastBitTime = 0;          // micros() time of the edge ending the last queued bit, 0 if not known
+
+	// time base for the edges
+	unsigned long anchorMicros = 0;         // micros() time of the anchor edge, moved on by whole microseconds
+	unsigned long anchorCounts = 0;         // timer counts from the anchor time to the last processed edge
+	boolean anchorValid = false;            // the time of the last processed edge is known
 
 	// private methods
 	void QueuePut(boolean newBit);          // adds a bit to the queue
 	static void GetTimestamp();		        // get and queue the timestamp from a hw interrupt
+	void UpdateAnchor();                    // take the last processed edge as the anchor, if its time can be found
 	void ArmTimerSetup();
 };
 
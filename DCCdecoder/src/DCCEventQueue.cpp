@@ -0,0 +1,74 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "DCCEventQueue.h"
+
+
+// add an event to the queue, returns false if the queue is full and the event was dropped
+bool DCCEventQueue::Put(const DCCEvent& event)
+{
+	if (queueSize >= queueLength)
+	{
+		dropped++;
+		return false;
+	}
+
+	byte writeIndex = readIndex + queueSize;
+	if (writeIndex >= queueLength) writeIndex -= queueLength;
+
+	events[writeIndex] = event;
+	queueSize++;
+	return true;
+}
+
+
+// get the oldest event from the queue, returns false if the queue is empty
+bool DCCEventQueue::Get(DCCEvent& event)
+{
+	if (queueSize == 0) return false;
+
+	event = events[readIndex];
+	if (++readIndex >= queueLength) readIndex = 0;
+	queueSize--;
+	return true;
+}
+
+
+// get the number of events in the queue
+byte DCCEventQueue::Size()
+{
+	return queueSize;
+}
+
+
+// get the number of events dropped because the queue was full
+unsigned int DCCEventQueue::Dropped()
+{
+	return dropped;
+}
+
+
+// empty the queue and clear the dropped count
+void DCCEventQueue::Reset()
+{
+	queueSize = 0;
+	readIndex = 0;
+	dropped = 0;
+}
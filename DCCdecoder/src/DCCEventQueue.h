@@ -0,0 +1,134 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+DCC Event Queue
+
+A bounded queue of decoded DCC events, for passing them from the decoder to the managers.
+
+Summary:
+
+Calling the manager event methods from within the bitstream and packet processing would let a slow
+method delay the draining of the timestamp queue. Instead, each decoded packet or error is stored in
+the event queue attached to the decoder as a small typed record. The manager then has the decoder
+dispatch the queued events to its event methods from its own Update method, a limited number at a time.
+
+Example Usage:
+
+	DCCEventQueue dccEvents;                // create an event queue
+	dcc.SetEventQueue(&dccEvents);          // have the decoder queue its events
+	dcc.ProcessTimeStamps();                // decode packets, queueing the events
+	dcc.DispatchEvents(*this, 2);           // call the event methods for at most two queued events
+
+Details:
+
+The queue is a ring buffer of fixed size records. Each record holds the event type, the packet time,
+and the event data, laid out according to the type as noted in the DCCEvent struct. Idle and reset
+events carry a copy of the packet bytes, since the packet builder's buffer is reused by the time the
+event is dispatched. If the queue is full, the new event is dropped and counted. Since DCC commands
+are repeated by the command station, a dropped command is normally received again shortly after. The
+queue is filled and emptied outside of any ISR, so no interrupt locking is needed.
+
+*/
+
+
+#ifndef _DCCEVENTQUEUE_h
+#define _DCCEVENTQUEUE_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+
+// a decoded DCC event
+struct DCCEvent
+{
+	enum EventType : byte
+	{
+		IDLE,                  // data: packet size, bytes: packet
+		RESET,                 // data: packet size, bytes: packet
+		BASIC_CONTROL,         // address: loco, value: speed, info: direction, data: speed steps
+		FUNCTION,              // address: loco, info: function group, data: functions
+		CONSIST,               // address: loco, info: direction, data: consist address
+		LOCO_POM,              // address: loco, value: cv, info: instruction type, data: cv data
+		LOCO_XPOM,             // xpom: loco, cv address and data, info: instruction type, data: number of data bytes
+		BASIC_ACC,             // address: board, subAddress: output, info: activate, data: data
+		BASIC_ACC_POM,         // address: board, subAddress: output, value: cv, info: instruction type, data: cv data
+		EXTENDED_ACC,          // address: board, subAddress: output, data: data
+		EXTENDED_ACC_POM,      // address: board, subAddress: output, value: cv, info: instruction type, data: cv data
+		LEGACY_ACC_POM,        // address: board, subAddress: output, value: cv, info: instruction type, data: cv data
+		ACC_XPOM,              // xpom: output, cv address and data, info: instruction type, data: number of data bytes
+		SERVICE_MODE,          // value: cv, info: instruction type, data: cv data
+		BITSTREAM_ERROR,       // info: error code
+		BITSTREAM_MAX_ERROR,   // info: error code
+		PACKET_ERROR,          // info: error code
+		PACKET_MAX_ERROR,      // info: error code
+		DECODING_ERROR,        // info: error code
+	};
+
+	// the bit for an event type in an event mask
+	static constexpr uint32_t Bit(EventType type) { return 1UL << type; }
+
+	EventType type;
+	byte info;
+	byte data;
+	unsigned long time;        // time (micros) of the end bit of the packet
+
+	union
+	{
+		struct
+		{
+			int address;
+			int subAddress;
+			int value;
+		} dcc;
+		struct
+		{
+			int address;
+			uint16_t cvIndex;      // upper 16 bits of the 24 bit cv address
+			byte cvOffset;         // lower 8 bits of the cv address
+			byte values[4];
+		} xpom;
+		byte bytes[6];
+	};
+};
+
+
+class DCCEventQueue
+{
+public:
+	bool Put(const DCCEvent& event);
+	bool Get(DCCEvent& event);
+	byte Size();
+	unsigned int Dropped();
+	void Reset();
+
+private:
+	enum : byte { queueLength = 8 };
+	DCCEvent events[queueLength];
+	byte queueSize = 0;
+	byte readIndex = 0;
+	unsigned int dropped = 0;          // events dropped because the queue was full
+};
+
+#endif
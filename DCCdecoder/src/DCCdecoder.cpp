@@ -20,72 +20,233 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include "DCCdecoder.h"
 
-// static pointer for callbacks
-DCCdecoder* DCCdecoder::currentInstance = 0;
+// packet type lookup table, expanded at compile time from PacketTypeOf
+#define PACKET_TYPES_4(n)   PacketTypeOf(n), PacketTypeOf(n + 1), PacketTypeOf(n + 2), PacketTypeOf(n + 3)
+#define PACKET_TYPES_16(n)  PACKET_TYPES_4(n), PACKET_TYPES_4(n + 4), PACKET_TYPES_4(n + 8), PACKET_TYPES_4(n + 12)
+#define PACKET_TYPES_64(n)  PACKET_TYPES_16(n), PACKET_TYPES_16(n + 16), PACKET_TYPES_16(n + 32), PACKET_TYPES_16(n + 48)
+
+const byte DCCdecoder::packetTypeTable[256] PROGMEM =
+{
+	PACKET_TYPES_64(0), PACKET_TYPES_64(64), PACKET_TYPES_64(128), PACKET_TYPES_64(192)
+};
+
+// accessory packet type lookup table, expanded at compile time from AccPacketTypeOf
+#define ACC_PACKET_TYPES_4(n)   AccPacketTypeOf(n), AccPacketTypeOf(n + 1), AccPacketTypeOf(n + 2), AccPacketTypeOf(n + 3)
+#define ACC_PACKET_TYPES_16(n)  ACC_PACKET_TYPES_4(n), ACC_PACKET_TYPES_4(n + 4), ACC_PACKET_TYPES_4(n + 8), ACC_PACKET_TYPES_4(n + 12)
+
+const byte DCCdecoder::accPacketTypeTable[64] PROGMEM =
+{
+	ACC_PACKET_TYPES_16(0), ACC_PACKET_TYPES_16(16), ACC_PACKET_TYPES_16(32), ACC_PACKET_TYPES_16(48)
+};
+
+// loco speed steps for the basic speed instruction in 28 step mode, indexed by SSSSC
+const int8_t DCCdecoder::speedTable28[32] PROGMEM =
+{
+	 0,  0, -1, -1,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12,
+	13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28
+};
+
+#undef PACKET_TYPES_4
+#undef PACKET_TYPES_16
+#undef PACKET_TYPES_64
+#undef ACC_PACKET_TYPES_4
+#undef ACC_PACKET_TYPES_16
 
 // Constructors
 
 DCCdecoder::DCCdecoder()
 {
-	// pointer for callback functions
-	currentInstance = this;
-	
-    // packet vars
-	for (byte i = 0; i < PACKET_LEN_MAX; i++)
-		packet[i] = 0;
-
-	// set callbacks for the bitstream capture
-	bitStream.SetDataFullHandler(WrapperBitStream);
-	bitStream.SetErrorHandler(WrapperBitStreamError);
+	// set callbacks for the bitstream capture, with this instance as the context
+	bitStream.SetDataFullHandler(WrapperBitStream, this);
+	bitStream.SetErrorHandler(WrapperBitStreamError, this);
 
 	// set callbacks for the packet builder
-	dccPacket.SetPacketCompleteHandler(WrapperDCCPacket);
-	dccPacket.SetPacketErrorHandler(WrapperDCCPacketError);
+	dccPacket.SetPacketCompleteHandler(WrapperDCCPacket, this);
+	dccPacket.SetPacketErrorHandler(WrapperDCCPacketError, this);
+
+	// reject packets for other addresses in the packet builder
+	UpdateAddressFilter();
 }
 
 DCCdecoder::DCCdecoder(DecoderSettings settings) : DCCdecoder()
 {
-	decoderSettings = settings;
+	UpdateSettings(settings);
 }
 
 bool DCCdecoder::SetAddress(uint16_t address)
 {
 	decoderSettings.baseAddress = address;
+	UpdateAddressFilter();
 	return true;
 }
 
 bool DCCdecoder::UpdateSettings(DecoderSettings settings)
 {
 	decoderSettings = settings;
+
+	// replace the address table with the alternate addresses from the settings
+	addressRangeCount = 0;
+	bool result = true;
+	for (byte i = 0; i < decoderSettings.altAddresses && i < 2; i++)
+		if (AddAddress(decoderSettings.altAddress[i]) != ADDRESS_ADDED) result = false;
+
+	UpdateAddressFilter();
+	return result;
+}
+
+
+// Address table  ==============================================================================
+
+// hold the address ranges in a table owned by the caller, keeping any already added. returns false, and
+// keeps the current table, if they don't fit in the new one.
+bool DCCdecoder::SetAddressTable(AddressRange* table, byte size)
+{
+	if (!table || addressRangeCount > size) return false;
+
+	for (byte i = 0; i < addressRangeCount; i++) table[i] = addressRanges[i];
+	addressRanges = table;
+	maxAddressRanges = size;
 	return true;
 }
 
+DCCdecoder::AddressResult DCCdecoder::AddAddress(uint16_t address)
+{
+	return AddAddressRange(address, address);
+}
+
+// add a range of output addresses, merging with any range it overlaps or adjoins
+DCCdecoder::AddressResult DCCdecoder::AddAddressRange(uint16_t firstAddress, uint16_t lastAddress)
+{
+	if (firstAddress < 1 || lastAddress > MAX_ADDRESS || firstAddress > lastAddress) return ADDRESS_INVALID;
+
+	// a range that merges with none of the others needs a free entry. the table is left as it is if
+	// there is none, so the caller can tell which addresses are not matched.
+	bool merges = false;
+	for (byte i = 0; i < addressRangeCount && !merges; i++)
+		merges = firstAddress <= addressRanges[i].last + 1 && lastAddress + 1 >= addressRanges[i].first;
+	if (!merges && addressRangeCount >= maxAddressRanges)
+	{
+#ifdef _DEBUG
+		Serial.println("Address table full, range not added.");
+#endif
+		return ADDRESS_TABLE_FULL;
+	}
+
+	byte i = 0;
+	while (i < addressRangeCount)
+	{
+		AddressRange& range = addressRanges[i];
+		if (firstAddress <= range.last + 1 && lastAddress + 1 >= range.first)
+		{
+			// take the merged range out of the table, and carry on merging with the remaining ones
+			if (range.first < firstAddress) firstAddress = range.first;
+			if (range.last > lastAddress) lastAddress = range.last;
+			addressRanges[i] = addressRanges[--addressRangeCount];
+		}
+		else
+			i++;
+	}
+
+	addressRanges[addressRangeCount].first = firstAddress;
+	addressRanges[addressRangeCount].last = lastAddress;
+	addressRangeCount++;
+
+	UpdateAddressFilter();
+	return ADDRESS_ADDED;
+}
+
+void DCCdecoder::ClearAddresses()
+{
+	addressRangeCount = 0;
+	UpdateAddressFilter();
+}
+
+// check an output address against the base address and the address table
+bool DCCdecoder::IsAddressMatched(uint16_t outputAddress)
+{
+	if (outputAddress == decoderSettings.baseAddress) return true;
+
+	for (byte i = 0; i < addressRangeCount; i++)
+		if (outputAddress >= addressRanges[i].first && outputAddress <= addressRanges[i].last) return true;
+
+	return false;
+}
+
+// push the board addresses for our output addresses down to the packet builder, so that packets for other
+// addresses are skipped during assembly. the filter is disabled if we are returning all packets.
+void DCCdecoder::UpdateAddressFilter()
+{
+	const uint16_t boardAddress = ((decoderSettings.baseAddress - 1) >> 2) + 1;   // as encoded in the packet
+
+	// span of board addresses covering the base address and the address table
+	uint16_t firstBoard = boardAddress;
+	uint16_t lastBoard = boardAddress;
+	for (byte i = 0; i < addressRangeCount; i++)
+	{
+		const uint16_t first = ((addressRanges[i].first - 1) >> 2) + 1;
+		const uint16_t last = ((addressRanges[i].last - 1) >> 2) + 1;
+		if (first < firstBoard) firstBoard = first;
+		if (last > lastBoard) lastBoard = last;
+	}
+
+	dccPacket.FilterAddresses(!decoderSettings.returnAllPackets && !packetSniffer, firstBoard, lastBoard);
+	dccPacket.FilterLocoAddresses(locoAddress, locoAddress > 127, consistAddress & 0x7F);
+
+	// the packet bits for our base address, for matching accessory packets before decoding addresses
+	matchAddrLow = boardAddress & 0x3F;
+	matchAddrHigh = ((~(boardAddress >> 2)) & 0x70) | (((decoderSettings.baseAddress - 1) & 0x03) << 1);
+}
+
+// Loco settings  ==============================================================================
+
+void DCCdecoder::SetLocoAddress(uint16_t address)
+{
+	locoAddress = address;
+	UpdateAddressFilter();
+}
+
+void DCCdecoder::SetConsistAddress(byte address)
+{
+	consistAddress = address;
+	UpdateAddressFilter();
+}
+
+void DCCdecoder::SetSpeedSteps(byte steps)
+{
+	speedSteps28 = (steps != 14);
+}
+
+// attach or detach a packet sniffer. all packets are passed through while sniffing.
+void DCCdecoder::SetPacketSniffer(PacketSniffer* sniffer)
+{
+	packetSniffer = sniffer;
+	dccPacket.FilterRepeatPackets(!packetSniffer);
+	UpdateAddressFilter();
+}
 
-// Set callback handlers  ==========================================================
 
-void DCCdecoder::SetBaselineControlPacketHandler(BasicControlHandler handler) { basicControlHandler = handler; }
-void DCCdecoder::SetBasicAccessoryDecoderPacketHandler(BasicAccHandler handler) { basicAccHandler = handler; }
-void DCCdecoder::SetBasicAccessoryPomPacketHandler(AccPomHandler handler) { basicAccPomHandler = handler; }
-void DCCdecoder::SetLegacyAccessoryPomPacketHandler(AccPomHandler handler) { legacyAccPomHandler = handler; }
-void DCCdecoder::SetExtendedAccessoryDecoderPacketHandler(ExtendedAccHandler handler) { extendedAccHandler = handler; }
-void DCCdecoder::SetExtendedAccessoryPomPacketHandler(AccPomHandler handler) { extAccPomHandler = handler; }
-void DCCdecoder::SetIdlePacketHandler(IdleResetHandler handler) { idleHandler = handler; }
-void DCCdecoder::SetResetPacketHandler(IdleResetHandler handler) { resetHandler = handler; }
+// Set emergency stop handler  ==================================================================
 
-void DCCdecoder::SetBitstreamErrorHandler(BitstreamErrorHandler handler) { bitstreamErrorHandler = handler; }
-void DCCdecoder::SetBitstreamMaxErrorHandler(BitstreamErrorHandler handler) { bitstreamMaxErrorHandler = handler; }
-void DCCdecoder::SetPacketErrorHandler(PacketErrorHandler handler) { packetErrorHandler = handler; }
-void DCCdecoder::SetPacketMaxErrorHandler(PacketErrorHandler handler) { packetMaxErrorHandler = handler; }
-void DCCdecoder::SetDecodingErrorHandler(DecodingErrorHandler handler) { decodingErrorHandler = handler; }
+void DCCdecoder::SetEmergencyStopHandler(EmergencyStopHandler handler, void* context)
+{
+	emergencyStopHandler = handler;
+	emergencyStopContext = context;
+}
 
 
 // Bitstream control  ==========================================================================
 
 void DCCdecoder::ProcessTimeStamps()
 {
+	// end the service mode ack pulse when it is due
+	UpdateAck();
+
 	// process the timestamps in the bitstream
 	bitStream.ProcessTimestamps();
 
+	// send any queued sniffer records
+	if (packetSniffer) packetSniffer->Update();
+
 	// check/reset error counts
 	const unsigned long currentMillis = millis();
 	if (currentMillis - lastMillis > 1000)
@@ -99,7 +260,7 @@ void DCCdecoder::ProcessTimeStamps()
 #endif
 
 		// check bit errors and raise event if necessary
-		if ((bitErrorCount > maxBitErrors) && bitstreamMaxErrorHandler) bitstreamMaxErrorHandler(lastBitError);
+		if ((bitErrorCount > maxBitErrors) && IsEventEnabled(DCCEvent::BITSTREAM_MAX_ERROR)) RaiseErrorEvent(DCCEvent::BITSTREAM_MAX_ERROR, lastBitError);
 
 		// if we see repeated packet errors, reset bitstream capture
 		if (packetErrorCount > maxPacketErrors)
@@ -109,7 +270,7 @@ void DCCdecoder::ProcessTimeStamps()
 			bitStream.Resume();
 
 			// raise max packet error event
-			if (packetMaxErrorHandler) packetMaxErrorHandler(lastPacketError);
+			if (IsEventEnabled(DCCEvent::PACKET_MAX_ERROR)) RaiseErrorEvent(DCCEvent::PACKET_MAX_ERROR, lastPacketError);
 		}
 
 		lastMillis = currentMillis;
@@ -133,40 +294,85 @@ void DCCdecoder::ResumeBitstream()
 	bitStream.Resume();
 }
 
+// Service mode acknowledgement  ===============================================================
+
+// set the output pulsed to acknowledge a service mode instruction
+void DCCdecoder::SetAckOutput(byte pin)
+{
+	ackPin = pin;
+	pinMode(ackPin, OUTPUT);
+}
+
+// begin the ack pulse. it is ended from ProcessTimeStamps, so that we never wait on it here.
+void DCCdecoder::Acknowledge()
+{
+	if (ackPin == noAckPin) return;
+
+	// keep the state from before the pulse, if we are extending one already in progress
+	if (!ackActive) ackPinState = digitalRead(ackPin);
+	digitalWrite(ackPin, HIGH);
+	ackActive = true;
+	ackStart = micros();
+}
+
+// restore the ack output once the pulse is complete
+void DCCdecoder::UpdateAck()
+{
+	if (ackActive && (micros() - ackStart >= ACK_DURATION))
+	{
+		digitalWrite(ackPin, ackPinState);
+		ackActive = false;
+	}
+}
+
+bool DCCdecoder::IsServiceMode()
+{
+	return serviceMode;
+}
+
+// classify a packet by its first byte
+DCCdecoder::PacketType DCCdecoder::ClassifyPacket(byte firstByte)
+{
+	return (PacketType)pgm_read_byte(&packetTypeTable[firstByte]);
+}
+
+unsigned long DCCdecoder::PacketTime()
+{
+	return packetTime;
+}
+
+byte DCCdecoder::SpeedSteps()
+{
+	return speedSteps;
+}
+
 
 
 // Packet processing   =========================================================================
 
 // process an incoming packet
 // we assume this is a valid, checksummed packet, for example from DCCpacket class
-void DCCdecoder::ProcessPacket(byte *packetData, byte size)
+void DCCdecoder::ProcessPacket(const DCCpacket::PacketView& packetView)
 {
-	// assign params to class vars
-    packetSize = size;
-    for (byte i=0; i<packetSize; i++)
-        packet[i] = packetData[i];
+	// refer to the packet builder's buffer, rather than copying it. it is valid until we return.
+    packet = packetView.data;
+    packetSize = packetView.size;
+    packetTime = packetView.time;
 
-    // Determine the basic packet type - loop through packet specs and check against current packet
-    byte i = 0;
-    bool packetIdentified = false;
+    if (packetSniffer) packetSniffer->RecordPacket(packet, packetSize, packetTime);
 
-	while (i < numPacketTypes && !packetIdentified)
-	{
-		if ((packet[0] & packetSpec[i].specMask) == packetSpec[i].specAns)
-			packetIdentified = true;
-		i++;
-	}
+    // Determine the basic packet type with a single table lookup on the first byte
+    packetType = (PacketType)pgm_read_byte(&packetTypeTable[packet[0]]);
 
-    // assign the packet type we identified
-    if (packetIdentified)
+    // service mode packets are sent with a long preamble, and are only looked for if they are handled
+    if (IsEventEnabled(DCCEvent::SERVICE_MODE))
     {
-        packetType = packetSpec[i - 1].packetType;
-    }
-    else    // exit with error if we can't identify the packet
-    {
-        if (decodingErrorHandler)
-            decodingErrorHandler(DCC_ERR_UNKNOWN_PACKET);
-        return;
+        if (packetView.preamble >= SERVICE_PREAMBLE_MIN)
+        {
+            if (ProcessServicePacket()) return;
+        }
+        else if (serviceMode)
+            SetServiceMode(false);
     }
 
     // Process the packet depending on its type
@@ -179,10 +385,10 @@ void DCCdecoder::ProcessPacket(byte *packetData, byte size)
         ProcessBroadcastPacket();
         break;
     case LOCO_SHORT:
-        //ProcessShortLocoPacket();
+        ProcessShortLocoPacket();
         break;
     case LOCO_LONG:
-        //ProcessLongLocoPacket();
+        ProcessLongLocoPacket();
         break;
     case ACCBROADCAST:
         ProcessAccBroadcastPacket();
@@ -198,25 +404,36 @@ void DCCdecoder::ProcessPacket(byte *packetData, byte size)
 // Process an idle packet
 void DCCdecoder::ProcessIdlePacket()
 {
-    if(idleHandler)
-        (idleHandler)(packetSize,packet);
+    if (IsEventEnabled(DCCEvent::IDLE))
+        RaisePacketEvent(DCCEvent::IDLE);
 }
 
 
 // Process a broadcast packet
 void DCCdecoder::ProcessBroadcastPacket()
 {
-    //  reset packet
+    //  reset packet, which also brings everything to an immediate stop, unless it is one of the resets sent
+    //  around each instruction in service mode
     if (packet[1] == 0x00)
     {
-        if(resetHandler)
-            (resetHandler)(packetSize,packet);
+        if (!serviceMode) EmergencyStop();
+        if (IsEventEnabled(DCCEvent::RESET))
+            RaisePacketEvent(DCCEvent::RESET);
+        return;
     }
 
-    //  broadcast stop packet
-    if ((packet[1] & 0xCE) == 0x40)
+    //  broadcast stop packet, 01DC000S, with S = 1 for an emergency stop
+    if ((packet[1] & 0xCF) == 0x41)
     {
-        // TODO: handle broadcast stop here
+        EmergencyStop();
+        return;
+    }
+
+    //  broadcast emergency stop with 128 speed steps, 00111111 D0000001
+    if (packet[1] == 0x3F && packetSize == 4 && (packet[2] & 0x7F) == 0x01)
+    {
+        EmergencyStop();
+        return;
     }
 
     // general broadcast packet
@@ -224,12 +441,253 @@ void DCCdecoder::ProcessBroadcastPacket()
 }
 
 
+// Process a packet with a long preamble, returns true if the packet was consumed by service mode
+bool DCCdecoder::ProcessServicePacket()
+{
+    const bool isReset = (packetType == BROADCAST && packet[1] == 0x00);
+
+    // service mode is entered on a reset packet, which stops everything as on the main, and is then
+    // processed as a reset in service mode
+    if (!serviceMode)
+    {
+        if (isReset)
+        {
+            EmergencyStop();
+            SetServiceMode(true);
+        }
+        return false;
+    }
+
+    // instructions are 0111xxxx, any other packet breaks a run of repeated instructions. resets and idles
+    // are processed as usual, everything else is ignored while in service mode.
+    if ((packet[0] & 0xF0) != 0x70 || packetSize > sizeof(servicePacket))
+    {
+        serviceRepeats = 0;
+        return !isReset && packetType != IDLEPKT;
+    }
+
+    // act on the second of a run of identical instructions, and ignore the rest of the run
+    if (serviceRepeats && packetSize == servicePacketSize && memcmp(packet, servicePacket, packetSize) == 0)
+    {
+        if (serviceRepeats < 255) serviceRepeats++;
+    }
+    else
+    {
+        memcpy(servicePacket, packet, packetSize);
+        servicePacketSize = packetSize;
+        serviceRepeats = 1;
+    }
+
+    if (serviceRepeats == 2) ProcessServiceInstruction();
+    return true;
+}
+
+
+// Process a service mode instruction, in direct mode or in paged and physical register mode
+void DCCdecoder::ProcessServiceInstruction()
+{
+    byte instructionType;
+    int cv;
+    byte data;
+
+    if (packetSize == 4)
+    {
+        // direct mode, 0111CCAA AAAAAAAA DDDDDDDD, for cv 1-1024. CC: 01 = verify, 11 = write, 10 = bit manipulation
+        instructionType = (packet[0] & 0x0C) >> 2;
+        if (instructionType == 0) return;    // reserved
+        cv = (((packet[0] & 0x03) << 8) | packet[1]) + 1;
+        data = packet[2];
+    }
+    else
+    {
+        // paged and physical register mode, 0111CRRR DDDDDDDD, where C = 1 to write, 0 to verify
+        const byte reg = packet[0] & 0x07;
+        instructionType = (packet[0] & 0x08) ? 3 : 1;
+        data = packet[1];
+
+        // the page register (register 6) is held here, and is acknowledged when written or matched
+        if (reg == 5)
+        {
+            if (instructionType == 3) servicePage = data;
+            if (instructionType == 3 || data == servicePage) Acknowledge();
+            return;
+        }
+
+        // registers 1-4 address the cvs in the current page, registers 5, 7, and 8 are CV29, CV7, and CV8
+        if (reg < 4)
+            cv = (byte)(servicePage - 1) * 4 + reg + 1;
+        else if (reg == 4)
+            cv = 29;
+        else
+            cv = reg + 1;
+    }
+
+    RaiseEvent(DCCEvent::SERVICE_MODE, 0, 0, cv, instructionType, data);
+}
+
+
+// enter or leave service mode. the packet builder passes all packets and repeats while in service mode.
+void DCCdecoder::SetServiceMode(bool enable)
+{
+    serviceMode = enable;
+    serviceRepeats = 0;
+    dccPacket.SetServiceMode(enable);
+}
+
+
+// pass a reset or emergency stop straight to its handler, rather than raising it as an event
+void DCCdecoder::EmergencyStop()
+{
+    if (emergencyStopHandler) emergencyStopHandler(emergencyStopContext);
+}
+
+
 // Process a loco packet with a short address
-void DCCdecoder::ProcessShortLocoPacket() {}
+void DCCdecoder::ProcessShortLocoPacket()
+{
+    // 0AAAAAAA, short addresses never match a long loco address
+    const int address = packet[0];
+    const bool isConsist = consistAddress && address == (consistAddress & 0x7F);
+    if (!isConsist && address != locoAddress && !decoderSettings.returnAllPackets) return;
+
+    ProcessLocoInstructions(1, address, isConsist);
+}
 
 
 // Process a loco packet with a long address
-void DCCdecoder::ProcessLongLocoPacket() { }
+void DCCdecoder::ProcessLongLocoPacket()
+{
+    // 11AAAAAA AAAAAAAA, addresses from 11101000 are reserved
+    if (packet[0] >= 0xE8) return;
+
+    const int address = ((packet[0] & 0x3F) << 8) | packet[1];
+    if ((locoAddress <= 127 || address != locoAddress) && !decoderSettings.returnAllPackets) return;
+
+    ProcessLocoInstructions(2, address, false);
+}
+
+
+// Process the instructions in a loco packet, starting at the given byte
+void DCCdecoder::ProcessLocoInstructions(byte index, int address, bool isConsist)
+{
+    // the last byte is the error detection byte
+    while (index < packetSize - 1)
+    {
+        const byte length = ProcessLocoInstruction(index, address, isConsist);
+        if (!length) return;
+        index += length;
+    }
+}
+
+
+// Process one loco instruction, returns its length in bytes, or 0 if it is not supported
+byte DCCdecoder::ProcessLocoInstruction(byte index, int address, bool isConsist)
+{
+    const byte instruction = packet[index];
+    const bool hasData = (index + 2 < packetSize);     // a data byte follows, ahead of the error detection byte
+
+    // the instruction type is given by the top three bits
+    switch (instruction >> 5)
+    {
+    case 0:     // 000 decoder and consist control
+        if ((instruction & 0xFE) == 0x12 && hasData)
+        {
+            // 0001001D 0AAAAAAA set consist address, D = 1 for reversed direction
+            if (IsEventEnabled(DCCEvent::CONSIST) && !isConsist)
+                RaiseEvent(DCCEvent::CONSIST, address, 0, 0, instruction & 0x01, packet[index + 1] & 0x7F);
+            return 2;
+        }
+        break;
+
+    case 1:     // 001 advanced operations
+        if (instruction == 0x3F && hasData)
+        {
+            // 00111111 DSSSSSSS 128 speed steps
+            const int step = packet[index + 1] & 0x7F;
+            speedSteps = 128;
+            ProcessSpeed(address, step < 2 ? -step : step - 1, packet[index + 1] >> 7, isConsist);
+            return 2;
+        }
+        break;
+
+    case 2:     // 010 speed and direction, reverse
+    case 3:     // 011 speed and direction, forward
+        if (speedSteps28)
+        {
+            // 01DCSSSS, the intermediate speed bit C is the low bit of the speed step
+            speedSteps = 28;
+            const byte index28 = ((instruction & 0x0F) << 1) | ((instruction & 0x10) >> 4);
+            ProcessSpeed(address, (int8_t)pgm_read_byte(&speedTable28[index28]), (instruction & 0x20) >> 5, isConsist);
+        }
+        else
+        {
+            // 01DCSSSS, the C bit is the headlight in 14 step mode
+            const int step = instruction & 0x0F;
+            speedSteps = 14;
+            ProcessSpeed(address, step < 2 ? -step : step - 1, (instruction & 0x20) >> 5, isConsist);
+        }
+        return 1;
+
+    case 4:     // 100 function group one, 100DDDDD with F0 in bit 4 and F1-F4 in bits 0-3
+        ProcessFunctions(address, FN_0_4, ((instruction & 0x0F) << 1) | ((instruction & 0x10) >> 4), isConsist);
+        return 1;
+
+    case 5:     // 101 function group two, 1011DDDD for F5-F8, 1010DDDD for F9-F12
+        ProcessFunctions(address, (instruction & 0x10) ? FN_5_8 : FN_9_12, instruction & 0x0F, isConsist);
+        return 1;
+
+    case 6:     // 110 feature expansion
+        if ((instruction & 0xFE) == 0xDE && hasData)
+        {
+            // 11011110 DDDDDDDD for F13-F20, 11011111 DDDDDDDD for F21-F28
+            ProcessFunctions(address, (instruction & 0x01) ? FN_21_28 : FN_13_20, packet[index + 1], isConsist);
+            return 2;
+        }
+        break;
+
+    case 7:     // 111 configuration variable access
+        if ((instruction & 0xF0) == 0xE0 && index + 4 < packetSize)
+        {
+            // 1110CCSS VVVVVVVV VVVVVVVV VVVVVVVV [DDDDDDDD...] extended form (XPOM), with a 24 bit cv
+            // address and up to four data bytes, which takes the rest of the packet
+            if (IsEventEnabled(DCCEvent::LOCO_XPOM) && !isConsist)
+                RaiseXpomEvent(DCCEvent::LOCO_XPOM, address, index);
+            return packetSize - 1 - index;
+        }
+        if ((instruction & 0xF0) == 0xE0 && index + 3 < packetSize)
+        {
+            // 1110CCVV VVVVVVVV DDDDDDDD long form, CC is the instruction type
+            if (IsEventEnabled(DCCEvent::LOCO_POM) && !isConsist)
+            {
+                int cv = ((instruction & 0x03) << 8) + packet[index + 1] + 1;   // cv 10 bit address, add one for zero index
+                RaiseEvent(DCCEvent::LOCO_POM, address, 0, cv, (instruction & 0x0C) >> 2, packet[index + 2]);
+            }
+            return 3;
+        }
+        break;
+    }
+
+    // unsupported or incomplete instruction, skip the rest of the packet
+    return 0;
+}
+
+
+// Return a speed and direction, reversing the direction for a reversed consist
+void DCCdecoder::ProcessSpeed(int address, int speed, byte direction, bool isConsist)
+{
+    if (isConsist && (consistAddress & 0x80)) direction ^= 0x01;
+
+    if (IsEventEnabled(DCCEvent::BASIC_CONTROL))
+        RaiseEvent(DCCEvent::BASIC_CONTROL, address, 0, speed, direction, speedSteps);
+}
+
+
+// Return a function group, functions are not returned for the consist address
+void DCCdecoder::ProcessFunctions(int address, byte functionGroup, byte functions, bool isConsist)
+{
+    if (IsEventEnabled(DCCEvent::FUNCTION) && !isConsist)
+        RaiseEvent(DCCEvent::FUNCTION, address, 0, 0, functionGroup, functions);
+}
 
 
 // Process an accessory broadcast packet
@@ -240,115 +698,121 @@ void DCCdecoder::ProcessAccBroadcastPacket()
     // basic acc packet
     if ((packet[1] & 0xF0) == 0x80)
     {
-        if (basicAccHandler)
-            basicAccHandler(0, 0, (packet[1] & 0x08)>>3, (packet[1] & 0x01));
+        if (IsEventEnabled(DCCEvent::BASIC_ACC))
+            RaiseEvent(DCCEvent::BASIC_ACC, 0, 0, 0, (packet[1] & 0x08)>>3, (packet[1] & 0x01));
         return;
     }
 
     // extended acc packet
     if ((packet[1] & 0xFF) == 0x07)
     {
-        if (extendedAccHandler)
-            extendedAccHandler(0, 0, packet[2] & 0x1F);
+        // the absolute stop aspect is an emergency stop for all accessories
+        if ((packet[2] & 0x1F) == 0) EmergencyStop();
+
+        if (IsEventEnabled(DCCEvent::EXTENDED_ACC))
+            RaiseEvent(DCCEvent::EXTENDED_ACC, 0, 0, 0, 0, packet[2] & 0x1F);
         return;
     }
 
     // we got here somehow with an incorrectly identified packet
-    if (decodingErrorHandler)
-        decodingErrorHandler(DCC_ERR_UNKNOWN_PACKET);
+    if (IsEventEnabled(DCCEvent::DECODING_ERROR))
+        RaiseErrorEvent(DCCEvent::DECODING_ERROR, DCC_ERR_UNKNOWN_PACKET);
 }
 
 
 // Process an accessory packet
 void DCCdecoder::ProcessAccPacket()
 {
-    // combine packet bytes for comparison against packet specs
-	const uint16_t comp = ((uint16_t)packet[1] << 8) | packet[2];
-
-    // loop through packet specs and check against current packet to identify it
-    byte i = 0;
-    bool packetIdentified = false;
-	while (i < numAccPacketTypes && !packetIdentified)
-	{
-		if ((comp & accPacketSpec[i].specMask) == accPacketSpec[i].specAns)
-			packetIdentified = true;
-		i++;
-	}
-
-    // assign the packet type we identified
-    AccPacketType accType;
-    if (packetIdentified)
+    // look up the packet type from the identifying bits of the first two data bytes. 3 byte packets
+    // have only a checksum in packet[2], so it is not used.
+    byte index = ((packet[1] & 0x80) >> 2) | ((packet[1] & 0x0C) << 1) | ((packet[1] & 0x01) << 2);
+    if (packetSize > 3)
     {
-        accType = accPacketSpec[i - 1].accPacketType;
+        if ((packet[2] & 0xF0) == 0xE0) index |= 0x02;
+        if ((packet[2] & 0xE0) == 0x00) index |= 0x01;
     }
-    else    // exit with error if we can't identify the packet
+    const byte accEntry = pgm_read_byte(&accPacketTypeTable[index]);
+    const AccPacketType accType = (AccPacketType)(accEntry & ACC_TYPE_MASK);
+
+    // exit with error if we can't identify the packet
+    if (accType == ACC_UNKNOWN)
     {
-        if (decodingErrorHandler)
-            decodingErrorHandler(DCC_ERR_UNKNOWN_PACKET);
+        if (IsEventEnabled(DCCEvent::DECODING_ERROR))
+            RaiseErrorEvent(DCCEvent::DECODING_ERROR, DCC_ERR_UNKNOWN_PACKET);
         return;
     }
 
-    // Ged board and output addresses
-    int hiAddr = (~packet[1] & 0x70) << 2;
-    int lowAddr = packet[0] & 0x3F;
-    int boardAddress = (hiAddr | lowAddr) - 1;
+    // check the address bits against our base address before decoding anything. board addressed
+    // packets carry no output pair bits, and match only if we are the first output on the board.
+    const byte addrMask = (accEntry & ACC_BOARD_ADDRESS) ? 0x70 : 0x76;
+    const boolean isPacketForBaseAddress = (packet[0] & 0x3F) == matchAddrLow && (packet[1] & addrMask) == matchAddrHigh;
+    if (!isPacketForBaseAddress && !addressRangeCount && !decoderSettings.returnAllPackets) return;
+
+    // Get board and output addresses
+    const int boardAddress = (((~packet[1] & 0x70) << 2) | (packet[0] & 0x3F)) - 1;
+    const int outputAddress = ((boardAddress << 2) | (packet[1] & addrMask & 0x06) >> 1) + 1;
+
+    // otherwise check the address table
+    if (!isPacketForBaseAddress && !decoderSettings.returnAllPackets && !IsAddressMatched(outputAddress)) return;
 
-    int outAddr = (packet[1] & 0x06) >> 1;
-    int outputAddress = ((boardAddress << 2) | outAddr) + 1;
-    if (accType == LEGACYPOM) outputAddress = (boardAddress << 2) + 1;
+    // the extended form of program on main (XPOM) is longer, with a 24 bit cv address and up to four
+    // data bytes, and is passed on for either type of accessory
+    if ((accType == BASICPOM || accType == EXTENDEDPOM) && packetSize > 6)
+    {
+        if (IsEventEnabled(DCCEvent::ACC_XPOM)) RaiseXpomEvent(DCCEvent::ACC_XPOM, outputAddress, 2);
+        return;
+    }
 
     // process the packet types
-    boolean isPacketForThisAddress = (outputAddress == decoderSettings.baseAddress);   // TODO: implememnt multiple address support
-    if (isPacketForThisAddress || decoderSettings.returnAllPackets)
+    switch (accType)
     {
-        switch (accType)
+    case BASIC:
+        if (IsEventEnabled(DCCEvent::BASIC_ACC))
+            // Raise basic acc event                             Activate bit     last data bit of packet 2
+            RaiseEvent(DCCEvent::BASIC_ACC, boardAddress, outputAddress, 0, (packet[1] & 0x08)>>3, (packet[1] & 0x01));
+        break;
+    case EXTENDED:
+        if (IsEventEnabled(DCCEvent::EXTENDED_ACC))
+            // Raise ext acc event                               data bits
+            RaiseEvent(DCCEvent::EXTENDED_ACC, boardAddress, outputAddress, 0, 0, packet[2] & 0x1F);
+        break;
+    case BASICPOM:
+        if (IsEventEnabled(DCCEvent::BASIC_ACC_POM))
         {
-        case BASIC:
-            if (basicAccHandler)
-                // Call BasicAccHandler                             Activate bit     last data bit of packet 2
-                basicAccHandler(boardAddress, outputAddress, (packet[1] & 0x08)>>3, (packet[1] & 0x01));
-            break;
-        case EXTENDED:
-            if (extendedAccHandler)
-                // Call ExtAccHandler                               data bits
-                extendedAccHandler(boardAddress, outputAddress, packet[2] & 0x1F);
-            break;
-        case BASICPOM:
-            if (basicAccPomHandler)
-            {
-                byte instType = (packet[2] & 0x0C)>>2;   // instruction type
-                int cv = ((packet[2] & 0x03) << 8) + packet[3] + 1;   // cv 10 bit address, add one for zero index
-                byte data = packet[4];
+            byte instType = (packet[2] & 0x0C)>>2;   // instruction type
+            int cv = ((packet[2] & 0x03) << 8) + packet[3] + 1;   // cv 10 bit address, add one for zero index
+            byte data = packet[4];
 
-                // Call Basic Acc Pom Handler
-                basicAccPomHandler(boardAddress, outputAddress, instType, cv, data);
-            }
-            break;
-        case EXTENDEDPOM:
-            if (extAccPomHandler)
-            {
-                byte instType = (packet[2] & 0x0C)>>2;   // instruction type
-                int cv = ((packet[2] & 0x03) << 8) + packet[3] + 1;   // cv 10 bit address, add one for zero index
-                byte data = packet[4];
+            // Raise basic acc pom event
+            RaiseEvent(DCCEvent::BASIC_ACC_POM, boardAddress, outputAddress, cv, instType, data);
+        }
+        break;
+    case EXTENDEDPOM:
+        if (IsEventEnabled(DCCEvent::EXTENDED_ACC_POM))
+        {
+            byte instType = (packet[2] & 0x0C)>>2;   // instruction type
+            int cv = ((packet[2] & 0x03) << 8) + packet[3] + 1;   // cv 10 bit address, add one for zero index
+            byte data = packet[4];
 
-                // Call Ext Acc Pom Handler
-                extAccPomHandler(boardAddress, outputAddress, instType, cv, data);
-            }
-            break;
-        case LEGACYPOM:
-            if (legacyAccPomHandler)
-            {
-                byte instType = 0;   // no instruction type for legacy packets
-                int cv = ((packet[1] & 0x03) << 8) + packet[2] + 1;   // cv 10 bit address, add one for zero index
-                byte data = packet[3];
+            // Raise ext acc pom event
+            RaiseEvent(DCCEvent::EXTENDED_ACC_POM, boardAddress, outputAddress, cv, instType, data);
+        }
+        break;
+    case LEGACYPOM:
+        if (IsEventEnabled(DCCEvent::LEGACY_ACC_POM))
+        {
+            byte instType = 0;   // no instruction type for legacy packets
+            int cv = ((packet[1] & 0x03) << 8) + packet[2] + 1;   // cv 10 bit address, add one for zero index
+            byte data = packet[3];
 
-                // Call Legacy Acc Pom Handler
-                legacyAccPomHandler(boardAddress, outputAddress, instType, cv, data);
-            }
-            break;
+            // Raise legacy acc pom event
+            RaiseEvent(DCCEvent::LEGACY_ACC_POM, boardAddress, outputAddress, cv, instType, data);
+        }
+        break;
 
-        }    // end switch
-    }     // end if
+    default:
+        break;
+    }    // end switch
 }
 
 
@@ -356,39 +820,109 @@ void DCCdecoder::BitStreamError(byte errorCode)
 {
 	bitErrorCount++;
 	lastBitError = errorCode;
-	if (bitstreamErrorHandler) bitstreamErrorHandler(errorCode);
+	if (packetSniffer) packetSniffer->RecordBitError(errorCode);
+	if (IsEventEnabled(DCCEvent::BITSTREAM_ERROR)) RaiseErrorEvent(DCCEvent::BITSTREAM_ERROR, errorCode);
 }
 
 void DCCdecoder::PacketError(byte errorCode)
 {
 	packetErrorCount++;
 	lastPacketError = errorCode;
-	if (packetErrorHandler) packetErrorHandler(errorCode);
+	if (packetSniffer) packetSniffer->RecordPacketError(errorCode);
+	if (IsEventEnabled(DCCEvent::PACKET_ERROR)) RaiseErrorEvent(DCCEvent::PACKET_ERROR, errorCode);
+}
+
+
+// Events  =====================================================================================
+
+// attach or detach the event queue. events are only raised while a queue is attached, and are passed
+// to the event methods of the handler given to DispatchEvents.
+void DCCdecoder::SetEventQueue(DCCEventQueue* queue)
+{
+	eventQueue = queue;
 }
 
+// enable the given events, for a handler bound by DispatchEvents(handler, maxEvents)
+void DCCdecoder::EnableEvents(uint32_t events)
+{
+	eventMask |= events;
+}
+
+// raise a decoded packet event
+void DCCdecoder::RaiseEvent(DCCEvent::EventType type, int address, int subAddress, int value, byte info, byte data)
+{
+	DCCEvent event;
+	event.type = type;
+	event.info = info;
+	event.data = data;
+	event.time = packetTime;
+	event.dcc.address = address;
+	event.dcc.subAddress = subAddress;
+	event.dcc.value = value;
+
+	if (eventQueue) eventQueue->Put(event);
+}
+
+// raise an idle or reset event, with a copy of the packet
+void DCCdecoder::RaisePacketEvent(DCCEvent::EventType type)
+{
+	DCCEvent event;
+	event.type = type;
+	event.info = 0;
+	event.data = (packetSize < sizeof(event.bytes)) ? packetSize : sizeof(event.bytes);
+	event.time = packetTime;
+	memcpy(event.bytes, packet, event.data);
+
+	if (eventQueue) eventQueue->Put(event);
+}
+
+// raise an extended program on main event, for the instruction at the given index of the packet. the
+// instruction is followed by three bytes of cv address, then the data bytes up to the error detection byte.
+void DCCdecoder::RaiseXpomEvent(DCCEvent::EventType type, int address, byte index)
+{
+	DCCEvent event;
+	event.type = type;
+	event.info = (packet[index] & 0x0C) >> 2;    // instruction type
+	event.data = packetSize - index - 5;         // number of data bytes
+	if (event.data > sizeof(event.xpom.values)) return;
+	event.time = packetTime;
+	event.xpom.address = address;
+	event.xpom.cvIndex = (packet[index + 1] << 8) + packet[index + 2];
+	event.xpom.cvOffset = packet[index + 3];
+	memcpy(event.xpom.values, &packet[index + 4], event.data);
+
+	if (eventQueue) eventQueue->Put(event);
+}
+
+// raise an error event
+void DCCdecoder::RaiseErrorEvent(DCCEvent::EventType type, byte errorCode)
+{
+	RaiseEvent(type, 0, 0, 0, errorCode, 0);
+}
 
 // wrappers for callbacks in bitstream and packet objects ===================================================
 
 // this is called from the bitstream capture when there are 32 bits to process.
-void DCCdecoder::WrapperBitStream(unsigned long incomingBits)
+void DCCdecoder::WrapperBitStream(void* context, unsigned long incomingBits)
 {
-	currentInstance->dccPacket.ProcessIncomingBits(incomingBits);
+	DCCdecoder* decoder = static_cast<DCCdecoder*>(context);
+	decoder->dccPacket.ProcessIncomingBits(incomingBits, decoder->bitStream.LastBitTime());
 }
 
-void DCCdecoder::WrapperBitStreamError(byte errorCode)
+void DCCdecoder::WrapperBitStreamError(void* context, byte errorCode)
 {
-	currentInstance->BitStreamError(errorCode);
+	static_cast<DCCdecoder*>(context)->BitStreamError(errorCode);
 }
 
 
 // this is called by the packet builder when a complete packet is ready, to kick off the actual decoding
-void DCCdecoder::WrapperDCCPacket(byte *packetData, byte size)
+void DCCdecoder::WrapperDCCPacket(void* context, const DCCpacket::PacketView& packetView)
 {
 	// kick off the packet processor
-	currentInstance->ProcessPacket(packetData, size);
+	static_cast<DCCdecoder*>(context)->ProcessPacket(packetView);
 }
 
-void DCCdecoder::WrapperDCCPacketError(byte errorCode)
+void DCCdecoder::WrapperDCCPacketError(void* context, byte errorCode)
 {
-	currentInstance->PacketError(errorCode);
+	static_cast<DCCdecoder*>(context)->PacketError(errorCode);
 }
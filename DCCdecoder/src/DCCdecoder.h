@@ -29,8 +29,8 @@ https://www.nmra.org/sites/default/files/s-9.2.1_2012_07.pdf
 Summary:
 
 This class decodes a DCC packet as described in the NMRA specs above. It determines the packet type,
-then processes it to extract the address and specific packet data. Callbacks are provided for each of
-the main packet types.
+then processes it to extract the address and specific packet data. An event is raised for each of
+the main packet types, and passed to the event methods of the calling library.
 
 Example Usage:
 
@@ -46,6 +46,9 @@ Example Usage:
 	DCCdecoder dcc { settings };
 
 	dcc.UpdateSettings(settings);          // configure the dcc decoder
+	dcc.SetAddressTable(ranges, 16);       // optionally hold the address ranges in a larger table
+	dcc.AddAddressRange(9, 16);            // also respond to outputs 9 through 16, returns
+	                                       // ADDRESS_TABLE_FULL if there is no room for the range
 
 Details:
 
@@ -53,32 +56,133 @@ The DCCdecoder class provides the overall management of the bitstream and packet
 bitstream object handles the raw bitstream capture, and provides data to the packet processor in 
 intervals. The packet processor performs validity checks and provides assembled packets to the
 deocder. The deocder then examines the packets to determine the packet type and its data. A decoder
-address may be configured and stored so that only relevant packets are returned in the callbacks.
+address may be configured and stored so that only relevant packets are returned in the events.
+Unless all packets are to be returned, the board address is also passed to the packet processor, so
+that loco packets and accessory packets for other boards are skipped before they are fully assembled.
 
 The ProcessTimeStamps() method should be called regularly to check for and process dcc timestamps in
 the queue. Packet decoding begins when the ProcessPacket is called with packet data. The packet is
 inspected to determine its type, after which specific methods are called to decode it accordingly.
+The packet is not copied - the decoder works directly on the packet builder's buffer via the packet
+view, which remains valid until processing of the packet is complete. The idle and reset events carry
+a copy of the packet bytes, which must not be retained after the event method returns.
 Each method gets the DCC address, packet data, and any other information from the packet, and then
-performs a callback to pass the decoded data back to the calling library. Packets to addresses other
-than the configured address are ignored by default. Broadcast packets are returned with a value of 0
+raises an event to pass the decoded data back to the calling library. During the event method, the
+PacketTime method provides the time (micros) of the end bit of the packet, so that the calling library
+can measure the latency from the DCC signal to its response. Packets to addresses other
+than the configured addresses are ignored by default. Broadcast packets are returned with a value of 0
 in the address field. Packet data is assumed to be a valid, checksummed packet, for example from the
 DCCpacket class.
 
-Idle, accessory, extended accessory, and broadcast packet types are supported. The basic packet type
-is determined by masking bits of the packet and conparing to the expected patterns as defined in the
-NMRA spec. Packet specs are ordered beginning with the most common, except where the expected bit
-patterns require a certain sequence. Decoding of the packet data is handled specifically for each
-packet type. Accessory packet types are further categorized in a similar manner. Basic and extended
+Idle, multifunction, accessory, extended accessory, and broadcast packet types are supported. The basic packet type
+is determined from the first byte of the packet with a single lookup in a 256 entry table, held in
+program memory. The table is built at compile time from the bit patterns defined in the NMRA spec,
+and may also be queried with ClassifyPacket. Decoding of the packet data is handled specifically for
+each packet type. Accessory packet types are further categorized with a second, smaller table keyed on
+the few bits that distinguish them. The address bits of accessory packets are compared with those of
+the configured address before the board and output addresses are decoded, so that packets for other
+addresses are discarded as early as possible. Basic and extended
 packets are supported, as are basic program on main, extended program on main, and legacy program on
 main.
 
-TODO: The library currently only implements placeholders for locomotive functionality.
+The extended form of configuration variable access (XPOM), for both locos and accessories, is told
+apart from the long form by its length. Its instruction 1110CCSS is followed by a 24 bit CV address
+and up to four data bytes, rather than a 10 bit CV address and one data byte. It is returned through
+the XPOM events with the instruction type, the upper 16 bits of the CV address as the index, which
+selects a page of CVs as CV31 and CV32 do, the lower 8 bits as the offset, and the data bytes. The
+sequence number SS is only used for RailCom replies, which are not supported, and is not returned.
+A loco XPOM instruction takes the rest of the packet.
+
+In addition to the base address, the decoder may respond to a set of other accessory output addresses.
+These are held in a table of address ranges, where a single address is a range of one. Ranges that
+overlap or adjoin are merged as they are added, so that a list of consecutive addresses takes a single
+entry, and one range may cover all 2044 addresses. The decoder has a table of four ranges, and a
+library that needs more, such as for a list of scattered outputs, gives it a larger table of its own
+with SetAddressTable. Adding a range returns ADDRESS_TABLE_FULL if it doesn't fit, leaving the table
+as it was, so the caller knows which addresses are not matched. The alternate addresses in the decoder
+settings are added to the table when the settings are updated, replacing any ranges already added. A
+packet for the base address is matched directly on the packet bits, otherwise the output address is
+checked against each range. The packet processor is passed the span of board addresses covering the
+base address and all ranges, so that most packets for other boards are still skipped during assembly.
+
+Each decoded packet or error is raised as an event, and stored in the DCCEventQueue attached with
+SetEventQueue. The calling library binds its event methods at compile time. It derives from
+DCCEventHandler, declares DCCdecoder as a friend, and defines the event methods it needs, hiding the
+empty defaults. It enables those events with EnableEvents, attaches an event queue, and passes itself
+to the DispatchEvents template from its Update method:
+
+	dcc.EnableEvents(DCCEvent::Bit(DCCEvent::BASIC_ACC) | DCCEvent::Bit(DCCEvent::BASIC_ACC_POM));
+	dcc.SetEventQueue(&dccEvents);
+	dcc.DispatchEvents(*this, 2);           // calls this->DCCBasicAccEvent(...) etc.
+
+DispatchEvents calls the event methods for at most the given number of queued events, so that a slow
+event method doesn't delay the processing of the timestamp queue. The methods are called directly,
+and may be inlined into the dispatch, so there is no function pointer to set or to check, and an event
+without a method of its own goes to the empty default. Events are only raised once they are enabled
+and a queue is attached, so that unused events take no space in the queue. The packet time and speed
+steps are stored with each event, and are available as usual during the event method.
+
+The decoder passes itself as the context for the callbacks from its bitstream and packet objects, so
+that any number of decoders may exist, each with its own pipeline. Only the most recently resumed
+decoder receives the timestamps from the capture hardware.
+
+A PacketSniffer may be attached with SetPacketSniffer, in which case every packet and error is also
+streamed to it as a binary record. While the sniffer is attached, the address and repeat filters in the
+packet processor are disabled so that all traffic is captured, and the sniffer output is serviced each
+time ProcessTimeStamps is called.
+
+Multifunction (loco) packets are decoded once a loco address is set with SetLocoAddress. Addresses up
+to 127 are taken as short addresses, and higher addresses as long addresses. A consist address may
+also be set in the CV19 format, in which case speed and direction instructions sent to the consist
+address are also returned, with the direction reversed if bit 7 is set. Function instructions sent
+to the consist address are not returned. The instructions in the packet are processed in turn, each
+one identified by its top three bits, until the end of the packet or an unsupported instruction.
+
+Speed and direction are returned through the basic control event, with the speed as a step
+number from 1 up to the number of speed steps, 0 to stop, or -1 for an emergency stop. The number of
+speed steps (14, 28, or 128) is available from SpeedSteps during the event. The basic speed
+instruction is decoded in 28 step mode by default, with a lookup table. In 14 step mode the headlight
+bit of the basic speed instruction is not returned. Functions F0 to F28 are returned in groups
+through the function event, with the group given by the number of its first function, and one bit
+per function starting with the first in bit 0. Consist control instructions are returned through the
+consist event, and long form configuration variable access (program on main) instructions through
+the loco POM event, or the loco XPOM event for the extended form. The short form of configuration variable access is not supported.
+
+Resets and emergency stops take a separate path, so that a layout wide stop reaches the calling library
+as quickly as possible. A broadcast reset, a broadcast emergency stop in any of the speed formats, and
+the absolute stop aspect broadcast to all extended accessories are passed straight to the emergency stop
+handler, from within the packet processing, rather than being raised as events. The packet processor
+does not filter these as repeats. The handler is given a context pointer, typically the calling library
+instance, and PacketTime is available during the handler for measuring the reaction time. A reset
+event is still raised afterwards as usual.
+
+Service mode (programming track) packets are told apart from packets on the main by their preamble,
+which is at least 20 bits long on the programming track. Once the service mode event is enabled, a reset
+packet with a long preamble enters service mode, and any packet with a normal preamble leaves it.
+While in service mode the packet builder passes all packets, and everything other than service mode
+instructions, resets, and idles is ignored. The reset that enters service mode is passed to the
+emergency stop handler as on the main, but the resets sent around each instruction are not, since the
+ack output may be the one the handler turns off. An instruction is acted on when the same packet has been
+received twice in a row, and only once however many times it is then repeated. Direct mode byte
+verify, byte write, and bit manipulation instructions are returned through the service mode event
+with their CV number. Paged and physical register instructions are translated to the same verify
+and write instructions, using the page register for registers 1-4, and CV29, CV7, and CV8 for
+registers 5, 7, and 8. The page register itself is held in the decoder. Address only mode is not
+supported.
+
+The service mode event method returns true to acknowledge the instruction, for a verify that matches or
+a completed write. The acknowledgement is a 6ms pulse on the output set with SetAckOutput, which
+must draw at least 60mA from the track, for example by powering the servos. The pulse is ended
+from ProcessTimeStamps rather than waited for, so ProcessTimeStamps must be called at least every
+millisecond or so while in service mode to keep the pulse near its nominal length.
 
 */
 
 
 #include "Bitstream.h"
 #include "DCCpacket.h"
+#include "PacketSniffer.h"
+#include "DCCEventQueue.h"
 
 
 #ifndef _DCCDECODER_h
@@ -94,52 +198,110 @@ TODO: The library currently only implements placeholders for locomotive function
 class DCCdecoder
 {
 public:
-	// callback function typedefs
-	typedef void(*IdleResetHandler)(byte byteCount, byte* packetBytes);
-	typedef void(*BasicControlHandler)(int address, int speed, int direction);
-	typedef void(*BasicAccHandler)(int boardAddress, int outputAddress, byte activate, byte data);
-	typedef void(*ExtendedAccHandler)(int boardAddress, int outputAddress, byte data);
-	typedef void(*AccPomHandler)(int boardAddress, int outputAddress, byte instructionType, int cv, byte data);
-
-	typedef void(*BitstreamErrorHandler)(byte ErrorCode);
-	typedef void(*PacketErrorHandler)(byte ErrorCode);
-	typedef void(*DecodingErrorHandler)(byte ErrorCode);
+	// called immediately on a reset or emergency stop, with the context given when it was set
+	typedef void(*EmergencyStopHandler)(void* context);
 
 	// Basic decoder setup
 	struct DecoderSettings
 	{
 		uint16_t baseAddress;
-		byte altAddresses;
-		uint16_t altAddress[2];    // TODO: implement multiple decoder addresses
+		byte altAddresses;         // number of alternate addresses in use
+		uint16_t altAddress[2];    // alternate accessory output addresses
 		bool returnAllPackets;
 	};
 
+	// DCC packet types
+	enum PacketType : byte
+	{
+		IDLEPKT,
+		BROADCAST,
+		LOCO_SHORT,
+		LOCO_LONG,
+		ACCBROADCAST,
+		ACCESSORY,
+	};
+
+	// classify a packet by its first byte
+	static PacketType ClassifyPacket(byte firstByte);
+
+	// loco function groups, the value is the number of the first function in the group
+	enum FunctionGroup : byte
+	{
+		FN_0_4 = 0,
+		FN_5_8 = 5,
+		FN_9_12 = 9,
+		FN_13_20 = 13,
+		FN_21_28 = 21,
+	};
+
+	// loco speed values passed to the control handler, in addition to the speed step
+	enum LocoSpeed : int
+	{
+		SPEED_STOP = 0,
+		SPEED_ESTOP = -1,
+	};
+
 	DCCdecoder();
 	explicit DCCdecoder(DecoderSettings settings);
 	bool SetAddress(uint16_t address);
 	bool UpdateSettings(DecoderSettings settings);
 
+	// a range of additional accessory output addresses
+	struct AddressRange
+	{
+		uint16_t first;
+		uint16_t last;
+	};
+
+	// result of adding an address or range to the address table
+	enum AddressResult : byte
+	{
+		ADDRESS_ADDED = 0,
+		ADDRESS_INVALID,            // not an output address, or the range is reversed
+		ADDRESS_TABLE_FULL,         // no room for another range, the table is unchanged
+	};
+
+	// respond to additional accessory output addresses, held in the built in table or one given by the caller
+	bool SetAddressTable(AddressRange* table, byte size);
+	AddressResult AddAddress(uint16_t address);
+	AddressResult AddAddressRange(uint16_t firstAddress, uint16_t lastAddress);
+	void ClearAddresses();
+	bool IsAddressMatched(uint16_t outputAddress);
+
+	// loco (multifunction) decoding, the loco address is 0 to disable, addresses over 127 are long
+	void SetLocoAddress(uint16_t address);
+	void SetConsistAddress(byte address);    // CV19 format, bit 7 set for reversed direction, 0 to disable
+	void SetSpeedSteps(byte steps);          // 14 or 28, for the basic speed and direction instruction
+
 	// decoder and bitstream control
 	void ProcessTimeStamps();          // call this regularly for the bitstream object to check
 									   // and process dcc timestamps in the queue
 	void SuspendBitstream();
 	void ResumeBitstream();
 
-	// set packet and other event handlers
-	void SetIdlePacketHandler(IdleResetHandler handler);
-	void SetResetPacketHandler(IdleResetHandler handler);
-	void SetBaselineControlPacketHandler(BasicControlHandler handler);
-	void SetBasicAccessoryDecoderPacketHandler(BasicAccHandler handler);
-	void SetBasicAccessoryPomPacketHandler(AccPomHandler handler);
-	void SetExtendedAccessoryDecoderPacketHandler(ExtendedAccHandler handler);
-	void SetExtendedAccessoryPomPacketHandler(AccPomHandler handler);
-	void SetLegacyAccessoryPomPacketHandler(AccPomHandler handler);
-
-	void SetBitstreamErrorHandler(BitstreamErrorHandler handler);
-	void SetBitstreamMaxErrorHandler(BitstreamErrorHandler handler);
-	void SetPacketErrorHandler(PacketErrorHandler handler);
-	void SetPacketMaxErrorHandler(PacketErrorHandler handler);
-	void SetDecodingErrorHandler(DecodingErrorHandler handler);
+	// time (micros) of the end bit of the packet being processed, valid during packet callbacks, 0 if not known
+	unsigned long PacketTime();
+
+	// speed steps (14, 28, or 128) of the speed being processed, valid during the control callback
+	byte SpeedSteps();
+
+	// service mode acknowledgement, pulsing an output that draws at least 60 mA
+	void SetAckOutput(byte pin);
+	void Acknowledge();
+	bool IsServiceMode();
+
+	// stream all packets and errors to a packet sniffer (0 to disable)
+	void SetPacketSniffer(PacketSniffer* sniffer);
+
+	// queue the enabled events, for dispatch from the main loop (0 to disable)
+	void SetEventQueue(DCCEventQueue* queue);
+
+	// dispatch queued events to the event methods of a handler derived from DCCEventHandler
+	void EnableEvents(uint32_t events);
+	template <class Handler> byte DispatchEvents(Handler& handler, byte maxEvents);
+
+	// called immediately on a reset or emergency stop, bypassing the event queue
+	void SetEmergencyStopHandler(EmergencyStopHandler handler, void* context = 0);
 
 private:
 
@@ -148,7 +310,10 @@ private:
 	{
 		DCC_ERR_UNKNOWN_PACKET = 101,    // DCC_Decoder results/errors
 		PACKET_LEN_MIN = 3,              // Min and max valid packet lengths
-		PACKET_LEN_MAX = 6,
+		PACKET_LEN_MAX = 11,
+		MAX_ADDRESS = 2044,              // highest accessory output address
+		SERVICE_PREAMBLE_MIN = 20,       // min preamble bits of service mode packets
+		ACK_DURATION = 6000,             // service mode ack pulse (micros)
 	};
 
 	DecoderSettings decoderSettings =
@@ -159,38 +324,23 @@ private:
 		false,   // return all packets
 	};
 
-	// DCC packet types and identifying specs
-	enum PacketType : byte
-	{
-		IDLEPKT,
-		BROADCAST,
-		LOCO_SHORT,
-		LOCO_LONG,
-		ACCBROADCAST,
-		ACCESSORY,
-	};
-
-	struct PacketSpec
-	{
-		PacketType packetType;
-		byte specMask;
-		byte specAns;
-	};
+	// Packet type lookup, indexed by the first byte of the packet. The table is generated at compile
+	// time from PacketTypeOf, and is stored in program memory.
+	static const byte packetTypeTable[256];
 
-	// Order these starting with the expected most common packet types, but note dependencies
-	const PacketSpec packetSpec[6] =
+	// The conditions are mutually exclusive, so unlike a list of masks they do not depend on ordering
+	static constexpr PacketType PacketTypeOf(byte b)
 	{
-		{ IDLEPKT,       0xFF, 0xFF  },     // 11111111
-		{ LOCO_LONG,     0xC0, 0xC0  },     // 11AAAAAA    must follow IDLEPKT
-		{ ACCBROADCAST,  0xFF, 0xBF  },     // 10111111
-		{ ACCESSORY,     0xC0, 0x80  },     // 10AAAAAA    must follow ACCBROADCAST
-		{ BROADCAST,     0xFF, 0x00  },     // 00000000
-		{ LOCO_SHORT,    0x80, 0x00  },     // 0AAAAAAA    must follow BROADCAST
-	};
-
-	enum : byte { numPacketTypes = sizeof(packetSpec) / sizeof(PacketSpec) };
-
-	// accessory packet types and specs
+		return
+			(b == 0xFF)                        ? IDLEPKT :          // 11111111
+			((b & 0xC0) == 0xC0)               ? LOCO_LONG :        // 11AAAAAA    except 11111111
+			(b == 0xBF)                        ? ACCBROADCAST :     // 10111111
+			((b & 0xC0) == 0x80)               ? ACCESSORY :        // 10AAAAAA    except 10111111
+			(b == 0x00)                        ? BROADCAST :        // 00000000
+			                                     LOCO_SHORT;        // 0AAAAAAA    except 00000000
+	}
+
+	// accessory packet types
 	enum AccPacketType : byte
 	{
 		BASIC,
@@ -198,26 +348,31 @@ private:
 		EXTENDED,
 		EXTENDEDPOM,
 		LEGACYPOM,
+		ACC_UNKNOWN,
+		ACC_TYPE_MASK = 0x07,
+		ACC_BOARD_ADDRESS = 0x80,     // flag, the packet carries a board address only (no output pair bits)
 	};
 
-	struct AccPacketSpec
+	// Accessory packet type lookup, indexed by the bits that distinguish the types:
+	//
+	//   bit 5   packet[1] bit 7    1 = basic, 0 = extended or legacy
+	//   bit 4   packet[1] bit 3    extended = 0, legacy = 1
+	//   bit 3   packet[1] bit 2    legacy = 1
+	//   bit 2   packet[1] bit 0    extended = 1
+	//   bit 1   packet[2] = 1110xxxx, program on main instruction
+	//   bit 0   packet[2] = 000xxxxx, extended aspect data
+	//
+	// Each entry holds the accessory packet type and the address decoding flag, in program memory.
+	static const byte accPacketTypeTable[64];
+
+	static constexpr byte AccPacketTypeOf(byte i)
 	{
-		AccPacketType accPacketType;
-		uint16_t specMask;
-		uint16_t specAns;
-	};
-
-	// Order these starting with the expected most common packet types, but note dependencies
-	const AccPacketSpec accPacketSpec[5] =
-	{
-		{ BASICPOM,    (0x80U << 8) + 0xF0, (0x80U << 8) + 0xE0 },
-		{ BASIC,       (0x80U << 8) + 0x00, (0x80U << 8) + 0x00 },   // must follow BASICPOM
-		{ EXTENDEDPOM, (0x89U << 8) + 0xF0, (0x01U << 8) + 0xE0 },
-		{ EXTENDED,    (0x89U << 8) + 0xE0, (0x01U << 8) + 0x00 },   // must follow EXTENDEDPOM
-		{ LEGACYPOM,   (0x8CU << 8) + 0x00, (0x0CU << 8) + 0x00 },
-	};
-
-	enum : byte { numAccPacketTypes = sizeof(accPacketSpec) / sizeof(AccPacketSpec) };
+		return
+			(i & 0x20)                      ? ((i & 0x02) ? BASICPOM : BASIC) :
+			((i & 0x14) == 0x04)            ? ((i & 0x02) ? EXTENDEDPOM : (i & 0x01) ? EXTENDED : ACC_UNKNOWN) :
+			((i & 0x18) == 0x18)            ? (LEGACYPOM | ACC_BOARD_ADDRESS) :
+			                                  ACC_UNKNOWN;
+	}
 
 	// DCC bitstream and packet processors
 	BitStream bitStream;
@@ -232,13 +387,51 @@ private:
 		maxPacketErrors = 10,     // number of packet errors before bitstream reset
 	};
 	unsigned long lastMillis = 0;         // for tracking refresh interval for error counts
+	PacketSniffer* packetSniffer = 0;     // optional sniffer for streaming all packets and errors
+	DCCEventQueue* eventQueue = 0;        // queue for events, dispatched by DispatchEvents
+	uint32_t eventMask = 0;               // events to be raised, one bit per event type
+
+	// our base address, as encoded in accessory packets, for matching before the addresses are decoded
+	byte matchAddrLow = 0;                // packet[0] & 0x3F
+	byte matchAddrHigh = 0;               // packet[1] & 0x76
+
+	// additional accessory output addresses, in the built in table unless one is given by the caller
+	enum : byte { defaultAddressRanges = 4 };
+	AddressRange defaultRanges[defaultAddressRanges];
+	AddressRange* addressRanges = defaultRanges;
+	byte maxAddressRanges = defaultAddressRanges;
+	byte addressRangeCount = 0;
+
+	// loco addresses and speed step mode
+	uint16_t locoAddress = 0;             // 0 if loco packets are not decoded
+	byte consistAddress = 0;              // CV19 format
+	bool speedSteps28 = true;             // 28 or 14 speed steps for the basic speed instruction
+	byte speedSteps = 28;                 // speed steps of the current speed instruction
+
+	// service mode, entered on a reset packet with a long preamble
+	bool serviceMode = false;
+	byte servicePacket[4];                // the last service mode packet, acted on when it is repeated
+	byte servicePacketSize = 0;
+	byte serviceRepeats = 0;              // number of times in a row the service mode packet has been received
+	byte servicePage = 1;                 // paged mode page register
+	enum : byte { noAckPin = 255 };
+	byte ackPin = noAckPin;               // output pulsed to acknowledge a service mode instruction
+	bool ackPinState = LOW;               // state of the ack output before the pulse
+	bool ackActive = false;
+	unsigned long ackStart = 0;           // time (micros) the ack pulse began
+
+	// speed step lookup for the basic speed instruction in 28 step mode, indexed by SSSSC, the four
+	// speed bits followed by the intermediate speed bit. 0 = stop, -1 = emergency stop.
+	static const int8_t speedTable28[32];
 
 	// process an incoming packet
-	void ProcessPacket(byte *packetData, byte packetSize);
+	void ProcessPacket(const DCCpacket::PacketView& packetView);
+	void UpdateAddressFilter();
 
-	// packet vars
-	byte packet[PACKET_LEN_MAX];          // the packet bytes
+	// packet vars, these refer to the packet builder's buffer, and are only valid while processing a packet
+	const byte* packet = 0;                // the packet bytes
 	byte packetSize = 0;                   // the current packet size
+	unsigned long packetTime = 0;          // time of the packet end bit
 	PacketType packetType = IDLEPKT;        // the packet type
 	byte lastBitError;
 	byte lastPacketError;
@@ -248,37 +441,109 @@ private:
 	void ProcessBroadcastPacket();
 	void ProcessShortLocoPacket();
 	void ProcessLongLocoPacket();
+	void ProcessLocoInstructions(byte index, int address, bool isConsist);
+	byte ProcessLocoInstruction(byte index, int address, bool isConsist);
+	void ProcessSpeed(int address, int speed, byte direction, bool isConsist);
+	void ProcessFunctions(int address, byte functionGroup, byte functions, bool isConsist);
 	void ProcessAccBroadcastPacket();
 	void ProcessAccPacket();
-
-	// Function pointers for the library callbacks
-	IdleResetHandler idleHandler = 0;
-	IdleResetHandler resetHandler = 0;
-	BasicAccHandler	basicAccHandler = 0;
-	AccPomHandler basicAccPomHandler = 0;
-	ExtendedAccHandler extendedAccHandler = 0;
-	AccPomHandler extAccPomHandler = 0;
-	AccPomHandler legacyAccPomHandler = 0;
-	BasicControlHandler basicControlHandler = 0;
-
-	BitstreamErrorHandler bitstreamErrorHandler = 0;
-	BitstreamErrorHandler bitstreamMaxErrorHandler = 0;
-	PacketErrorHandler packetErrorHandler = 0;
-	PacketErrorHandler packetMaxErrorHandler = 0;
-	DecodingErrorHandler decodingErrorHandler = 0;
+	bool ProcessServicePacket();
+	void ProcessServiceInstruction();
+	void SetServiceMode(bool enable);
+	void UpdateAck();
+	void EmergencyStop();
+
+	// emergency stop handler, and its context
+	EmergencyStopHandler emergencyStopHandler = 0;
+	void* emergencyStopContext = 0;
+
+	// raise events into the event queue
+	void RaiseEvent(DCCEvent::EventType type, int address, int subAddress, int value, byte info, byte data);
+	void RaisePacketEvent(DCCEvent::EventType type);
+	void RaiseXpomEvent(DCCEvent::EventType type, int address, byte index);
+	void RaiseErrorEvent(DCCEvent::EventType type, byte errorCode);
+	bool IsEventEnabled(DCCEvent::EventType type) { return (eventMask & DCCEvent::Bit(type)) != 0; }
 
 	// error handling for bitstream and packet processing
 	void BitStreamError(byte errorCode);
 	void PacketError(byte errorCode);
 
-	// pointer to allow us to access member objects from callbacks
-	static DCCdecoder* currentInstance;
+	// callbacks for bitstream and packet builder, with the decoder instance as the context
+	static void WrapperBitStream(void* context, unsigned long incomingBits);
+	static void WrapperBitStreamError(void* context, byte errorCode);
+	static void WrapperDCCPacket(void* context, const DCCpacket::PacketView& packetView);
+	static void WrapperDCCPacketError(void* context, byte errorCode);
+};
+
 
-	// callbacks for bitstream and packet builder
-	static void WrapperBitStream(unsigned long incomingBits);
-	static void WrapperBitStreamError(byte errorCode);
-	static void WrapperDCCPacket(byte *packetData, byte size);
-	static void WrapperDCCPacketError(byte errorCode);
+// default event methods for a handler bound at compile time. a handler hides the methods for the events it uses.
+class DCCEventHandler
+{
+public:
+	void DCCIdleEvent(byte byteCount, const byte* packetBytes) {}
+	void DCCResetEvent(byte byteCount, const byte* packetBytes) {}
+	void DCCBasicControlEvent(int address, int speed, int direction) {}
+	void DCCFunctionEvent(int address, byte functionGroup, byte functions) {}
+	void DCCConsistEvent(int address, byte consistAddress, byte direction) {}
+	void DCCLocoPomEvent(int address, byte instructionType, int cv, byte data) {}
+	void DCCLocoXpomEvent(int address, byte instructionType, uint16_t cvIndex, byte cvOffset, const byte* data, byte count) {}
+	void DCCBasicAccEvent(int boardAddress, int outputAddress, byte activate, byte data) {}
+	void DCCBasicAccPomEvent(int boardAddress, int outputAddress, byte instructionType, int cv, byte data) {}
+	void DCCExtendedAccEvent(int boardAddress, int outputAddress, byte data) {}
+	void DCCExtendedAccPomEvent(int boardAddress, int outputAddress, byte instructionType, int cv, byte data) {}
+	void DCCLegacyAccPomEvent(int boardAddress, int outputAddress, byte instructionType, int cv, byte data) {}
+	void DCCAccXpomEvent(int outputAddress, byte instructionType, uint16_t cvIndex, byte cvOffset, const byte* data, byte count) {}
+	bool DCCServiceModeEvent(byte instructionType, int cv, byte data) { return false; }
+	void DCCBitstreamErrorEvent(byte errorCode) {}
+	void DCCBitstreamMaxErrorEvent(byte errorCode) {}
+	void DCCPacketErrorEvent(byte errorCode) {}
+	void DCCPacketMaxErrorEvent(byte errorCode) {}
+	void DCCDecodingErrorEvent(byte errorCode) {}
 };
 
+
+// pass up to the given number of queued events to the event methods of the handler, returns the number dispatched
+template <class Handler>
+byte DCCdecoder::DispatchEvents(Handler& handler, byte maxEvents)
+{
+	if (!eventQueue) return 0;
+
+	DCCEvent event;
+	byte count = 0;
+	while (count < maxEvents && eventQueue->Get(event))
+	{
+		// restore the packet state that is available to the handlers
+		packetTime = event.time;
+
+		switch (event.type)
+		{
+		case DCCEvent::IDLE: handler.DCCIdleEvent(event.data, event.bytes); break;
+		case DCCEvent::RESET: handler.DCCResetEvent(event.data, event.bytes); break;
+		case DCCEvent::BASIC_CONTROL:
+			speedSteps = event.data;
+			handler.DCCBasicControlEvent(event.dcc.address, event.dcc.value, event.info);
+			break;
+		case DCCEvent::FUNCTION: handler.DCCFunctionEvent(event.dcc.address, event.info, event.data); break;
+		case DCCEvent::CONSIST: handler.DCCConsistEvent(event.dcc.address, event.data, event.info); break;
+		case DCCEvent::LOCO_POM: handler.DCCLocoPomEvent(event.dcc.address, event.info, event.dcc.value, event.data); break;
+		case DCCEvent::LOCO_XPOM: handler.DCCLocoXpomEvent(event.xpom.address, event.info, event.xpom.cvIndex, event.xpom.cvOffset, event.xpom.values, event.data); break;
+		case DCCEvent::BASIC_ACC: handler.DCCBasicAccEvent(event.dcc.address, event.dcc.subAddress, event.info, event.data); break;
+		case DCCEvent::BASIC_ACC_POM: handler.DCCBasicAccPomEvent(event.dcc.address, event.dcc.subAddress, event.info, event.dcc.value, event.data); break;
+		case DCCEvent::EXTENDED_ACC: handler.DCCExtendedAccEvent(event.dcc.address, event.dcc.subAddress, event.data); break;
+		case DCCEvent::EXTENDED_ACC_POM: handler.DCCExtendedAccPomEvent(event.dcc.address, event.dcc.subAddress, event.info, event.dcc.value, event.data); break;
+		case DCCEvent::LEGACY_ACC_POM: handler.DCCLegacyAccPomEvent(event.dcc.address, event.dcc.subAddress, event.info, event.dcc.value, event.data); break;
+		case DCCEvent::ACC_XPOM: handler.DCCAccXpomEvent(event.xpom.address, event.info, event.xpom.cvIndex, event.xpom.cvOffset, event.xpom.values, event.data); break;
+		case DCCEvent::SERVICE_MODE: if (handler.DCCServiceModeEvent(event.info, event.dcc.value, event.data)) Acknowledge(); break;
+		case DCCEvent::BITSTREAM_ERROR: handler.DCCBitstreamErrorEvent(event.info); break;
+		case DCCEvent::BITSTREAM_MAX_ERROR: handler.DCCBitstreamMaxErrorEvent(event.info); break;
+		case DCCEvent::PACKET_ERROR: handler.DCCPacketErrorEvent(event.info); break;
+		case DCCEvent::PACKET_MAX_ERROR: handler.DCCPacketMaxErrorEvent(event.info); break;
+		case DCCEvent::DECODING_ERROR: handler.DCCDecodingErrorEvent(event.info); break;
+		}
+		count++;
+	}
+
+	return count;
+}
+
 #endif
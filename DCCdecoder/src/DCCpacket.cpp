@@ -38,15 +38,17 @@ DCCpacket::DCCpacket(bool EnableChecksum, bool FilterRepeats, unsigned int Filte
 }
 
 
-void DCCpacket::SetPacketCompleteHandler(PacketCompleteHandler Handler)
+void DCCpacket::SetPacketCompleteHandler(PacketCompleteHandler Handler, void* Context)
 {
     packetCompleteHandler = Handler;
+    completeContext = Context;
 }
 
 
-void DCCpacket::SetPacketErrorHandler(PacketErrorHandler Handler)
+void DCCpacket::SetPacketErrorHandler(PacketErrorHandler Handler, void* Context)
 {
     packetErrorHandler = Handler;
+    errorContext = Context;
 }
 
 
@@ -62,20 +64,69 @@ void DCCpacket::FilterRepeatPackets(bool Filter)
 }
 
 
-// process an incoming sequence of 32 bits, stored in an unsigned long
-void DCCpacket::ProcessIncomingBits(unsigned long incomingBits)
+// set the accessory board address (9 bits, as encoded in the packet) used for early rejection of packets
+void DCCpacket::FilterAddresses(bool Filter, uint16_t BoardAddress)
+{
+    FilterAddresses(Filter, BoardAddress, BoardAddress);
+}
+
+
+// set a range of accessory board addresses (9 bits, as encoded in the packet) used for early rejection of packets
+void DCCpacket::FilterAddresses(bool Filter, uint16_t FirstBoardAddress, uint16_t LastBoardAddress)
+{
+    filterAddresses = Filter;
+    filterAddrFirst = FirstBoardAddress;
+    filterAddrLast = LastBoardAddress;
+    filterAddrLowBits = (FirstBoardAddress >> 6) == (LastBoardAddress >> 6);    // same 10AAAAAA block
+}
+
+
+// set the loco and consist addresses accepted by the address filter, 0 to reject all loco packets
+void DCCpacket::FilterLocoAddresses(uint16_t LocoAddress, bool LongAddress, byte ConsistAddress)
+{
+    filterLocoLong = LongAddress && LocoAddress;
+    filterLocoFirst = filterLocoLong ? (0xC0 | (LocoAddress >> 8)) : LocoAddress;    // 11AAAAAA or 0AAAAAAA
+    filterLocoSecond = LocoAddress & 0xFF;
+    filterConsistAddress = ConsistAddress;
+}
+
+
+// pass all packets while in service mode, since service mode instructions are not addressed, and are
+// only acted on when repeated
+void DCCpacket::SetServiceMode(bool ServiceMode)
+{
+    serviceMode = ServiceMode;
+}
+
+
+// process an incoming sequence of 32 bits, stored in an unsigned long, optionally with the time of the last bit
+void DCCpacket::ProcessIncomingBits(unsigned long incomingBits, unsigned long BitTime)
 {
     // We get a new set of bits from the DCC bitstream about every 5ms.
     // It takes approx 120-140 us to process a set of bits, excluding callbacks and repeat filtering,
     // or 150-250 us with repeat filtering enabled.
 
     dataBits = incomingBits;
+    bitTime = BitTime;
 
-    // process each bit in turn
-    for (unsigned long mask = 0x80000000; mask; mask >>=1)
+    // process each bit in turn, consuming bits from the top of dataBits
+    bitsLeft = 32;
+    while (bitsLeft)
     {
+        // at the start of a data byte with a full byte left in the input, extract the whole byte at once
+        if (state == READPACKET && packetMask == 0x80 && bitsLeft >= 8)
+        {
+            packet[packetIndex] = dataBits >> 24;
+            packetMask = 0;
+            dataBits <<= 8;
+            bitsLeft -= 8;
+            continue;
+        }
+
         // get the current bit
-        currentBit = (dataBits & mask) ? 1 : 0;
+        currentBit = (dataBits & 0x80000000) ? 1 : 0;
+        dataBits <<= 1;
+        bitsLeft--;
 
         // process depending on the state we're in
         switch (state)
@@ -96,13 +147,14 @@ void DCCpacket::ReadPreamble()
 {
     if (currentBit == 1)     // if it's a 1, bump our count of consecutive 1's
     {
-        preambleBitCount++;
+        if (preambleBitCount < 255) preambleBitCount++;
     }
     else                     // if it's a 0...
     {
         if (preambleBitCount >= PREAMBLE_MIN)   // we have the minimum number of 1's plus the trailing zero
         {
             state = READPACKET;                 // begin reading the packet
+            packetPreamble = preambleBitCount;
             preambleBitCount = 0;
         }
         else
@@ -119,8 +171,9 @@ void DCCpacket::ReadPacket()
     // assemble eight bits, decrementing the packet mask each time
     if (packetMask)
     {
-        if (currentBit == 1)    // write the current bit
-            packet[packetIndex] |= packetMask;
+        // shift in the current bit. after eight bits, any stale data from a previous packet is gone,
+        // so the packet bytes never need to be cleared
+        packet[packetIndex] = (packet[packetIndex] << 1) | currentBit;
 
         packetMask >>= 1;      // advance the packet mask
     }
@@ -139,22 +192,32 @@ void DCCpacket::ReadPacket()
             }
             else   // packet ended on a 1 but is incorrect length
             {
-                if (packetErrorHandler && (packetIndex < PACKET_LEN_MIN)) packetErrorHandler (ERR_PACKET_TOO_SHORT);
-                if (packetErrorHandler && (packetIndex > PACKET_LEN_MIN)) packetErrorHandler (ERR_PACKET_TOO_LONG);
+                if (packetErrorHandler && (packetIndex < PACKET_LEN_MIN)) packetErrorHandler(errorContext, ERR_PACKET_TOO_SHORT);
+                if (packetErrorHandler && (packetIndex > PACKET_LEN_MIN)) packetErrorHandler(errorContext, ERR_PACKET_TOO_LONG);
                 Reset();
             }
         }
         else   // zero bit indicates more data
         {
+            // fold the completed byte into the running checksum
+            checksum ^= packet[packetIndex];
+
             // advance to the next packet and reset the mask
             packetIndex++;
             packetMask = 0x80;
 
+            // check the address as soon as we have enough of it, and skip the rest of the packet if not ours
+            if (filterAddresses && !serviceMode && packetIndex <= 2 && IsAddressRejected())
+            {
+                Reset();
+                return;
+            }
+
             // if packet index is too high, reset
             if (packetIndex > PACKET_LEN_MAX)
             {
                 if (packetErrorHandler)
-                    packetErrorHandler(ERR_PACKET_TOO_LONG);
+                    packetErrorHandler(errorContext, ERR_PACKET_TOO_LONG);
                 Reset();
             }
         }
@@ -169,30 +232,29 @@ void DCCpacket::Execute()
     // initialize as true so we can just skip checksum if disabled
     bool checksumOk = true;
 
-    // verify checksum if enabled
+    // verify checksum if enabled. the xor of the address and instruction bytes has been
+    // accumulated as each byte completed, so we only need to compare it to the last byte.
     if (enableChecksum)
-    {
-        byte errorDectection = packet[0] ^ packet[1];             // initial xor of address and 1st instruction byte
-        for (int i = 2; i < packetIndex; i++) 
-            errorDectection ^= packet[i];                         // xor additional instruction bytes
-        checksumOk = (errorDectection == packet[packetIndex]);
-    }
+        checksumOk = (checksum == packet[packetIndex]);
 
     // if we pass the checksum
     if(checksumOk)
     {
         // if check for repeats is enabled, and it's a repeat packet, skip the callback
-        if (!(filterRepeatPackets && IsRepeatPacket()))
+        if (!(filterRepeatPackets && !serviceMode && !IsStopPacket() && IsRepeatPacket()))
         {
-            // execute callback for complete valid packet
+            // execute callback for complete valid packet, the view remains valid until we reset below
             if (packetCompleteHandler)
-                packetCompleteHandler(packet, packetIndex + 1);   // return the size of the packet, not the final index
+            {
+                const PacketView view = { packet, (byte)(packetIndex + 1), EndBitTime(), packetPreamble };   // return the size of the packet, not the final index
+                packetCompleteHandler(completeContext, view);
+            }
         }
     }
     else   // check sum error
     {
         if (packetErrorHandler)
-            packetErrorHandler(ERR_FAILED_CHECKSUM);
+            packetErrorHandler(errorContext, ERR_FAILED_CHECKSUM);
     }
 
     // reset and start looking for preamble again.
@@ -200,11 +262,36 @@ void DCCpacket::Execute()
 }
 
 
+// estimate the time of the end bit by backing out the bits that follow it in the source data, or 0 if
+// the bit time isn't known. the bits are consumed from the top of dataBits, which is shifted up with
+// zeros, so the bits that follow are the ones left in it.
+unsigned long DCCpacket::EndBitTime()
+{
+    if (bitTime == 0) return 0;
+
+    const byte ones = __builtin_popcountl(dataBits);
+    return bitTime - ones * (unsigned long)BIT_ONE_DURATION - (byte)(bitsLeft - ones) * (unsigned long)BIT_ZERO_DURATION;
+}
+
+
+// check for a reset or emergency stop, which are passed even if repeated
+bool DCCpacket::IsStopPacket()
+{
+    // reset 00000000 00000000, emergency stop 00000000 01DC0001, or 00000000 00111111 D0000001 for 128 speed steps
+    if (packet[0] == 0x00)
+        return packet[1] == 0x00 || (packet[1] & 0xCF) == 0x41 || (packetIndex == 3 && packet[1] == 0x3F && (packet[2] & 0x7F) == 0x01);
+
+    // extended accessory broadcast of the absolute stop aspect, 10111111 00000111 00000000
+    return packetIndex == 3 && packet[0] == 0xBF && packet[1] == 0x07 && packet[2] == 0x00;
+}
+
+
 // reset packet and counter data, and start looking for next preamble.
 void DCCpacket::Reset()
 {
-    // Reset packet data
-    packet[0] = packet[1] = packet[2] = packet[3] = packet[4] = packet[5] = 0;
+    // Reset packet data. the packet bytes are overwritten as they are assembled, so only
+    // the index, mask, and checksum need to be reset here.
+    checksum = 0;
     packetIndex = 0;
     packetMask = 0x80;
 
@@ -213,6 +300,39 @@ void DCCpacket::Reset()
 }
 
 
+// check the completed address bytes against the address filter. returns true if the packet should be skipped.
+// called after the first byte (packetIndex == 1) and the second byte (packetIndex == 2) are complete.
+bool DCCpacket::IsAddressRejected()
+{
+    const byte first = packet[0];
+
+    // idle (11111111) and broadcast (00000000) packets are always accepted
+    if (first == 0xFF || first == 0x00) return false;
+
+    // loco packets (0AAAAAAA or 11AAAAAA), check against the loco and consist addresses
+    if ((first & 0xC0) != 0x80)
+    {
+        if (first == filterConsistAddress) return false;
+        if (first != filterLocoFirst) return true;
+        if (!filterLocoLong || packetIndex < 2) return false;
+        return packet[1] != filterLocoSecond;
+    }
+
+    // accessory packet (10AAAAAA), check low address bits if we can, allowing for the broadcast address
+    const byte addrLow = first & 0x3F;
+    if (filterAddrLowBits && addrLow != 0x3F &&
+        (addrLow < (filterAddrFirst & 0x3F) || addrLow > (filterAddrLast & 0x3F))) return true;
+    if (packetIndex < 2) return false;    // need the second byte for the high address bits
+
+    // check the full address, the accessory broadcast address is 111 111111 (high bits sent as 000)
+    const byte addrHigh = packet[1] & 0x70;
+    if (addrLow == 0x3F && addrHigh == 0x00) return false;
+    const uint16_t address = ((~addrHigh & 0x70) << 2) | addrLow;
+
+    return address < filterAddrFirst || address > filterAddrLast;
+}
+
+
 // check for repeat packets within a certain time interval. returns true if a match is found.
 // updating of the packet history removes packets that are outside the time interval, and ensures that
 // the most common packets are at the front of the list
@@ -284,7 +404,7 @@ bool DCCpacket::IsRepeatPacket()
     else   // raise error for exceeding max history size
     {
         if (packetErrorHandler)
-            packetErrorHandler(ERR_EXCEEDED_HISTORY_SIZE);
+            packetErrorHandler(errorContext, ERR_EXCEEDED_HISTORY_SIZE);
     }
 
     return false;
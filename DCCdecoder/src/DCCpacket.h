@@ -37,7 +37,12 @@ Example Usage:
 
 	DCCpacket dccpacket;                            // DCCpacket object, default settings
 	DCCpacket dccPacket{ true, true, 250 };         // with checksum, repeat packet filtering, and repeat interval
+	dccpacket.FilterAddresses(true, boardAddress);  // only assemble packets for this accessory board address
+	dccpacket.FilterAddresses(true, first, last);   // or for a range of accessory board addresses
+	dccpacket.FilterLocoAddresses(3, false, 0);     // also assemble packets for this loco address
+	dccpacket.SetServiceMode(true);                 // pass all packets and repeats, on the programming track
 	dccpacket.ProcessIncomingBits(incomingBits);    // process 32 bits of bitstream data
+	dccpacket.ProcessIncomingBits(incomingBits, bitTime);    // with the time (micros) of the last bit
 
 Details:
 
@@ -46,12 +51,54 @@ After finding the preamble, the state changes to READPACKET. In this state, eigh
 followed by checking the next bit to determine if the packet has ended. When a 1 bit is read here,
 indicating the end of the packet, control passes to the Execute method.
 
+An optional address filter rejects packets that are not of interest as early as possible. When
+enabled, the first byte of each packet is checked as soon as it is complete. Locomotive packets
+are rejected immediately, unless a loco address has been set with FilterLocoAddresses. In that case
+short address packets are checked against the loco and consist addresses, and long address packets
+are checked on the first byte and then on the second. Accessory packets are checked against the
+low bits of the board address, and the full board address is checked against the range of accepted
+board addresses after the second byte. If the range spans more than one block of 64 boards, the
+low bits cannot be checked on their own, and the check after the first byte is skipped. Idle,
+broadcast, and accessory broadcast packets are always accepted. A rejected packet is
+dropped without further assembly, checksum, or repeat filtering, and the state reverts to 
+READPREAMBLE to wait for the next packet. Since the data bytes are separated by zero bits, the
+remainder of the rejected packet cannot be mistaken for a preamble.
+
+While reading the packet, whenever eight bits are available at the start of a data byte they are
+extracted from the input in a single step, otherwise they are shifted in one at a time. Each
+completed byte is folded into a running XOR as the following zero bit is read, so that the error
+detection byte has already been computed when the end bit arrives. Since the packet bytes are
+overwritten during assembly, they do not need to be cleared between packets. Packets of up to 11
+bytes are assembled, which is the length of an extended program on main (XPOM) packet with four
+data bytes for a long loco address or an accessory.
+
+If the time of the last bit in the incoming data is provided, the time of the packet end bit is
+estimated from it, using the nominal durations of the one and zero bits that follow the end bit in
+the same set of data. This time is provided with the completed packet, for measuring the latency
+from the DCC signal to the resulting action. A bit time of 0 means that the time isn't known, and
+the packet time is then 0 as well.
+
+Completed packets are provided to the callback as a PacketView, a read-only view of the packet
+data, size, and time. The view refers directly to the internal packet buffer rather than a copy.
+The buffer is not modified until the callback returns, after which the view is no longer valid.
+The view also gives the number of preamble bits ahead of the packet, counted up to 255. Service
+mode packets on the programming track are sent with a preamble of at least 20 bits, rather than the
+usual 14, so the decoder uses this to tell them apart from packets on the main.
+
+While in service mode, set with SetServiceMode, the address and repeat filters are bypassed. Service
+mode instructions share the first byte of short loco addresses, and the decoder must see each
+instruction repeated before acting on it.
+
 The Execute method performs two optional checks on the packet. A checksum is performed per the
 DCC spec using the last data byte. If the checksum passes, the packet is then checked to determine
 if it has been repeated within a given time interval. If the packet passes both of these checks,
 a callback is performed with the completed packet. After a packet is built and executed, the Reset
 method resets the packet data and the state reverts to READPREAMBLE.
 
+Resets and emergency stops, whether broadcast to all locos or as the absolute stop aspect to all
+extended accessories, are passed to the callback every time rather than being filtered as repeats,
+so that a stop sent shortly after an earlier one is never lost.
+
 The IsRepeatPacket method checks for repeat packets within a certain time interval, returning true
 if a match is found. A log is maintained of recent packets. The log is updated on entry to the
 method to remove packets that are outside the specified time interval. Packets that are still within
@@ -78,7 +125,7 @@ and its timestamp are added to the log, and the method returns false.
 enum : byte
 {
 	PACKET_LEN_MIN = 2,         // zero indexed
-	PACKET_LEN_MAX = 5,         // zero indexed
+	PACKET_LEN_MAX = 10,        // zero indexed, long enough for an XPOM packet with four data bytes
 	PREAMBLE_MIN = 10,          // minimum number of 1's to signal valid preamble
 	MAX_PACKET_LOG_SIZE = 15,   // max number of packets to check for repeats
 								// Note: the number of packets in the log is at least 1 for idle packets plus 1 for each engine
@@ -95,21 +142,42 @@ enum : byte
 	ERR_EXCEEDED_HISTORY_SIZE = 4,
 };
 
+// nominal bit durations (us), for estimating the time of the packet end bit
+enum : byte
+{
+	BIT_ONE_DURATION = 116,
+	BIT_ZERO_DURATION = 200,
+};
+
 
 class DCCpacket
 {
 
 public:
-	typedef void(*PacketCompleteHandler)(byte *Packet, byte PacketSize);
-	typedef void(*PacketErrorHandler)(byte ErrorCode);
+	// read-only view of a completed packet. this points into the packet builder's own buffer, and is
+	// only valid until the packet complete handler returns.
+	struct PacketView
+	{
+		const byte* data;             // the packet bytes, including the error detection byte
+		byte size;                    // number of bytes in the packet
+		unsigned long time;           // estimated time (micros) of the packet end bit
+		byte preamble;                // number of preamble bits, up to 255, for detecting service mode packets
+	};
+
+	typedef void(*PacketCompleteHandler)(void* Context, const PacketView& Packet);
+	typedef void(*PacketErrorHandler)(void* Context, byte ErrorCode);
 
 	DCCpacket();
 	DCCpacket(bool EnableChecksum, bool FilterRepeats, unsigned int FilterInterval);
-	void ProcessIncomingBits(unsigned long incomingBits);
-	void SetPacketCompleteHandler(PacketCompleteHandler Handler);
-	void SetPacketErrorHandler(PacketErrorHandler Handler);
+	void ProcessIncomingBits(unsigned long incomingBits, unsigned long BitTime = 0);
+	void SetPacketCompleteHandler(PacketCompleteHandler Handler, void* Context = 0);
+	void SetPacketErrorHandler(PacketErrorHandler Handler, void* Context = 0);
 	void EnableChecksum(bool Enable);
 	void FilterRepeatPackets(bool Filter);
+	void FilterAddresses(bool Filter, uint16_t BoardAddress);
+	void FilterAddresses(bool Filter, uint16_t FirstBoardAddress, uint16_t LastBoardAddress);
+	void FilterLocoAddresses(uint16_t LocoAddress, bool LongAddress, byte ConsistAddress);
+	void SetServiceMode(bool ServiceMode);
 
 private:
 	// states
@@ -132,24 +200,44 @@ private:
 	void Execute();
 	void Reset();
 	bool IsRepeatPacket();
+	bool IsAddressRejected();
+	bool IsStopPacket();
+	unsigned long EndBitTime();
 
 	// callback handlers
 	PacketCompleteHandler packetCompleteHandler = 0;
+	void* completeContext = 0;          // context passed to the packet complete handler, e.g. the owning instance
 	PacketErrorHandler packetErrorHandler = 0;
+	void* errorContext = 0;             // context passed to the packet error handler
 
 	// state and packet vars
 	unsigned long dataBits = 0;         // the source bit data
+	byte bitsLeft = 0;                  // number of bits in dataBits not yet processed
+	unsigned long bitTime = 0;          // time (micros) of the last bit in the source data
 	State state = READPREAMBLE;         // current processing state
 	byte packetIndex = 0;               // packet byte that we're on
 	byte packetMask = 0x80;             // mask for assigning bits to packet bytes
 	byte packet[PACKET_LEN_MAX + 1];    // packet data
+	byte checksum = 0;                  // running xor of the completed packet bytes
 	bool currentBit = 0;                // the current bit extracted from the input stream
 	byte preambleBitCount = 0;          // count of consecutive 1's we've found while looking for preamble
+	byte packetPreamble = 0;            // preamble length of the packet being read
 
 	bool enableChecksum = true;                // require valid checksum in order to return packet
 	bool filterRepeatPackets = true;           // filter out repeated packets, sending only the first in the given interval
 	unsigned int filterInterval = 250;         // time period (ms) within which packets are considered repeats
 	LogPacket packetLog[MAX_PACKET_LOG_SIZE];  // history of packets to check for repeats
+
+	bool filterAddresses = false;              // reject packets not addressed to this accessory board during assembly
+	uint16_t filterAddrFirst = 0;              // range of board addresses accepted, 9 bits as encoded in the packet
+	uint16_t filterAddrLast = 0;
+	bool filterAddrLowBits = false;            // the range lies within one block of 64, so the low bits can be checked alone
+	byte filterLocoFirst = 0;                  // first byte of loco packets accepted, 0 if none
+	byte filterLocoSecond = 0;                 // second byte of loco packets accepted, for long addresses
+	bool filterLocoLong = false;               // the loco address is long, so the second byte is checked
+	byte filterConsistAddress = 0;             // consist address accepted, 0 if none
+
+	bool serviceMode = false;                  // pass all packets, including repeats, while on the programming track
 };
 
 
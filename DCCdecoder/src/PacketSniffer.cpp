@@ -0,0 +1,127 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "PacketSniffer.h"
+
+
+// set up the sniffer to write to the given output
+PacketSniffer::PacketSniffer(Print& Output) : output(Output)
+{
+}
+
+
+// queue a record for a completed packet
+void PacketSniffer::RecordPacket(const byte* Packet, byte PacketSize, unsigned long PacketTime)
+{
+	AddRecord(RECORD_PACKET, Packet, PacketSize, PacketTime);
+}
+
+
+// queue a record for a packet error
+void PacketSniffer::RecordPacketError(byte ErrorCode)
+{
+	AddRecord(RECORD_PACKET_ERROR, &ErrorCode, 1, micros());
+}
+
+
+// queue a record for a bitstream error
+void PacketSniffer::RecordBitError(byte ErrorCode)
+{
+	AddRecord(RECORD_BIT_ERROR, &ErrorCode, 1, micros());
+}
+
+
+// send as much of the queued data as the output can take without blocking
+void PacketSniffer::Update()
+{
+	int available = output.availableForWrite();
+	while (available > 0 && tail != head)
+	{
+		output.write(buffer[tail]);
+		tail = (tail + 1) & bufferMask;
+		available--;
+	}
+}
+
+
+// build a record, COBS encode it, and add it to the ring buffer if there is room
+void PacketSniffer::AddRecord(byte Flags, const byte* Data, byte DataSize, unsigned long Time)
+{
+	if (DataSize > maxDataBytes) DataSize = maxDataBytes;
+
+	// time since the previous record, error records use micros() so may be slightly out of order
+	unsigned long delta = Time - lastRecordTime;
+	if ((long)delta < 0) delta = 0;
+	if (delta > 0xFFFF)
+	{
+		Flags |= RECORD_TIME_OVERFLOW;
+		delta = 0xFFFF;
+	}
+
+	if (dropped) Flags |= RECORD_DROPPED;
+
+	// assemble the raw record
+	byte raw[headerBytes + maxDataBytes];
+	raw[0] = Flags | DataSize;
+	raw[1] = lowByte(delta);
+	raw[2] = highByte(delta);
+	for (byte i = 0; i < DataSize; i++)
+		raw[headerBytes + i] = Data[i];
+	const byte rawSize = headerBytes + DataSize;
+
+	// COBS encode - each zero is replaced by the distance to the next zero, with a final zero delimiter
+	byte encoded[maxEncodedBytes];
+	byte codeIndex = 0;
+	byte code = 1;
+	byte n = 1;
+	for (byte i = 0; i < rawSize; i++)
+	{
+		if (raw[i] == 0)
+		{
+			encoded[codeIndex] = code;
+			codeIndex = n++;
+			code = 1;
+		}
+		else
+		{
+			encoded[n++] = raw[i];
+			code++;
+		}
+	}
+	encoded[codeIndex] = code;
+	encoded[n++] = 0;
+
+	// check for room in the ring buffer (one slot is kept empty to tell full from empty)
+	const byte used = (head - tail) & bufferMask;
+	if (bufferSize - 1 - used < n)
+	{
+		dropped = true;
+		return;
+	}
+
+	for (byte i = 0; i < n; i++)
+	{
+		buffer[head] = encoded[i];
+		head = (head + 1) & bufferMask;
+	}
+
+	dropped = false;
+	lastRecordTime = Time;
+}
@@ -0,0 +1,108 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+DCC Packet Sniffer
+
+A class to stream DCC packets and errors over a serial port as compact binary records.
+
+Summary:
+
+Printing packets as text takes many Serial.print calls per packet, which at DCC packet rates saturates
+the serial port and stalls the main loop long enough to overrun the timestamp queue. This class instead
+encodes each packet or error as a short binary record, and queues it in a ring buffer. The ring buffer
+is drained to the output only as fast as the output can accept data without blocking. The host side
+tool Tools/dccsniff.py decodes the records back into a readable log.
+
+Example Usage:
+
+	PacketSniffer sniffer{ Serial };        // create a sniffer writing to Serial
+	dcc.SetPacketSniffer(&sniffer);         // have the decoder send all packets and errors to it
+	dcc.ProcessTimeStamps();                // the decoder drains the sniffer buffer as it runs
+
+Details:
+
+Each record is COBS (consistent overhead byte stuffing) encoded and terminated with a zero byte, so
+that the host can resynchronize at any record boundary. Before encoding, a record consists of:
+
+	byte 0       low nibble: number of data bytes, high nibble: record type and flags
+	byte 1-2     time since the previous record (us), little endian
+	byte 3...    data bytes - the packet including its error byte, or the error code
+
+The record type is a packet, a packet error, or a bitstream error. The TIME_OVERFLOW flag indicates
+that the time since the previous record did not fit in 16 bits, and the DROPPED flag indicates that
+one or more records before this one were dropped because the ring buffer was full. Records are
+encoded when they are added, so draining the buffer is a simple copy. The largest record (a six byte
+packet) is eleven bytes on the wire, so even a busy layout needs only a few kB/s.
+
+*/
+
+
+#ifndef _PACKETSNIFFER_h
+#define _PACKETSNIFFER_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+
+class PacketSniffer
+{
+public:
+	// record types and flags, in the high nibble of the first record byte
+	enum RecordFlags : byte
+	{
+		RECORD_PACKET = 0x00,
+		RECORD_PACKET_ERROR = 0x10,
+		RECORD_BIT_ERROR = 0x20,
+		RECORD_TIME_OVERFLOW = 0x40,
+		RECORD_DROPPED = 0x80,
+	};
+
+	explicit PacketSniffer(Print& Output);
+	void RecordPacket(const byte* Packet, byte PacketSize, unsigned long PacketTime);
+	void RecordPacketError(byte ErrorCode);
+	void RecordBitError(byte ErrorCode);
+	void Update();
+
+private:
+	enum : byte
+	{
+		bufferSize = 128,           // ring buffer size, must be a power of two
+		bufferMask = bufferSize - 1,
+		maxDataBytes = 6,           // longest packet
+		headerBytes = 3,
+		maxEncodedBytes = headerBytes + maxDataBytes + 2,    // plus COBS overhead byte and delimiter
+	};
+
+	void AddRecord(byte Flags, const byte* Data, byte DataSize, unsigned long Time);
+
+	Print& output;                       // where the encoded records are written
+	byte buffer[bufferSize];             // ring buffer of encoded records
+	byte head = 0;                       // next index to write
+	byte tail = 0;                       // next index to send
+	bool dropped = false;                // a record was dropped since the last one queued
+	unsigned long lastRecordTime = 0;    // time of the previous record, for time deltas
+};
+
+#endif
@@ -21,76 +21,88 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include "DCCdecoder.h"
 
+// stream binary packet records for Tools/dccsniff.py, rather than printing each packet
+//#define SNIFFER_MODE
+
 
 // Bitstream setup ==========================================================================
 
 DCCdecoder dcc;
 
-
-void BitErrorHandler(byte errorCode)
-{
-	//Serial.print("Bit error, code: ");
-	//Serial.println(errorCode,DEC);
-
-	digitalWrite(6, HIGH); delay(100); digitalWrite(6, LOW);
-}
-
-
-void PacketErrorHandler(byte errorCode)
-{
-	Serial.print("Packet error, code: ");
-	Serial.println(errorCode, DEC);
-}
-
-
-void DCC_AccessoryDecoderHandler(int boardAddress, int outputAddress, byte activate, byte data)
-{
-	Serial.print("Basic Acc Packet, Board Address: ");
-	Serial.print(boardAddress, DEC);
-	Serial.print("  Output Address: ");
-	Serial.print(outputAddress, DEC);
-	Serial.print("  Activate Bit: ");
-	Serial.print(activate, DEC);
-	Serial.print("  Data: ");
-	Serial.println(data, DEC);
-}
-
-
-void DCC_ExtendedAccDecoderHandler(int boardAddress, int outputAddress, byte data)
-{
-	Serial.print("Ext Acc Packet, Board Address: ");
-	Serial.print(boardAddress, DEC);
-	Serial.print("  Output Address: ");
-	Serial.print(outputAddress, DEC);
-	Serial.print("  Data: ");
-	Serial.println(data, DEC);
-}
+#if defined(SNIFFER_MODE)
+PacketSniffer sniffer{ Serial };
+#endif
 
 
-void DCC_BaselineControlHandler(int address, int speed, int direction)
+// event handler, bound to the decoder at compile time
+class DecoderTest : public DCCEventHandler
 {
-	Serial.print("Baseline Packet, Loco Address: ");
-	Serial.print(address, DEC);
-	Serial.print("  Speed: ");
-	Serial.print(speed, DEC);
-	Serial.print("  Direction: ");
-	Serial.println(direction, DEC);
-}
-
+	friend class DCCdecoder;
+
+private:
+	void DCCBitstreamMaxErrorEvent(byte errorCode)
+	{
+		//Serial.print("Bit error, code: ");
+		//Serial.println(errorCode,DEC);
+
+		digitalWrite(6, HIGH); delay(100); digitalWrite(6, LOW);
+	}
+
+	void DCCPacketErrorEvent(byte errorCode)
+	{
+		Serial.print("Packet error, code: ");
+		Serial.println(errorCode, DEC);
+	}
+
+	void DCCBasicAccEvent(int boardAddress, int outputAddress, byte activate, byte data)
+	{
+		Serial.print("Basic Acc Packet, Board Address: ");
+		Serial.print(boardAddress, DEC);
+		Serial.print("  Output Address: ");
+		Serial.print(outputAddress, DEC);
+		Serial.print("  Activate Bit: ");
+		Serial.print(activate, DEC);
+		Serial.print("  Data: ");
+		Serial.println(data, DEC);
+	}
+
+	void DCCExtendedAccEvent(int boardAddress, int outputAddress, byte data)
+	{
+		Serial.print("Ext Acc Packet, Board Address: ");
+		Serial.print(boardAddress, DEC);
+		Serial.print("  Output Address: ");
+		Serial.print(outputAddress, DEC);
+		Serial.print("  Data: ");
+		Serial.println(data, DEC);
+	}
+
+	void DCCBasicControlEvent(int address, int speed, int direction)
+	{
+		Serial.print("Baseline Packet, Loco Address: ");
+		Serial.print(address, DEC);
+		Serial.print("  Speed: ");
+		Serial.print(speed, DEC);
+		Serial.print("  Direction: ");
+		Serial.println(direction, DEC);
+	}
+
+	void DCCBasicAccPomEvent(int boardAddress, int outputAddress, byte instructionType, int cv, byte data)
+	{
+		Serial.print("Basic Acc POM Packet, Board Address: ");
+		Serial.print(boardAddress, DEC);
+		Serial.print("  Output Address: ");
+		Serial.print(outputAddress, DEC);
+		Serial.print("  Instruction Type: ");
+		Serial.print(instructionType, DEC);
+		Serial.print("  CV: ");
+		Serial.print(cv, DEC);
+		Serial.print("  Data: ");
+		Serial.println(data, DEC);
+	}
+};
 
-void DCC_AccPomHandler(int boardAddress, int outputAddress, byte instructionType, int cv, byte data)
-{
-	Serial.print("Basic Acc POM Packet, Board Address: ");
-	Serial.print(boardAddress, DEC);
-	Serial.print("  Output Address: ");
-	Serial.print(outputAddress, DEC);
-	Serial.print("  Instruction Type: ");
-	Serial.print(instructionType, DEC);
-	Serial.print("  CV: ");
-	Serial.print(cv, DEC);
-	Serial.print("  Data: ");
-	Serial.println(data, DEC);
-}
+DecoderTest decoderTest;
+DCCEventQueue dccEvents;
 
 
 DCCdecoder::DecoderSettings settings =
@@ -121,15 +133,19 @@ void setup()
 	Serial.begin(115200);
 
 	dcc.UpdateSettings(settings);
-	dcc.SetBasicAccessoryDecoderPacketHandler(&DCC_AccessoryDecoderHandler);
-	dcc.SetExtendedAccessoryDecoderPacketHandler(&DCC_ExtendedAccDecoderHandler);
-	dcc.SetBaselineControlPacketHandler(&DCC_BaselineControlHandler);
-	dcc.SetBasicAccessoryPomPacketHandler(&DCC_AccPomHandler);
 
-	//dcc.SetBitstreamErrorHandler(BitErrorHandler);
-	//dcc.SetPacketErrorHandler(PacketErrorHandler);
-	dcc.SetBitstreamMaxErrorHandler(BitErrorHandler);
-	//dcc.SetPacketMaxErrorHandler(PacketErrorHandler);
+#if defined(SNIFFER_MODE)
+	// all packets and errors go to the sniffer, no text output so we don't corrupt the binary stream
+	dcc.SetPacketSniffer(&sniffer);
+	dcc.ResumeBitstream();
+	return;
+#endif
+
+	// add DCCEvent::PACKET_ERROR to print the packet errors
+	dcc.EnableEvents(DCCEvent::Bit(DCCEvent::BASIC_ACC) | DCCEvent::Bit(DCCEvent::EXTENDED_ACC) |
+		DCCEvent::Bit(DCCEvent::BASIC_CONTROL) | DCCEvent::Bit(DCCEvent::BASIC_ACC_POM) |
+		DCCEvent::Bit(DCCEvent::BITSTREAM_MAX_ERROR));
+	dcc.SetEventQueue(&dccEvents);
 
 	Serial.println("dcc decoder setup complete.");
 
@@ -144,4 +160,5 @@ void setup()
 void loop()
 {
 	dcc.ProcessTimeStamps();
+	dcc.DispatchEvents(decoderTest, 1);
 }
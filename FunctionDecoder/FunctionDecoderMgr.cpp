@@ -0,0 +1,443 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "FunctionDecoderMgr.h"
+
+
+// factory default CVs
+const CVManager::CVstatic FunctionDecoderMgr::cvSchema[numCVindexes] PROGMEM =
+{
+	CVManager::CV8(CV_PrimaryAddress, 3, 1, 127, false),
+	CVManager::CV8(CV_ExtAddressMSB, 192, 192, 231, false),
+	CVManager::CV8(CV_ExtAddressLSB, 0, 0, 255, false),
+	CVManager::CV8(CV_ConsistAddress, 0),
+	CVManager::CV8(CV_Config, CONFIG_SPEEDSTEPS28),
+	CVManager::CV8(CV_Output1Function, 0),
+	CVManager::CV8(CV_Output2Function, 1),
+	CVManager::CV8(CV_Output3Function, 2),
+	CVManager::CV8(CV_Output4Function, 3),
+	CVManager::CV8(CV_Output5Function, 4),
+	CVManager::CV8(CV_Output6Function, 5),
+};
+
+// cv order of the config stored without a header, by firmware from before the config was versioned
+const byte FunctionDecoderMgr::cvLayoutV0[numCVindexes] PROGMEM =
+{
+	CV_PrimaryAddress, CV_ExtAddressMSB, CV_ExtAddressLSB, CV_ConsistAddress, CV_Config, CV_Output1Function,
+	CV_Output2Function, CV_Output3Function, CV_Output4Function, CV_Output5Function, CV_Output6Function,
+};
+
+// earlier config versions that can be migrated
+const CVStore::Layout FunctionDecoderMgr::configLayouts[numConfigLayouts] PROGMEM =
+{
+	{ 0, numCVindexes, cvLayoutV0 },
+};
+
+
+// ========================================================================================================
+// Public Methods
+
+
+// FunctionDecoderMgr constructor
+FunctionDecoderMgr::FunctionDecoderMgr()
+{
+	// configure the dcc events, which are dispatched to our event methods from Update
+	dcc.EnableEvents(DCCEvent::Bit(DCCEvent::FUNCTION) | DCCEvent::Bit(DCCEvent::LOCO_POM) |
+		DCCEvent::Bit(DCCEvent::LOCO_XPOM) | DCCEvent::Bit(DCCEvent::SERVICE_MODE) | DCCEvent::Bit(DCCEvent::BITSTREAM_MAX_ERROR) |
+		DCCEvent::Bit(DCCEvent::PACKET_MAX_ERROR));
+	dcc.SetEventQueue(&dccEvents);
+
+	// acknowledge service mode instructions with a pulse on the relay 1 coil, which is also output 3, and
+	// is held off while in service mode
+	dcc.SetAckOutput(Relay1Pin);
+
+	// configure timer event handlers
+	errorTimer.SetTimerHandler(WrapperErrorTimer, this);
+	resetTimer.SetTimerHandler(WrapperResetTimer, this);
+
+	// update the addresses and output mapping when their cvs change
+	cv.subscribe(CV_PrimaryAddress, CV_Config, WrapperConfigCVChange, this);
+	cv.subscribe(CV_Output1Function, CV_Output6Function, WrapperConfigCVChange, this);
+
+	// save the cvs written by program on main in a patch record, rather than the whole config
+	cvStore.SetPatchKey(configPatchKey);
+
+#if defined(WITH_CV_BACKUP)
+	// the cvs set by a restore are saved as one record
+	cvBackup.SetRestoreHandler(WrapperCVRestore, this);
+#endif
+}
+
+
+// Check for factory reset, then proceed with main initialization
+void FunctionDecoderMgr::Initialize()
+{
+	// check for button hold on startup (for reset to defaults)
+	if (button.RawState() == LOW)
+	{
+		FactoryReset(true);    // perform a complete reset
+	}
+	else
+	{
+		InitMain();
+	}
+}
+
+
+// check for new bitstream data, update led and timers
+void FunctionDecoderMgr::Update()
+{
+	// process any DCC interrupts that have been timestamped
+	dcc.ProcessTimeStamps();
+
+	// hold the ack output off while in service mode, before any service mode instruction is handled,
+	// and set it from its function again afterwards
+	if (dcc.IsServiceMode() != serviceMode)
+	{
+		serviceMode = !serviceMode;
+		if (serviceMode)
+			output[ackOutput].SetPin(LOW);
+		else
+			UpdateOutput(ackOutput);
+	}
+
+	// handle the decoded dcc events
+	dcc.DispatchEvents(*this, maxDispatchEvents);
+
+	// do the updates to maintain flashing led
+	const unsigned long currentMillis = millis();
+	led.Update(currentMillis);
+
+	// timer updates
+	errorTimer.Update(currentMillis);
+	resetTimer.Update(currentMillis);
+
+#if defined(WITH_CV_BACKUP)
+	// handle a cv backup or restore command from the serial port
+	cvBackup.Update();
+#endif
+
+	// write the queued config record, as far as the eeprom writer has room
+	store.Update();
+}
+
+
+// ========================================================================================================
+// Private Methods
+
+
+// Initialize the function decoder manager by reading stored values from CVs, and setting up the dcc decoder
+void FunctionDecoderMgr::InitMain()
+{
+	// load config
+	LoadConfig();
+	ConfigureDecoder();
+
+	// set the led and begin bitstream capture
+	led.SetLED(RgbLed::GREEN, RgbLed::ON);
+	dcc.ResumeBitstream();
+
+#ifdef _DEBUG
+	Serial.println("FunctionDecoderMgr init done.");
+#endif
+}
+
+
+// set up the dcc decoder and the output mapping from the CVs
+void FunctionDecoderMgr::ConfigureDecoder()
+{
+	ConfigureAddress();
+	for (byte i = 0; i < numOutputs; i++)
+		ConfigureOutput(i);
+}
+
+
+// set the loco and consist addresses and the speed step mode in the dcc decoder
+void FunctionDecoderMgr::ConfigureAddress()
+{
+	const byte config = cv.getCV(CV_Config);
+
+	// loco address, short or long as selected in CV29
+	uint16_t addr = cv.getCV(CV_PrimaryAddress);
+	if (config & CONFIG_LONGADDRESS)
+		addr = ((cv.getCV(CV_ExtAddressMSB) & 0x3F) << 8) + cv.getCV(CV_ExtAddressLSB);
+
+	dcc.SetLocoAddress(addr);
+	dcc.SetConsistAddress(cv.getCV(CV_ConsistAddress));
+	dcc.SetSpeedSteps((config & CONFIG_SPEEDSTEPS28) ? 28 : 14);
+}
+
+
+// resolve the function assigned to an output into a function group and bit
+void FunctionDecoderMgr::ConfigureOutput(byte outputIndex)
+{
+	const byte function = cv.getCV(CV_Output1Function + outputIndex);
+	outputGroup[outputIndex] = FunctionGroupIndex(function);
+	outputMask[outputIndex] = 0;
+	if (outputGroup[outputIndex] == noFunctionGroup) return;
+
+	// the group index also gives the number of the first function in the group
+	const byte firstFunction[numFunctionGroups] = { 0, 5, 9, 13, 21 };
+	outputMask[outputIndex] = 1 << (function - firstFunction[outputGroup[outputIndex]]);
+
+	// set the output from the last state received
+	UpdateOutput(outputIndex);
+}
+
+
+// set an output from the last state of its function, unless it is the ack output in service mode
+void FunctionDecoderMgr::UpdateOutput(byte outputIndex)
+{
+	if (outputGroup[outputIndex] == noFunctionGroup || (outputIndex == ackOutput && serviceMode)) return;
+
+	output[outputIndex].SetPin((functionState[outputGroup[outputIndex]] & outputMask[outputIndex]) != 0);
+}
+
+
+// get the index of the function group containing a function
+byte FunctionDecoderMgr::FunctionGroupIndex(byte functionNumber)
+{
+	if (functionNumber > 28) return noFunctionGroup;
+	if (functionNumber >= DCCdecoder::FN_21_28) return 4;
+	if (functionNumber >= DCCdecoder::FN_13_20) return 3;
+	if (functionNumber >= DCCdecoder::FN_9_12) return 2;
+	if (functionNumber >= DCCdecoder::FN_5_8) return 1;
+	return 0;
+}
+
+
+// perform a reset to factory defaults
+void FunctionDecoderMgr::FactoryReset(bool HardReset)
+{
+	// normal initilization will resume after this timer expires
+	const unsigned long resetDelay = 2500;  // time to flash led so we have indication of reset occuring
+	resetTimer.StartTimer(resetDelay);
+	led.SetLED(RgbLed::MAGENTA, RgbLed::FLASH);
+
+	// suspend bitstream in case of soft reset
+	dcc.SuspendBitstream();
+
+	// do the cv reset
+	cv.resetCVs();
+	SaveConfig();
+}
+
+
+void FunctionDecoderMgr::LoadConfig()
+{
+	// load the stored config, which holds the working CVs. a config from earlier firmware is migrated,
+	// and the CVs are set to defaults on first boot or if the config is not valid.
+	cvStore.Load();
+}
+
+
+void FunctionDecoderMgr::SaveConfig()
+{
+	// queue the config, which holds the working CVs, to be written in the background
+	cvStore.Save();
+}
+
+
+// ========================================================================================================
+// Event Handlers
+
+
+// handle the reset timer callback
+void FunctionDecoderMgr::ResetTimerHandler()
+{
+	// run the main init after the reset timer expires
+	InitMain();
+}
+
+
+// handle the error timer callback
+void FunctionDecoderMgr::ErrorTimerHandler()
+{
+	// all we need to do here is turn the led back on normally
+	led.SetLED(RgbLed::GREEN, RgbLed::ON);
+}
+
+
+void FunctionDecoderMgr::MaxBitErrorHandler()
+{
+	// set up timer for LED indication, normal led will resume after this timer expires
+	errorTimer.StartTimer(250);
+	led.SetLED(RgbLed::YELLOW, RgbLed::ON);
+}
+
+
+void FunctionDecoderMgr::MaxPacketErrorHandler()
+{
+	// set up timer for LED indication, normal led will resume after this timer expires
+	errorTimer.StartTimer(500);
+	led.SetLED(RgbLed::YELLOW, RgbLed::ON);
+}
+
+
+// handle a DCC function group for our loco address
+void FunctionDecoderMgr::DCCFunctionHandler(byte functionGroup, byte functions)
+{
+	const byte group = FunctionGroupIndex(functionGroup);
+
+	// the function groups are refreshed continuously, so exit quickly if nothing has changed
+	const byte changed = functions ^ functionState[group];
+	if (!changed) return;
+	functionState[group] = functions;
+
+#ifdef _DEBUG
+	Serial.print("Received dcc functions from F");
+	Serial.print(functionGroup, DEC);
+	Serial.print(", value ");
+	Serial.println(functions, BIN);
+#endif
+
+	// set only the outputs whose function has changed
+	for (byte i = 0; i < numOutputs; i++)
+		if (outputGroup[i] == group && (changed & outputMask[i]))
+			UpdateOutput(i);
+}
+
+
+// handle a DCC program on main command
+void FunctionDecoderMgr::DCCPomHandler(unsigned int Addr, byte instType, unsigned int CV, byte Value)
+{
+	// assume we are filtering repeated packets in the packet builder, so we don't check for that here
+	// assume DCCdecoder is set to return only packets for this decoder's address.
+
+#ifdef _DEBUG
+	Serial.print("In class callback for dcc program on main, CV: ");
+	Serial.print(CV, DEC);
+	Serial.print(", Value: ");
+	Serial.println(Value, DEC);
+#endif
+
+	// a verify would be answered by railcom, which isn't supported, so the led shows if the cv matches
+	const int16_t writeValue = cv.getWriteValue(instType, CV, Value);
+	if (writeValue < 0)
+	{
+		ShowPomResult(cv.verifyCV(instType, CV, Value));
+		return;
+	}
+
+	// check for and perform cv commanded reset
+	if (CommandedReset(CV, writeValue)) return;
+
+	// set the cv, where a bit manipulation changes only the one bit, and save it in the patch of the config
+	const bool valid = cv.setCV(CV, writeValue);
+	ShowPomResult(valid);
+	if (valid) cvStore.SaveCV(CV);
+}
+
+
+// handle a DCC extended program on main command, for up to four cvs starting at the given one. the
+// decoder has no cv pages, so only an index of 0 is used, with the offset addressing CV1-256.
+void FunctionDecoderMgr::DCCXpomHandler(byte instType, uint16_t cvIndex, byte cvOffset, const byte* data, byte count)
+{
+	const unsigned int firstCV = cvOffset + 1;
+	if (cvIndex != 0)
+	{
+		ShowPomResult(false);
+		return;
+	}
+
+	// a single byte is handled as for program on main
+	if (count == 1)
+	{
+		DCCPomHandler(0, instType, firstCV, data[0]);
+		return;
+	}
+
+	// a read would be answered by railcom, which isn't supported, so the led shows if the cv exists
+	if (instType != CVManager::CV_WRITE || count == 0)
+	{
+		ShowPomResult(instType == CVManager::CV_VERIFY && cv.getCVindex(firstCV) >= 0);
+		return;
+	}
+
+	// set the cvs as for program on main, saving only the ones that are set
+	bool valid = true;
+	for (byte i = 0; i < count; i++)
+	{
+		if (CommandedReset(firstCV + i, data[i])) return;
+
+		if (cv.setCV(firstCV + i, data[i]))
+			cvStore.SaveCV(firstCV + i);
+		else
+			valid = false;
+	}
+	ShowPomResult(valid);
+}
+
+
+// perform a factory reset if it is commanded by a write to the reset cv, returns true if it was
+bool FunctionDecoderMgr::CommandedReset(unsigned int CV, uint16_t value)
+{
+	if (CV != CV_reset) return false;
+
+	if (value == CV_softResetValue)
+		FactoryReset(false);
+	else if (value == CV_hardResetValue)
+		FactoryReset(true);
+	else
+		return false;
+
+	return true;
+}
+
+
+// show the result of a program on main command on the led
+void FunctionDecoderMgr::ShowPomResult(bool valid)
+{
+	// blue if we are programming a valid CV, or yellow if the CV is invalid
+	errorTimer.StartTimer(1000);
+	led.SetLED(valid ? RgbLed::BLUE : RgbLed::YELLOW, RgbLed::ON);
+}
+
+
+// update the addresses or the mapping of an output when one of their cvs is changed
+void FunctionDecoderMgr::ConfigCVChanged(byte cvNum, uint16_t value)
+{
+	if (cvNum >= CV_Output1Function)
+		ConfigureOutput(cvNum - CV_Output1Function);
+	else
+		ConfigureAddress();
+}
+
+
+// handle a DCC service mode instruction, returns true to acknowledge it
+bool FunctionDecoderMgr::DCCServiceModeHandler(byte instType, unsigned int CV, byte Value)
+{
+	// writes are made as for program on main, and acknowledged once the cv holds the new value
+	const int16_t writeValue = cv.getWriteValue(instType, CV, Value);
+	if (writeValue < 0) return cv.verifyCV(instType, CV, Value);
+
+	DCCPomHandler(0, CVManager::CV_WRITE, CV, writeValue);
+	return cv.verifyCV(CVManager::CV_VERIFY, CV, writeValue);
+}
+
+
+// ========================================================================================================
+// timer and cv change callback wrappers, with the manager instance as the context
+void FunctionDecoderMgr::WrapperResetTimer(void* context) { static_cast<FunctionDecoderMgr*>(context)->ResetTimerHandler(); }
+void FunctionDecoderMgr::WrapperErrorTimer(void* context) { static_cast<FunctionDecoderMgr*>(context)->ErrorTimerHandler(); }
+void FunctionDecoderMgr::WrapperConfigCVChange(void* context, byte cvNum, uint16_t value) { static_cast<FunctionDecoderMgr*>(context)->ConfigCVChanged(cvNum, value); }
+#if defined(WITH_CV_BACKUP)
+void FunctionDecoderMgr::WrapperCVRestore(void* context) { static_cast<FunctionDecoderMgr*>(context)->SaveConfig(); }
+#endif
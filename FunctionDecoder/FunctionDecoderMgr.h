@@ -0,0 +1,268 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Arduino Function Decoder Manager
+
+A class for managing the top level operation of a DCC function decoder, driving outputs from the
+function keys of a loco address.
+
+Summary:
+
+The FunctionDecoderMgr class provides the top level functionality for the function decoder. It
+answers to a loco address, and sets its outputs from the functions F0-F28 sent to that address. The
+function assigned to each output is stored in a CV. It uses the same hardware as the turnout board,
+with the aux outputs and the relays as the function outputs, and the LED for indications. A reset
+to default may be performed by holding the pushbutton while the hardware is powered up.
+
+Example Usage:
+
+FunctionDecoderMgr FunctionManager;      // create an instance of the function decoder manager
+FunctionManager.Initialize();            // initialize the function decoder manager. call this in setup().
+FunctionManager.Update();                // check for DCC commands, update LED and timers.
+										    call this in loop().
+
+Details:
+
+The InitMain method performs the setup for the class, including reading the stored configuration
+from EEPROM, setting the loco address, consist address, and speed step mode in the DCC decoder from
+CV1, CV17/18, CV19 and CV29, and setting up the output mapping. If a factory reset is triggered in
+the Initialize method, the CVs are restored to their default settings, and a timer is set which then
+runs the InitMain method.
+
+The CV numbers, defaults and ranges are a constant table in flash, and the working CV values are the
+config struct. The config is stored with its version as a record of a record store, which checks it
+with a CRC and spreads the writes across the whole EEPROM, and a config stored by earlier firmware,
+including one stored directly in EEPROM with or without a header, is migrated to the current CVs when
+loaded. A save queues the config record, which is written a few bytes at a time from Update, so that a
+CV write doesn't hold up the DCC processing while the EEPROM is written.
+
+The DCCFunctionHandler processes a function group received for the loco address. The command station
+repeats the function groups continuously, so the handler compares each group against the cached
+state of that group, and returns immediately if nothing has changed. Otherwise only the outputs
+assigned to a function that changed are set. The output mapping is resolved from the CVs into a group
+and bit mask per output when the configuration is loaded, so that no CV lookups are needed while
+handling a function group.
+
+The function for each output is set in CV33-CV38, for outputs 1-6, with a value of 0-28. Any other
+value leaves the output unassigned. By default outputs 1-6 follow F0-F5. The DCCPomHandler method
+processes a program on main packet for the loco address. A write byte or bit manipulation is checked
+for a valid CV, stored, with only the one bit changed for a bit manipulation, and saved in a small
+patch record of the config, so that a bit write doesn't rewrite every CV. A verify would be answered
+by RailCom, which isn't supported, so the LED shows whether the CV matches. The DCCXpomHandler method
+processes the extended form (XPOM), writing up to four consecutive CVs as for program on main, so a
+write to CV55 performs a reset and only the CVs that are set are saved, for CV1-256 with a CV index
+of 0. A handler subscribed to changes of the CVs then updates just the state that
+the CV affects, the decoder addresses for CV1-CV29, or the mapping of one output for CV33-CV38. CV55
+provides soft and hard resets to defaults, as for the turnout managers.
+
+If built with WITH_CV_BACKUP, the CVs can also be backed up to and restored from a host over the
+serial port by the cvBackup object, with the config saved once after a restore. The serial port uses
+the aux output pins, so the outputs on pins 0 and 1 can't be used in that build.
+
+The DCCServiceModeHandler method processes a service mode instruction on the programming track.
+Verifies are checked against the CVs, and writes are made through the DCCPomHandler. The instruction
+is acknowledged with a pulse on the relay 1 output, for a verify that matches or a completed write.
+The board has no other load that draws the acknowledgement current from the track, so relay 1 is
+also function output 3. While the decoder is in service mode, that output is held off and its
+function ignored, so that the pulse is the only change in the load, and when service mode ends it is
+set again from the last state of its function.
+
+Event handler wrappers for the timers are static, so that they are accessible as callbacks from
+those classes. The timers are given this instance as the context for the callback, which the wrappers
+use to reach the function decoder manager. The DCC events are instead bound at compile time,
+with the DCCdecoder calling the DCC event methods directly from the Update method.
+
+*/
+
+#ifndef _FUNCTIONDECODERMGR_h
+#define _FUNCTIONDECODERMGR_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "DCCdecoder.h"
+#include "RGB_LED.h"
+#include "Button.h"
+#include "OutputPin.h"
+#include "EventTimer.h"
+#include "CVManager.h"
+#include "CVStore.h"
+#include "RecordStore.h"
+#include "EEPROMWriter.h"
+
+// build the serial cv backup and restore. the serial port shares pins 0 and 1 with the aux outputs, as in
+// debug builds, so it is left out of a normal build.
+//#define WITH_CV_BACKUP
+
+#if defined(WITH_CV_BACKUP)
+#include "CVBackup.h"
+#endif
+
+
+class FunctionDecoderMgr : public DCCEventHandler
+{
+public:
+	FunctionDecoderMgr();
+	void Initialize();
+	void Update();
+
+private:
+	// Hardware assignments, as for the turnout board
+	enum HardwarePins : byte {
+		Aux1Pin = 0,
+		Aux2Pin = 1,
+		//HWirqPin = 2,     //  set in bitstream.h
+		ButtonPin = 3,
+		LedBPin = 6,
+		LedRPin = 7,
+		//ICRPin = 8,        // set in bitstream.h
+		LedGPin = 12,
+		Relay1Pin = 14,
+		Relay2Pin = 15,
+		Relay3Pin = 18,
+		Relay4Pin = 19,
+	};
+
+	// main functions
+	void InitMain();
+	void FactoryReset(bool HardReset);
+	void LoadConfig();
+	void SaveConfig();
+	void ConfigureDecoder();
+	void ConfigureAddress();
+	void ConfigureOutput(byte outputIndex);
+	void UpdateOutput(byte outputIndex);
+
+	// Sensors and outputs, output 3 is on relay 1, which also acknowledges service mode instructions
+	enum : byte { numOutputs = 6, ackOutput = 2 };
+	Button button{ ButtonPin, true };
+	RgbLed led{ LedRPin, LedGPin, LedBPin };
+	OutputPin output[numOutputs] = { { Aux1Pin }, { Aux2Pin }, { Relay1Pin }, { Relay2Pin }, { Relay3Pin }, { Relay4Pin } };
+	EventTimer resetTimer;
+	EventTimer errorTimer;
+
+	// DCC decoder
+	DCCdecoder dcc;
+	DCCEventQueue dccEvents;                   // decoded dcc events waiting to be handled
+	enum : byte { maxDispatchEvents = 2 };     // max dcc events handled per update
+	bool serviceMode = false;                  // the decoder is in service mode, with the ack output held off
+
+	// function groups, in the order F0-F4, F5-F8, F9-F12, F13-F20, F21-F28
+	enum : byte { numFunctionGroups = 5, noFunctionGroup = 255 };
+	static byte FunctionGroupIndex(byte functionNumber);
+
+	byte functionState[numFunctionGroups] = { 0, 0, 0, 0, 0 };    // last state received for each function group
+	byte outputGroup[numOutputs];              // function group index of the function assigned to each output
+	byte outputMask[numOutputs];               // bit of the function within its group
+
+	// define our available cv's
+	enum CVList : byte {
+		CV_PrimaryAddress = 1,
+		CV_ExtAddressMSB = 17,
+		CV_ExtAddressLSB = 18,
+		CV_ConsistAddress = 19,
+		CV_Config = 29,
+		CV_Output1Function = 33,
+		CV_Output2Function = 34,
+		CV_Output3Function = 35,
+		CV_Output4Function = 36,
+		CV_Output5Function = 37,
+		CV_Output6Function = 38,
+	};
+
+	// CV29 bits
+	enum ConfigBits : byte {
+		CONFIG_SPEEDSTEPS28 = 0x02,
+		CONFIG_LONGADDRESS = 0x20,
+	};
+
+	enum : byte { numCVindexes = 11 };
+	static const CVManager::CVstatic cvSchema[numCVindexes];    // cv numbers, defaults and ranges, in flash
+
+	struct ConfigVars
+	{
+		byte CVs[numCVindexes];
+	};
+
+	ConfigVars configVars;
+	byte cvLookup[CVManager::IndexSize(CV_PrimaryAddress, CV_Output6Function)];    // lookup from cv number to index
+	CVManager cv{ cvSchema, configVars.CVs, numCVindexes, cvLookup, sizeof(cvLookup) };      // working cvs are held in the config struct
+
+	// the config is a record in a store that takes up the whole EEPROM, with the cvs written by program
+	// on main saved in a patch record of the config
+	enum : byte { configKey = 0, configPatchKey = 1 };
+	RecordStorage storage{ 0, 1024 };
+	RecordStore store{ storage };
+
+	// bump the version when the cv schema changes, and add a layout of the previous version so that a
+	// stored config can be migrated.
+	enum : byte { configVersion = 1, numConfigLayouts = 1 };
+	static const byte cvLayoutV0[numCVindexes];                 // cv order of the config stored without a header
+	static const CVStore::Layout configLayouts[numConfigLayouts];
+	CVStore cvStore{ cv, store, configKey, configVersion, configLayouts, numConfigLayouts };
+
+#if defined(WITH_CV_BACKUP)
+	// the cvs can be backed up and restored over the serial port, with the config saved once after a restore
+	byte backupBuffer[CVBackup::BufferSize(numCVindexes)];
+	CVBackup cvBackup{ Serial, cv, backupBuffer, sizeof(backupBuffer) };
+	static void WrapperCVRestore(void* context);
+#endif
+
+	// factory default settings
+	enum ResetCVs : byte {
+		CV_reset = 55,
+		CV_softResetValue = 11,
+		CV_hardResetValue = 55,
+	};
+
+	// event handlers
+	void ResetTimerHandler();
+	void ErrorTimerHandler();
+	void MaxBitErrorHandler();
+	void MaxPacketErrorHandler();
+	void DCCFunctionHandler(byte functionGroup, byte functions);
+	void DCCPomHandler(unsigned int Addr, byte instType, unsigned int CV, byte Value);
+	void DCCXpomHandler(byte instType, uint16_t cvIndex, byte cvOffset, const byte* data, byte count);
+	void ShowPomResult(bool valid);
+	bool CommandedReset(unsigned int CV, uint16_t value);
+	bool DCCServiceModeHandler(byte instType, unsigned int CV, byte Value);
+	void ConfigCVChanged(byte cvNum, uint16_t value);
+
+	// DCC events, called directly from DCCdecoder::DispatchEvents
+	friend class DCCdecoder;
+	void DCCFunctionEvent(int address, byte functionGroup, byte functions) { DCCFunctionHandler(functionGroup, functions); }
+	void DCCLocoPomEvent(int address, byte instructionType, int cv, byte data) { DCCPomHandler(address, instructionType, cv, data); }
+	void DCCLocoXpomEvent(int address, byte instructionType, uint16_t cvIndex, byte cvOffset, const byte* data, byte count) { DCCXpomHandler(instructionType, cvIndex, cvOffset, data, count); }
+	bool DCCServiceModeEvent(byte instructionType, int cv, byte data) { return DCCServiceModeHandler(instructionType, cv, data); }
+	void DCCBitstreamMaxErrorEvent(byte errorCode) { MaxBitErrorHandler(); }
+	void DCCPacketMaxErrorEvent(byte errorCode) { MaxPacketErrorHandler(); }
+
+	// timer and cv change handler wrappers
+	static void WrapperResetTimer(void* context);
+	static void WrapperErrorTimer(void* context);
+	static void WrapperConfigCVChange(void* context, byte cvNum, uint16_t value);
+};
+
+#endif
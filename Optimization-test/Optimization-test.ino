@@ -16,11 +16,82 @@
 //DCCpacket dccpacket(true, false, 100);
 DCCdecoder dcc;
 
+
+// Packet classification benchmark  ============================================================
+
+// the previous mask and compare classifier, kept here for comparison against the lookup table
+struct PacketSpec
+{
+	DCCdecoder::PacketType packetType;
+	byte specMask;
+	byte specAns;
+};
+
+const PacketSpec packetSpec[6] =
+{
+	{ DCCdecoder::IDLEPKT,       0xFF, 0xFF  },     // 11111111
+	{ DCCdecoder::LOCO_LONG,     0xC0, 0xC0  },     // 11AAAAAA    must follow IDLEPKT
+	{ DCCdecoder::ACCBROADCAST,  0xFF, 0xBF  },     // 10111111
+	{ DCCdecoder::ACCESSORY,     0xC0, 0x80  },     // 10AAAAAA    must follow ACCBROADCAST
+	{ DCCdecoder::BROADCAST,     0xFF, 0x00  },     // 00000000
+	{ DCCdecoder::LOCO_SHORT,    0x80, 0x00  },     // 0AAAAAAA    must follow BROADCAST
+};
+
+DCCdecoder::PacketType ClassifyByMask(byte firstByte)
+{
+	for (byte i = 0; i < 6; i++)
+		if ((firstByte & packetSpec[i].specMask) == packetSpec[i].specAns)
+			return packetSpec[i].packetType;
+	return DCCdecoder::IDLEPKT;
+}
+
+// first bytes of typical traffic mixes
+const byte idleMix[16] =      { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x03, 0x81, 0xFF, 0xFF };
+const byte locoMix[16] =      { 0x03, 0x03, 0xC4, 0xC4, 0x17, 0x17, 0xFF, 0x03, 0xC4, 0x2A, 0x2A, 0xD1, 0xD1, 0xFF, 0x03, 0x17 };
+const byte accessoryMix[16] = { 0x81, 0x81, 0x81, 0x81, 0x92, 0x92, 0x92, 0x92, 0xBF, 0xFF, 0x81, 0x81, 0xA0, 0xA0, 0xFF, 0x03 };
+
+const unsigned int iterations = 1000;
+volatile byte sink;            // keeps the compiler from discarding the classification results
+
+unsigned long TimeTable(const byte* mix)
+{
+	unsigned long start = micros();
+	for (unsigned int n = 0; n < iterations; n++)
+		for (byte i = 0; i < 16; i++)
+			sink = DCCdecoder::ClassifyPacket(mix[i]);
+	return micros() - start;
+}
+
+unsigned long TimeMask(const byte* mix)
+{
+	unsigned long start = micros();
+	for (unsigned int n = 0; n < iterations; n++)
+		for (byte i = 0; i < 16; i++)
+			sink = ClassifyByMask(mix[i]);
+	return micros() - start;
+}
+
+void RunBenchmark(const char* name, const byte* mix)
+{
+	// report the average time per 1000 packets in micros
+	Serial.print(name);
+	Serial.print("  table: ");
+	Serial.print(TimeTable(mix) / 16);
+	Serial.print("  mask: ");
+	Serial.println(TimeMask(mix) / 16);
+}
+
+
 // the setup function runs once when you press reset or power the board
 void setup() {
 	//bitStream.Resume();
 
-	dcc.SetupDecoder(0, 0, 0, true);
+	Serial.begin(115200);
+	Serial.println("Packet classification, micros per 1000 packets");
+	RunBenchmark("idle     ", idleMix);
+	RunBenchmark("loco     ", locoMix);
+	RunBenchmark("accessory", accessoryMix);
+
 	dcc.ResumeBitstream();
 }
 
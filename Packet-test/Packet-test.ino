@@ -52,13 +52,13 @@ BitStream bitStream;
 DCCpacket dccpacket(true, false, 250);
 
 
-void BitStreamHandler(unsigned long incomingBits)
+void BitStreamHandler(void* context, unsigned long incomingBits)
 {
-	dccpacket.ProcessIncomingBits(incomingBits);
+	dccpacket.ProcessIncomingBits(incomingBits, bitStream.LastBitTime());
 }
 
 
-void BitErrorHandler(byte errorCode)
+void BitErrorHandler(void* context, byte errorCode)
 {
 	if (gBitErrorCount < 25)
 		gBitErrorLog[gBitErrorCount] = errorCode;
@@ -70,15 +70,18 @@ void BitErrorHandler(byte errorCode)
 
 // dcc packet builder setup ============================================================
 
-void PacketErrorHandler(byte errorCode)
+void PacketErrorHandler(void* context, byte errorCode)
 {
 	if (gErrorCount < 25)
 		gErrorLog[gErrorCount] = errorCode;
 	gErrorCount++;
 }
 
-void RawPacketHandler(byte *packetBytes, byte byteCount)
+void RawPacketHandler(void* context, const DCCpacket::PacketView& packet)
 {
+	const byte* packetBytes = packet.data;
+	const byte byteCount = packet.size;
+
 	// Bump global packet count
 	++gPacketCount;
 
@@ -0,0 +1,261 @@
+#!/usr/bin/env python3
+#
+# This file is part of Arduino Turnout
+# Copyright (C) 2017-2018 Eric Thorstenson
+#
+# Arduino Turnout is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Arduino Turnout is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+"""
+Back up and restore the CVs of a decoder over its serial port, and show, compare and merge the backups.
+
+Usage:
+
+    cvbackup.py backup PORT FILE [baud]     save the CVs of the decoder on PORT to FILE (requires pyserial)
+    cvbackup.py restore PORT FILE [baud]    restore the CVs in FILE to the decoder on PORT
+    cvbackup.py show FILE                   list the CVs in FILE
+    cvbackup.py diff FILE FILE...           list the CVs that differ between the files
+    cvbackup.py merge BASE OTHER OUT [--only CVS] [--skip CVS]
+                                            write BASE to OUT, with the CVs it shares with OTHER taken
+                                            from OTHER. CVS is a list of CV numbers and ranges, such as
+                                            1,9,257-292. --skip 1,9 keeps the address of BASE.
+
+A file holds the blob sent by the CVBackup class. See CVBackup.h for the blob and frame layout.
+"""
+
+import os
+import sys
+import time
+
+from dccsniff import cobs_decode
+
+BLOB_MAGIC = 0x4243
+FORMAT_VERSION = 1
+CV_SECTION = 0
+FIRST_PAGED_CV = 257
+
+CMD_BACKUP = 1
+CMD_RESTORE = 2
+RESULTS = {0: "ok", 1: "unknown command", 2: "too long", 3: "failed crc", 4: "bad format",
+           5: "unknown cv", 6: "value out of range"}
+
+
+def crc16(data):
+    # CRC-16/CCITT as in RecordStore::UpdateCRC
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def cobs_encode(data):
+    out = bytearray()
+    run = bytearray()
+    for b in data:
+        if b == 0:
+            out += bytes([len(run) + 1]) + run
+            run = bytearray()
+        else:
+            run.append(b)
+            if len(run) == 254:
+                out += bytes([255]) + run
+                run = bytearray()
+    out += bytes([len(run) + 1]) + run
+    return bytes(out) + b"\0"
+
+
+def parse_blob(blob):
+    """Return the sections of a blob, as a list of (index, entries). The entries of the CV section are
+    (cv number, value) pairs, with 0 for the low byte of a 16 bit CV, and of a page are values from CV257."""
+    if len(blob) < 6 or crc16(blob[:-2]) != blob[-2] | (blob[-1] << 8):
+        raise ValueError("failed crc")
+    if blob[0] | (blob[1] << 8) != BLOB_MAGIC or blob[2] != FORMAT_VERSION:
+        raise ValueError("not a cv backup")
+
+    try:
+        return _parse_sections(blob)
+    except IndexError:
+        raise ValueError("bad format")
+
+
+def _parse_sections(blob):
+    sections = []
+    pos = 4
+    for _ in range(blob[3]):
+        index = blob[pos] | (blob[pos + 1] << 8)
+        count = blob[pos + 2]
+        pos += 3
+        if index == CV_SECTION:
+            entries = [(blob[pos + 2 * i], blob[pos + 2 * i + 1]) for i in range(count)]
+            pos += 2 * count
+        else:
+            entries = list(blob[pos:pos + count])
+            pos += count
+        sections.append((index, entries))
+    if pos != len(blob) - 2:
+        raise ValueError("bad format")
+    return sections
+
+
+def build_blob(sections):
+    blob = bytearray([BLOB_MAGIC & 0xFF, BLOB_MAGIC >> 8, FORMAT_VERSION, len(sections)])
+    for index, entries in sections:
+        blob += bytes([index & 0xFF, index >> 8, len(entries)])
+        for entry in entries:
+            blob += bytes(entry) if index == CV_SECTION else bytes([entry])
+    crc = crc16(blob)
+    return bytes(blob + bytes([crc & 0xFF, crc >> 8]))
+
+
+def cv_values(sections):
+    """Return the CVs as a dict of (page index, cv number) to value. A 16 bit CV of the CV section is
+    one value, and the CVs of a page are bytes, since the blob doesn't say which are 16 bit."""
+    cvs = {}
+    for index, entries in sections:
+        if index == CV_SECTION:
+            last = None
+            for cv, value in entries:
+                if cv == 0 and last is not None:
+                    cvs[last] = (cvs[last] << 8) | value
+                else:
+                    last = (CV_SECTION, cv)
+                    cvs[last] = value
+        else:
+            for offset, value in enumerate(entries):
+                cvs[(index, FIRST_PAGED_CV + offset)] = value
+    return cvs
+
+
+def set_cv(sections, key, value):
+    index, cv = key
+    for section, entries in sections:
+        if section != index:
+            continue
+        if index != CV_SECTION:
+            entries[cv - FIRST_PAGED_CV] = value
+            return
+        for i, (number, _) in enumerate(entries):
+            if number != cv:
+                continue
+            if i + 1 < len(entries) and entries[i + 1][0] == 0:
+                entries[i] = (cv, value >> 8)
+                entries[i + 1] = (0, value & 0xFF)
+            else:
+                entries[i] = (cv, value)
+            return
+
+
+def cv_name(key):
+    index, cv = key
+    return "CV%d" % cv if index == CV_SECTION else "page %d CV%d" % (index, cv)
+
+
+def parse_cv_list(text):
+    cvs = set()
+    for part in text.split(","):
+        first, _, last = part.partition("-")
+        cvs.update(range(int(first), int(last or first) + 1))
+    return cvs
+
+
+def read_blob(name):
+    with open(name, "rb") as f:
+        blob = f.read()
+    return blob, parse_blob(blob)
+
+
+def transact(port_name, baud, frame):
+    import serial    # pyserial, only needed to talk to a decoder
+    with serial.Serial(port_name, baud, timeout=2) as port:
+        # opening the port resets most AVR boards, so give the sketch time to start
+        time.sleep(2)
+        port.reset_input_buffer()
+        port.write(cobs_encode(frame))
+        data = bytearray()
+        while True:
+            chunk = port.read(1)
+            if not chunk:
+                raise IOError("no reply from decoder")
+            if chunk[0] != 0:
+                data += chunk
+                continue
+            # skip anything that isn't the reply, such as debug output
+            try:
+                reply = cobs_decode(bytes(data))
+            except ValueError:
+                reply = b""
+            data = bytearray()
+            if len(reply) >= 2 and reply[0] == frame[0]:
+                if reply[1] != 0:
+                    raise IOError("decoder replied: %s" % RESULTS.get(reply[1], reply[1]))
+                return reply[2:]
+
+
+def main(args):
+    if len(args) < 2:
+        print(__doc__)
+        return 1
+
+    command = args[0]
+    if command == "backup":
+        blob = transact(args[1], int(args[3]) if len(args) > 3 else 115200, bytes([CMD_BACKUP]))
+        parse_blob(blob)
+        with open(args[2], "wb") as f:
+            f.write(blob)
+    elif command == "restore":
+        blob, _ = read_blob(args[2])
+        transact(args[1], int(args[3]) if len(args) > 3 else 115200, bytes([CMD_RESTORE]) + blob)
+    elif command == "show":
+        for key, value in sorted(cv_values(read_blob(args[1])[1]).items()):
+            print("%-20s %d" % (cv_name(key), value))
+    elif command == "diff":
+        files = [cv_values(read_blob(name)[1]) for name in args[1:]]
+        names = [os.path.basename(name) for name in args[1:]]
+        widths = [max(6, len(name)) for name in names]
+        print("%-20s" % "" + "".join(" %*s" % (w, name) for w, name in zip(widths, names)))
+        for key in sorted(set().union(*files)):
+            values = [cvs.get(key) for cvs in files]
+            if len(set(values)) > 1:
+                print("%-20s" % cv_name(key) + "".join(" %*s" % (w, "-" if v is None else v) for w, v in zip(widths, values)))
+    elif command == "merge":
+        _, base = read_blob(args[1])
+        other = cv_values(read_blob(args[2])[1])
+        only = skip = None
+        options = args[4:]
+        for option, value in zip(options[::2], options[1::2]):
+            if option == "--only":
+                only = parse_cv_list(value)
+            elif option == "--skip":
+                skip = parse_cv_list(value)
+        for key, value in cv_values(base).items():
+            cv = key[1]
+            if key not in other or (only is not None and cv not in only) or (skip is not None and cv in skip):
+                continue
+            set_cv(base, key, other[key])
+        with open(args[3], "wb") as f:
+            f.write(build_blob(base))
+    else:
+        print(__doc__)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    try:
+        sys.exit(main(sys.argv[1:]))
+    except (ValueError, IOError) as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
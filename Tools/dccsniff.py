@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+#
+# This file is part of Arduino Turnout
+# Copyright (C) 2017-2018 Eric Thorstenson
+#
+# Arduino Turnout is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Arduino Turnout is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+"""
+Decode the binary packet records streamed by the PacketSniffer class into a readable log.
+
+Usage:
+
+    dccsniff.py /dev/ttyUSB0 [baud]     read from a serial port (requires pyserial)
+    dccsniff.py capture.bin             read from a file of captured serial data
+    dccsniff.py -                       read from stdin
+
+Each record is COBS encoded and terminated by a zero byte. See PacketSniffer.h for the record layout.
+"""
+
+import os
+import sys
+
+RECORD_PACKET_ERROR = 0x10
+RECORD_BIT_ERROR = 0x20
+RECORD_TIME_OVERFLOW = 0x40
+RECORD_DROPPED = 0x80
+
+PACKET_ERRORS = {1: "packet too long", 2: "packet too short", 3: "failed checksum", 4: "exceeded history size"}
+BIT_ERRORS = {1: "invalid half bit", 2: "half bit too short", 3: "half bit between 0 and 1",
+              4: "half bit too long", 10: "sequential error limit"}
+
+
+def cobs_decode(frame):
+    out = bytearray()
+    i = 0
+    while i < len(frame):
+        code = frame[i]
+        if code == 0 or i + code > len(frame) + 1:
+            raise ValueError("bad COBS frame")
+        out += frame[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(frame):
+            out.append(0)
+    return bytes(out)
+
+
+def packet_type(p):
+    # same classification as DCCdecoder::ProcessPacket
+    b = p[0]
+    if b == 0xFF:
+        return "idle"
+    if b == 0x00:
+        return "broadcast"
+    if b & 0x80 == 0:
+        return "loco %d" % b
+    if b & 0xC0 == 0xC0:
+        return "loco %d" % (((b & 0x3F) << 8) | p[1]) if len(p) > 1 else "loco long"
+    if b == 0xBF:
+        return "accessory broadcast"
+    if len(p) < 2:
+        return "accessory"
+    board = ((~p[1] & 0x70) << 2) | (b & 0x3F)
+    output = (((board - 1) << 2) | ((p[1] & 0x06) >> 1)) + 1
+    kind = "basic" if p[1] & 0x80 else "extended"
+    return "accessory %s board %d output %d" % (kind, board - 1, output)
+
+
+def format_record(record, clock):
+    flags = record[0] & 0xF0
+    size = record[0] & 0x0F
+    delta = record[1] | (record[2] << 8)
+    data = record[3:3 + size]
+
+    notes = []
+    if flags & RECORD_TIME_OVERFLOW:
+        notes.append("time overflow")
+    if flags & RECORD_DROPPED:
+        notes.append("records dropped")
+
+    if flags & RECORD_PACKET_ERROR:
+        text = "packet error: %s" % PACKET_ERRORS.get(data[0], data[0])
+    elif flags & RECORD_BIT_ERROR:
+        text = "bit error: %s" % BIT_ERRORS.get(data[0], data[0])
+    else:
+        text = "%-20s %s" % (" ".join("%02X" % b for b in data), packet_type(data))
+
+    line = "%12.3f ms  +%6d us  %s" % (clock / 1000.0, delta, text)
+    if notes:
+        line += "  [" + ", ".join(notes) + "]"
+    return line
+
+
+def frames(stream):
+    frame = bytearray()
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            return
+        for b in chunk:
+            if b == 0:
+                if frame:
+                    yield bytes(frame)
+                frame = bytearray()
+            else:
+                frame.append(b)
+
+
+def open_input(args):
+    if not args or args[0] == "-":
+        return sys.stdin.buffer
+    name = args[0]
+    if os.path.isfile(name):
+        return open(name, "rb")
+    import serial    # pyserial, only needed for live capture
+    baud = int(args[1]) if len(args) > 1 else 115200
+    port = serial.Serial(name, baud, timeout=1)
+    port.read = _blocking(port.read)
+    return port
+
+
+def _blocking(read):
+    # keep reading through serial timeouts, so an idle layout doesn't end the capture
+    def wrapped(n):
+        while True:
+            data = read(n)
+            if data:
+                return data
+    return wrapped
+
+
+def main(args):
+    clock = 0
+    bad = 0
+    for frame in frames(open_input(args)):
+        try:
+            record = cobs_decode(frame)
+        except ValueError:
+            bad += 1
+            continue
+        if len(record) < 3 or len(record) != 3 + (record[0] & 0x0F):
+            bad += 1    # e.g. a partial record at the start of the capture
+            continue
+        clock += record[1] | (record[2] << 8)
+        print(format_record(record, clock))
+    if bad:
+        print("%d malformed records skipped" % bad, file=sys.stderr)
+
+
+if __name__ == "__main__":
+    try:
+        main(sys.argv[1:])
+    except KeyboardInterrupt:
+        pass
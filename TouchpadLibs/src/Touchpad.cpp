@@ -13,9 +13,10 @@ void Touchpad::Init()
 	transitionToIdle();
 }
 
-void Touchpad::SetGraphicButtonHandler(GraphicButtonHandler handler)
+void Touchpad::SetGraphicButtonHandler(GraphicButtonHandler handler, void* context)
 {
 	graphicButtonHandler = handler;
+	handlerContext = context;
 }
 
 void Touchpad::Update()
@@ -43,7 +44,7 @@ void Touchpad::transitionToIdle()
 		if (b.Type() == GraphicButton::MOMENTARY && b.IsPressed())
 		{
 			ButtonRelease(&b);
-			if (graphicButtonHandler) graphicButtonHandler(b.ButtonID(), false);
+			if (graphicButtonHandler) graphicButtonHandler(handlerContext, b.ButtonID(), false);
 		}
 	}
 
@@ -91,12 +92,12 @@ void Touchpad::transitionToTouched()
 			if (b.Type() == GraphicButton::MOMENTARY)
 			{
 				ButtonPress(&b);
-				if (graphicButtonHandler) graphicButtonHandler(b.ButtonID(), true);
+				if (graphicButtonHandler) graphicButtonHandler(handlerContext, b.ButtonID(), true);
 			}
 			if (b.Type() == GraphicButton::LATCHING && !b.IsPressed())
 			{
 				ButtonPress(&b);
-				if (graphicButtonHandler) graphicButtonHandler(b.ButtonID(), true);
+				if (graphicButtonHandler) graphicButtonHandler(handlerContext, b.ButtonID(), true);
 			}
 		}
 	}
@@ -19,13 +19,13 @@
 class Touchpad
 {
 public:
-	typedef void(*GraphicButtonHandler)(byte buttonID, bool state);
+	typedef void(*GraphicButtonHandler)(void* context, byte buttonID, bool state);
 
 	Touchpad();
 	void Init();
 	void Update();
 	void Update(uint32_t curMillis);
-	void SetGraphicButtonHandler(GraphicButtonHandler handler);
+	void SetGraphicButtonHandler(GraphicButtonHandler handler, void* context = 0);
 	void SetButtonPress(byte buttonID, bool isPressed);
 
 	enum buttonIDs : byte
@@ -154,6 +154,7 @@ private:
 	void ButtonRelease(GraphicButton* b);
 
 	GraphicButtonHandler graphicButtonHandler = 0;
+	void* handlerContext = 0;           // context passed to the handler
 };
 
 #endif
@@ -34,6 +34,8 @@ void setup()
 
 	Serial.begin(115200);
 	delay(1000);   // delay for Serial.print in factory reset (??)
+#elif defined(WITH_CV_BACKUP)
+	Serial.begin(115200);    // for cv backup and restore
 #endif
 
     // initialize the turnout manager
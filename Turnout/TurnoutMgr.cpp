@@ -28,30 +28,29 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 // TurnoutMgr constructor
 TurnoutMgr::TurnoutMgr()
 {
-	// set pointer to this instance of the turnout manager, so that we can reference it in callbacks
-	currentInstance = this;
-
 	// configure sensor/servo event handlers
-	button.SetButtonPressHandler(WrapperButtonPress);
-	osStraight.SetButtonPressHandler(WrapperOSStraight);
-	osCurved.SetButtonPressHandler(WrapperOSCurved);
-
-	// configure dcc event handlers
-	dcc.SetBasicAccessoryDecoderPacketHandler(WrapperDCCAccPacket);
-	dcc.SetExtendedAccessoryDecoderPacketHandler(WrapperDCCExtPacket);
-	dcc.SetBasicAccessoryPomPacketHandler(WrapperDCCAccPomPacket);
-	dcc.SetBitstreamMaxErrorHandler(WrapperMaxBitErrors);
-	dcc.SetPacketMaxErrorHandler(WrapperMaxPacketErrors);
-	dcc.SetDecodingErrorHandler(WrapperDCCDecodingError);
+	button.SetButtonPressHandler(WrapperButtonPress, this);
+	osStraight.SetButtonPressHandler(WrapperOSStraight, this);
+	osCurved.SetButtonPressHandler(WrapperOSCurved, this);
+
+	// enable the dcc events handled here, in addition to those handled in TurnoutBase
+	dcc.EnableEvents(DCCEvent::Bit(DCCEvent::BASIC_ACC) | DCCEvent::Bit(DCCEvent::BASIC_ACC_POM) |
+		DCCEvent::Bit(DCCEvent::SERVICE_MODE));
+
+	// dcc resets and emergency stops are handled immediately, rather than through the event queue
+	dcc.SetEmergencyStopHandler(WrapperEmergencyStop, this);
 
 	// configure timer event handlers
-	errorTimer.SetTimerHandler(WrapperErrorTimer);
-	resetTimer.SetTimerHandler(WrapperResetTimer);
-	servoTimer.SetTimerHandler(WrapperServoTimer);
+	errorTimer.SetTimerHandler(WrapperErrorTimer, this);
+	resetTimer.SetTimerHandler(WrapperResetTimer, this);
+	servoTimer.SetTimerHandler(WrapperServoTimer, this);
 
 	// configure servo event handlers
 	for (byte i = 0; i < numServos; i++)
-		servo[i].SetServoMoveDoneHandler(WrapperServoMoveDone);
+		servo[i].SetServoMoveDoneHandler(WrapperServoMoveDone, this);
+
+	// update the servos when their cvs change
+	cv.subscribe(CV_servo1MinTravel, CV_servoHighSpeed, WrapperServoCVChange, this);
 }
 
 
@@ -82,6 +81,9 @@ void TurnoutMgr::Update()
 	// do all the updates that TurnoutBase handles
 	TurnoutBase::Update();
 
+	// handle the decoded dcc events, leaving them queued while the servos are in motion
+	if (!servosActive) dcc.DispatchEvents(*this, maxDispatchEvents);
+
 	// then update our sensors and servo
 	const unsigned long currentMillis = millis();
 	osStraight.Update(currentMillis);
@@ -119,17 +121,15 @@ void TurnoutMgr::InitMain()
 
 
 // set the turnout to a new position
-void TurnoutMgr::BeginServoMove()
+void TurnoutMgr::BeginServoMove(unsigned long packetTime)
 {
-	// store new position to cv
-	cv.setCV(CV_turnoutPosition, position);
-	SaveConfig();
-
 	// set the led to indicate servo is in motion
 	led.SetLED((position == STRAIGHT) ? RgbLed::GREEN : RgbLed::RED, RgbLed::FLASH);
 
-	// stop the bitstream capture
+	// stop the bitstream capture, if it shares timer1 with the servos
+#if defined(BITSTREAM_USES_TIMER1)
 	dcc.SuspendBitstream();
+#endif
 
 	// turn off the relays
 	relayStraight.SetPin(LOW);
@@ -144,8 +144,14 @@ void TurnoutMgr::BeginServoMove()
 
 	// set the servo index to the first servo and start moving the servos in sequence
 	servosActive = true;
+	servosStopped = false;
 	currentServo = 0;
 	ServoMoveDoneHandler();
+
+	// record the latency from the end of a dcc packet to the start of the servo motion, before the new
+	// position is stored, so that it doesn't include the save
+	dccLatency.Record(packetTime);
+	SavePosition();
 }
 
 
@@ -173,9 +179,11 @@ void TurnoutMgr::EndServoMove()
 		relayCurved.SetPin(HIGH);
 	}
 
-	// resume the bitstream capture
+	// resume the bitstream capture, if it was suspended for the motion
 	servosActive = false;
+#if defined(BITSTREAM_USES_TIMER1)
 	dcc.ResumeBitstream();
+#endif
 }
 
 
@@ -188,9 +196,9 @@ void TurnoutMgr::EndServoMove()
 void TurnoutMgr::ResetTimerHandler()
 {
 	// enable button/occupancy sensor handlers
-	button.SetButtonPressHandler(WrapperButtonPress);
-	osStraight.SetButtonPressHandler(WrapperOSStraight);
-	osCurved.SetButtonPressHandler(WrapperOSCurved);
+	button.SetButtonPressHandler(WrapperButtonPress, this);
+	osStraight.SetButtonPressHandler(WrapperOSStraight, this);
+	osCurved.SetButtonPressHandler(WrapperOSCurved, this);
 
 	// run the main init after the reset timer expires
 	InitMain();
@@ -252,7 +260,7 @@ void TurnoutMgr::OSStraightHandler(bool ButtonState)
 	const State newPos = (occupancySensorSwap) ? CURVED : STRAIGHT;
 
 	// check occupancy sensor state (LOW so we respond when train detected)
-	if (ButtonState == LOW && newPos != position)
+	if (ButtonState == LOW && (newPos != position || servosStopped))
 	{
 		position = newPos;
 		servoRate = HIGH;
@@ -267,7 +275,7 @@ void TurnoutMgr::OSCurvedHandler(bool ButtonState)
 	const State newPos = (occupancySensorSwap) ? STRAIGHT : CURVED;
 
 	// check occupancy sensor state (LOW so we respond when train detected)
-	if (ButtonState == LOW && newPos != position)
+	if (ButtonState == LOW && (newPos != position || servosStopped))
 	{
 		position = newPos;
 		servoRate = HIGH;
@@ -286,7 +294,7 @@ void TurnoutMgr::DCCAccCommandHandler(unsigned int Addr, unsigned int Direction)
 	if (dccCommandSwap) dccState = (State)!dccState; // swap the interpretation of dcc command if needed
 
 	// if we are already in the desired position, just exit
-	if (dccState == position) return;
+	if (dccState == position && !servosStopped) return;
 
 #ifdef _DEBUG
 	Serial.print("Received dcc command to position ");
@@ -299,7 +307,7 @@ void TurnoutMgr::DCCAccCommandHandler(unsigned int Addr, unsigned int Direction)
 		// set switch state based on dcc command
 		position = dccState;
 		servoRate = LOW;
-		BeginServoMove();
+		BeginServoMove(dcc.PacketTime());
 	}
 	else
 	{
@@ -311,55 +319,88 @@ void TurnoutMgr::DCCAccCommandHandler(unsigned int Addr, unsigned int Direction)
 
 
 
-// handle a DCC program on main command
-void TurnoutMgr::DCCPomHandler(unsigned int Addr, byte instType, unsigned int CV, byte Value)
+// freeze the servos where they are and cut their power, on a dcc reset or emergency stop
+void TurnoutMgr::EmergencyStopHandler()
+{
+	if (!servosActive) return;
+
+	servoPower.SetPin(LOW);
+	for (byte i = 0; i < numServos; i++)
+	{
+		servo[i].Stop();
+		servo[i].StopPWM();
+	}
+
+	// the points may be part way, so leave the relays off and flash an error until the next move
+	servoTimer.StopTimer();
+	servosActive = false;
+	servosStopped = true;
+	led.SetLED(RgbLed::YELLOW, RgbLed::FLASH);
+
+	// record the reaction time from the end of the stop packet
+	stopLatency.Record(dcc.PacketTime());
+}
+
+
+// update the servo when one of its cvs is changed
+void TurnoutMgr::ServoCVChanged(byte cvNum, uint16_t value)
 {
-	// do most of the program on main stuff in TurnoutBase
-	TurnoutBase::DCCPomHandler(Addr, instType, CV, Value);
-
-	// update servo vars from eeprom
-	if (CV == CV_servo1MinTravel) servo[0].SetExtent(LOW, cv.getCV(CV_servo1MinTravel));
-	if (CV == CV_servo1MaxTravel) servo[0].SetExtent(HIGH, cv.getCV(CV_servo1MaxTravel));
-	if (CV == CV_servoLowSpeed) servo[0].SetDuration(LOW, cv.getCV(CV_servoLowSpeed) * 100);
-	if (CV == CV_servoHighSpeed) servo[0].SetDuration(HIGH, cv.getCV(CV_servoHighSpeed) * 100);
+	// a service mode write only sets the extent, since the servo power is the ack output on the
+	// programming track, and the servos move to it with the next command
+	const bool move = !dcc.IsServiceMode();
+
+	switch (cvNum)
+	{
+	case CV_servo1MinTravel: servo[0].SetExtent(LOW, value, move); break;
+	case CV_servo1MaxTravel: servo[0].SetExtent(HIGH, value, move); break;
+	case CV_servoLowSpeed: servo[0].SetDuration(LOW, value * 100); break;
+	case CV_servoHighSpeed: servo[0].SetDuration(HIGH, value * 100); break;
+	}
 }
 
 
-// ========================================================================================================
+// handle a DCC service mode instruction, returns true to acknowledge it
+bool TurnoutMgr::DCCServiceModeHandler(byte instType, unsigned int CV, byte Value)
+{
+	// writes are made as for program on main, and acknowledged once the cv holds the new value
+	const int16_t writeValue = cv.getWriteValue(instType, CV, Value);
+	if (writeValue < 0) return cv.verifyCV(instType, CV, Value);
+
+	DCCPomHandler(0, CVManager::CV_WRITE, CV, writeValue);
+	return cv.verifyCV(CVManager::CV_VERIFY, CV, writeValue);
+}
 
-TurnoutMgr *TurnoutMgr::currentInstance = 0;    // pointer to allow us to access member objects from callbacks
 
-												// servo/sensor callback wrappers
-void TurnoutMgr::WrapperButtonPress(bool ButtonState) { currentInstance->ButtonEventHandler(ButtonState); }
-void TurnoutMgr::WrapperOSStraight(bool ButtonState) { currentInstance->OSStraightHandler(ButtonState); }
-void TurnoutMgr::WrapperOSCurved(bool ButtonState) { currentInstance->OSCurvedHandler(ButtonState); }
-void TurnoutMgr::WrapperServoMoveDone() { currentInstance->ServoMoveDoneHandler(); }
+// ========================================================================================================
+// servo/sensor callback wrappers, with the manager instance as the context
+void TurnoutMgr::WrapperButtonPress(void* context, bool ButtonState) { static_cast<TurnoutMgr*>(context)->ButtonEventHandler(ButtonState); }
+void TurnoutMgr::WrapperOSStraight(void* context, bool ButtonState) { static_cast<TurnoutMgr*>(context)->OSStraightHandler(ButtonState); }
+void TurnoutMgr::WrapperOSCurved(void* context, bool ButtonState) { static_cast<TurnoutMgr*>(context)->OSCurvedHandler(ButtonState); }
+void TurnoutMgr::WrapperServoMoveDone(void* context) { static_cast<TurnoutMgr*>(context)->ServoMoveDoneHandler(); }
+void TurnoutMgr::WrapperEmergencyStop(void* context) { static_cast<TurnoutMgr*>(context)->EmergencyStopHandler(); }
+void TurnoutMgr::WrapperServoCVChange(void* context, byte cvNum, uint16_t value) { static_cast<TurnoutMgr*>(context)->ServoCVChanged(cvNum, value); }
 
 
 // ========================================================================================================
-// dcc processor callback wrappers
+// dcc events, dispatched by DCCdecoder::DispatchEvents
 
-void TurnoutMgr::WrapperDCCAccPacket(int boardAddress, int outputAddress, byte activate, byte data)
+void TurnoutMgr::DCCBasicAccEvent(int boardAddress, int outputAddress, byte activate, byte data)
 {
-	currentInstance->DCCAccCommandHandler(outputAddress, data);
+	DCCAccCommandHandler(outputAddress, data);
 }
 
-void TurnoutMgr::WrapperDCCExtPacket(int boardAddress, int outputAddress, byte data)
+void TurnoutMgr::DCCBasicAccPomEvent(int boardAddress, int outputAddress, byte instructionType, int cv, byte data)
 {
-	currentInstance->DCCExtCommandHandler(outputAddress, data);
+	DCCPomHandler(outputAddress, instructionType, cv, data);
 }
 
-void TurnoutMgr::WrapperDCCAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data)
+bool TurnoutMgr::DCCServiceModeEvent(byte instructionType, int cv, byte data)
 {
-	currentInstance->DCCPomHandler(outputAddress, instructionType, cv, data);
+	return DCCServiceModeHandler(instructionType, cv, data);
 }
 
-void TurnoutMgr::WrapperMaxBitErrors(byte errorCode) { currentInstance->TurnoutBase::MaxBitErrorHandler(); }
-void TurnoutMgr::WrapperMaxPacketErrors(byte errorCode) { currentInstance->TurnoutBase::MaxPacketErrorHandler(); }
-void TurnoutMgr::WrapperDCCDecodingError(byte errorCode) { currentInstance->TurnoutBase::DCCDecodingError(); }
-
 
 // timer callback wrappers
-void TurnoutMgr::WrapperResetTimer() { currentInstance->ResetTimerHandler(); }
-void TurnoutMgr::WrapperErrorTimer() { currentInstance->ErrorTimerHandler(); }
-void TurnoutMgr::WrapperServoTimer() { currentInstance->EndServoMove(); }
+void TurnoutMgr::WrapperResetTimer(void* context) { static_cast<TurnoutMgr*>(context)->ResetTimerHandler(); }
+void TurnoutMgr::WrapperErrorTimer(void* context) { static_cast<TurnoutMgr*>(context)->ErrorTimerHandler(); }
+void TurnoutMgr::WrapperServoTimer(void* context) { static_cast<TurnoutMgr*>(context)->EndServoMove(); }
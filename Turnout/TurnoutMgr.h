@@ -56,25 +56,37 @@ received by the BitStream object, which then sends them to the DCCpacket object
 into a full DCC packet. It also handles millis-related updates for the LED, sensors, timers and
 servo.
 
-The BeginServoMove method configures the turnout prior to beginning a servo motion. It stores the
-new position to EEPROM, starts the LED flashing, disables relays, and stops the bitstream capture.
-It then starts PWM for the servo and enables the servo power pin. It then calls the ServoMoveDoneHandler
-to perform the actual motion. After the final servo motion is complete, the EndServoMove method is
+The BeginServoMove method configures the turnout prior to beginning a servo motion. It starts the LED
+flashing, disables relays, and stops the bitstream capture if it shares timer1 with the servos. It
+then starts PWM for the servo and enables the servo power pin. It then calls the ServoMoveDoneHandler
+to perform the actual motion. For a DCC command it is given the packet time, and records the latency
+once the motion has started, and only then stores the new position, so the latency doesn't include
+the save. After the final servo motion is complete, the EndServoMove method is
 called via the servoTimer event handler. The EndServoMove method sets the LED for the new position,
-stops the servo PWM and disables the servo power, resumes the bitstream capture, and sets the relays.
+stops the servo PWM and disables the servo power, resumes the bitstream capture if it was
+suspended, and sets the relays.
 
 The ButtonEventHandler, OSStraightHandler, and OSCurvedHandler respond to events from
 the button and occupancy sensors, and trigger a change in the turnout position.
 
 The DCCAccCommandHandler processes a basic accessory command, used to set the position of the
 turnout. Occupancy sensors are checked prior to setting the turnout, with an error indication given
-if they are occupied. The DCCPomHandler method processes a program on main packet. It checks for a 
-valid CV, stores the data via the DCCdecoder object, and then re-reads the basic configuration for 
-the turnout.
-
-Event handler wrappers for the sensors, button, servo, timer, and DCC classes are static, so that
-they are accessible as callbacks from those classes. An instance variable provides access to the
-instance of the turnout manager, where the actual callback handling takes place.
+if they are occupied. The DCCPomHandler method of TurnoutBase processes a program on main packet. A
+change to one of the servo CVs is passed to the ServoCVChanged handler, which is subscribed to those
+CVs, and updates just the extent or duration of the servo that the CV sets.
+
+The DCCServiceModeHandler method processes a service mode instruction on the programming track.
+Verifies are checked against the CVs, and writes are made through the DCCPomHandler so that the
+servos are updated by the CV change handler. The instruction is acknowledged with a pulse of servo
+power, for a verify that matches or a completed write. Since the servo power is the ack output, a
+write in service mode sets a new extent without moving the servos, and the resets sent around each
+instruction don't reach the EmergencyStopHandler.
+
+Event handler wrappers for the sensors, button, servo, and timer classes are static, so that
+they are accessible as callbacks from those classes. Each callback is set with this instance as its
+context, which the wrapper uses to pass the event to the turnout manager, so that several managers
+may run side by side. The DCC events are
+instead bound at compile time, with the DCCdecoder calling the DCC event methods directly.
 
 */
 
@@ -101,7 +113,7 @@ public:
 private:
 	// main functions
 	void InitMain();
-	void BeginServoMove();
+	void BeginServoMove(unsigned long packetTime = 0);
 	void EndServoMove();
 
 	// Sensors and outputs
@@ -124,31 +136,28 @@ private:
 	void OSStraightHandler(bool ButtonState);
 	void OSCurvedHandler(bool ButtonState);
 	void DCCAccCommandHandler(unsigned int Addr, unsigned int Direction);
-	void DCCPomHandler(unsigned int Addr, byte instType, unsigned int CV, byte Value);
-
-	// pointer to allow us to access member objects from callbacks
-	static TurnoutMgr *currentInstance;
+	bool DCCServiceModeHandler(byte instType, unsigned int CV, byte Value);
+	void EmergencyStopHandler();
+	void ServoCVChanged(byte cvNum, uint16_t value);
 
 	// Turnout manager event handler wrappers
-	static void WrapperButtonPress(bool ButtonState);
-	static void WrapperOSStraight(bool ButtonState);
-	static void WrapperOSCurved(bool ButtonState);
-	static void WrapperServoMoveDone();
-
-	// DCC event handler wrappers
-	static void WrapperDCCAccPacket(int boardAddress, int outputAddress, byte activate, byte data);
-	static void WrapperDCCExtPacket(int boardAddress, int outputAddress, byte data);
-	static void WrapperDCCAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data);
+	static void WrapperButtonPress(void* context, bool ButtonState);
+	static void WrapperOSStraight(void* context, bool ButtonState);
+	static void WrapperOSCurved(void* context, bool ButtonState);
+	static void WrapperServoMoveDone(void* context);
+	static void WrapperEmergencyStop(void* context);
+	static void WrapperServoCVChange(void* context, byte cvNum, uint16_t value);
+
+	// DCC events, called directly from DCCdecoder::DispatchEvents
+	friend class DCCdecoder;
+	void DCCBasicAccEvent(int boardAddress, int outputAddress, byte activate, byte data);
+	void DCCBasicAccPomEvent(int boardAddress, int outputAddress, byte instructionType, int cv, byte data);
+	bool DCCServiceModeEvent(byte instructionType, int cv, byte data);
 
 	// Turnout manager event handler wrappers
-	static void WrapperResetTimer();
-	static void WrapperErrorTimer();
-	static void WrapperServoTimer();
-
-	// Wrappers for events in Turnoutbase
-	static void WrapperMaxBitErrors(byte errorCode);
-	static void WrapperMaxPacketErrors(byte errorCode);
-	static void WrapperDCCDecodingError(byte errorCode);
+	static void WrapperResetTimer(void* context);
+	static void WrapperErrorTimer(void* context);
+	static void WrapperServoTimer(void* context);
 };
 
 
@@ -21,6 +21,49 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include "TurnoutBase.h"
 
 
+// factory default CVs
+const CVManager::CVstatic TurnoutBase::cvSchema[numCVindexes] PROGMEM =
+{
+	CVManager::CV8(CV_AddressLSB, 1, 0, 255, false),
+	CVManager::CV8(CV_AddressMSB, 0, 0, 255, false),
+	CVManager::CV8(CV_servo1MinTravel, 90, 45, 135, false),
+	CVManager::CV8(CV_servo1MaxTravel, 90, 45, 135, false),
+	CVManager::CV8(CV_servoLowSpeed, 25),
+	CVManager::CV8(CV_servoHighSpeed, 0),
+	CVManager::CV8(CV_occupancySensorSwap, 0),
+	CVManager::CV8(CV_dccCommandSwap, 0),
+	CVManager::CV8(CV_relaySwap, 0),
+	CVManager::CV8(CV_Aux1Off, 10),
+	CVManager::CV8(CV_Aux1On, 11),
+	CVManager::CV8(CV_Aux2Off, 20),
+	CVManager::CV8(CV_Aux2On, 21),
+	CVManager::CV8(CV_positionIndicationToggle, 1),
+	CVManager::CV8(CV_errorIndicationToggle, 2),
+	CVManager::CV8(CV_turnoutPosition, 0, 0, 1, false),
+	CVManager::CV8(CV_servo2MinTravel, 90, 45, 135, false),
+	CVManager::CV8(CV_servo2MaxTravel, 90, 45, 135, false),
+	CVManager::CV8(CV_servo3MinTravel, 90, 45, 135, false),
+	CVManager::CV8(CV_servo3MaxTravel, 90, 45, 135, false),
+	CVManager::CV8(CV_servo4MinTravel, 90, 45, 135, false),
+	CVManager::CV8(CV_servo4MaxTravel, 90, 45, 135, false),
+};
+
+// cv order of the config stored without a header, by firmware from before the config was versioned
+const byte TurnoutBase::cvLayoutV0[numCVindexes] PROGMEM =
+{
+	CV_AddressLSB, CV_AddressMSB, CV_servo1MinTravel, CV_servo1MaxTravel, CV_servoLowSpeed, CV_servoHighSpeed,
+	CV_occupancySensorSwap, CV_dccCommandSwap, CV_relaySwap, CV_Aux1Off, CV_Aux1On, CV_Aux2Off, CV_Aux2On,
+	CV_positionIndicationToggle, CV_errorIndicationToggle, CV_turnoutPosition, CV_servo2MinTravel,
+	CV_servo2MaxTravel, CV_servo3MinTravel, CV_servo3MaxTravel, CV_servo4MinTravel, CV_servo4MaxTravel,
+};
+
+// earlier config versions that can be migrated
+const CVStore::Layout TurnoutBase::configLayouts[numConfigLayouts] PROGMEM =
+{
+	{ 0, numCVindexes, cvLayoutV0 },
+};
+
+
 // ========================================================================================================
 // Public Methods
 
@@ -28,6 +71,22 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 // TurnoutMgr constructor
 TurnoutBase::TurnoutBase()
 {
+	// queue the dcc events, so that they are handled from Update after the timestamps are processed
+	dcc.EnableEvents(baseDCCEvents);
+	dcc.SetEventQueue(&dccEvents);
+
+	// acknowledge service mode instructions with a pulse of servo power
+	dcc.SetAckOutput(ServoPowerPin);
+
+	// update the swap options and signal aspects when their cvs change
+	cv.subscribe(CV_occupancySensorSwap, CV_errorIndicationToggle, WrapperConfigCVChange, this);
+
+	// save the cvs written by program on main in a patch record, rather than the whole config
+	cvStore.SetPatchKey(configPatchKey);
+
+#if defined(WITH_CV_BACKUP)
+	cvBackup.SetRestoreHandler(WrapperCVRestore, this);
+#endif
 }
 
 
@@ -49,6 +108,25 @@ void TurnoutBase::Update()
 
 	// update sensors
 	button.Update(currentMillis);
+
+#if defined(WITH_CV_BACKUP)
+	// handle a cv backup or restore command from the serial port
+	cvBackup.Update();
+#endif
+
+	// write the queued config and position records, as far as the eeprom writer has room
+	store.Update();
+
+#if defined(_DEBUG) && !defined(WITH_CV_BACKUP)
+	// print the latency statistics on demand, when an L is received on the serial port
+	if (Serial.available() > 0 && Serial.read() == 'L')
+	{
+		Serial.print("Command ");
+		dccLatency.Report(Serial);
+		Serial.print("Emergency stop ");
+		stopLatency.Report(Serial);
+	}
+#endif
 }
 
 
@@ -59,32 +137,6 @@ void TurnoutBase::Update()
 // Initialize the turnout manager by setting up the dcc config, reading stored values from CVs, and setting up the servo
 void TurnoutBase::InitMain()
 {
-
-	// configure factory default CVs
-	byte index = 0;
-	index = cv.initCV(index, CV_AddressLSB, 1, 0, 255, false);
-	index = cv.initCV(index, CV_AddressMSB, 0, 0, 255, false);
-	index = cv.initCV(index, CV_servo1MinTravel, 90, 45, 135, false);
-	index = cv.initCV(index, CV_servo1MaxTravel, 90, 45, 135, false);
-	index = cv.initCV(index, CV_servoLowSpeed, 25);
-	index = cv.initCV(index, CV_servoHighSpeed, 0);
-	index = cv.initCV(index, CV_occupancySensorSwap, 0);
-	index = cv.initCV(index, CV_dccCommandSwap, 0);
-	index = cv.initCV(index, CV_relaySwap, 0);
-	index = cv.initCV(index, CV_Aux1Off, 10);
-	index = cv.initCV(index, CV_Aux1On, 11);
-	index = cv.initCV(index, CV_Aux2Off, 20);
-	index = cv.initCV(index, CV_Aux2On, 21);
-	index = cv.initCV(index, CV_positionIndicationToggle, 1);
-	index = cv.initCV(index, CV_errorIndicationToggle, 2);
-	index = cv.initCV(index, CV_turnoutPosition, 0, 0, 1, false);
-	index = cv.initCV(index, CV_servo2MinTravel, 90, 45, 135, false);
-	index = cv.initCV(index, CV_servo2MaxTravel, 90, 45, 135, false);
-	index = cv.initCV(index, CV_servo3MinTravel, 90, 45, 135, false);
-	index = cv.initCV(index, CV_servo3MaxTravel, 90, 45, 135, false);
-	index = cv.initCV(index, CV_servo4MinTravel, 90, 45, 135, false);
-	cv.initCV(index, CV_servo4MaxTravel, 90, 45, 135, false);
-
 	// load config
 	LoadConfig();
 
@@ -92,10 +144,12 @@ void TurnoutBase::InitMain()
 	byte addr = (cv.getCV(CV_AddressMSB) << 8) + cv.getCV(CV_AddressLSB);
 	dcc.SetAddress(addr);
 
-	// get variables from cv's
+	// get variables from cv's, which are then kept up to date by ConfigCVChanged
 	occupancySensorSwap = cv.getCV(CV_occupancySensorSwap);
 	dccCommandSwap = cv.getCV(CV_dccCommandSwap);
 	relaySwap = cv.getCV(CV_relaySwap);
+	for (byte i = 0; i < numAspectCVs; i++)
+		signalAspects[i] = cv.getCV(CV_Aux1Off + i);
 
 	// set the current position based on the stored position
 	position = (cv.getCV(CV_turnoutPosition) == 0) ? STRAIGHT : CURVED;
@@ -116,6 +170,7 @@ void TurnoutBase::FactoryReset(bool HardReset)
 	// do the cv reset
 	cv.resetCVs();
 	SaveConfig();
+	SavePositionRecord();
 }
 
 
@@ -171,25 +226,25 @@ void TurnoutBase::DCCExtCommandHandler(unsigned int Addr, unsigned int Data)
 #endif
 
 	// process a matching signal aspect to turn aux outputs on or off
-	if (Data == cv.getCV(CV_Aux1Off))
+	if (Data == SignalAspect(CV_Aux1Off))
 	{
 		auxOutput1.SetPin(LOW);
 		return;
 	}
 
-	if (Data == cv.getCV(CV_Aux1On))
+	if (Data == SignalAspect(CV_Aux1On))
 	{
 		auxOutput1.SetPin(HIGH);
 		return;
 	}
 
-	if (Data == cv.getCV(CV_Aux2Off))
+	if (Data == SignalAspect(CV_Aux2Off))
 	{
 		auxOutput2.SetPin(LOW);
 		return;
 	}
 
-	if (Data == cv.getCV(CV_Aux2On))
+	if (Data == SignalAspect(CV_Aux2On))
 	{
 		auxOutput2.SetPin(HIGH);
 		return;
@@ -197,7 +252,7 @@ void TurnoutBase::DCCExtCommandHandler(unsigned int Addr, unsigned int Data)
 
 
 	// process a matching signal aspect to toggle error indication
-	if (Data == cv.getCV(CV_errorIndicationToggle))
+	if (Data == SignalAspect(CV_errorIndicationToggle))
 	{
 		showErrorIndication = !showErrorIndication;
 
@@ -227,79 +282,160 @@ void TurnoutBase::DCCPomHandler(unsigned int Addr, byte instType, unsigned int C
 	Serial.println(Value, DEC);
 #endif
 
+	// a verify would be answered by railcom, which isn't supported, so the led shows if the cv matches
+	const int16_t writeValue = cv.getWriteValue(instType, CV, Value);
+	if (writeValue < 0)
+	{
+		ShowPomResult(cv.verifyCV(instType, CV, Value));
+		return;
+	}
+
 	// check for and perform cv commanded reset
-	if (CV == CV_reset)
+	if (CommandedReset(CV, writeValue)) return;
+
+	// set the cv, where a bit manipulation changes only the one bit, and save it
+	const bool valid = cv.setCV(CV, writeValue);
+	ShowPomResult(valid);
+	if (valid) SaveCV(CV);
+}
+
+
+// handle a DCC extended program on main command, for up to four cvs starting at the given one. the
+// turnout has no cv pages, so only an index of 0 is used, with the offset addressing CV1-256.
+void TurnoutBase::DCCXpomHandler(byte instType, uint16_t cvIndex, byte cvOffset, const byte* data, byte count)
+{
+	const unsigned int firstCV = cvOffset + 1;
+	if (cvIndex != 0)
 	{
-		if (Value == CV_softResetValue)
-		{
-			FactoryReset(false);
-			return;
-		}
-		if (Value == CV_hardResetValue)
-		{
-			FactoryReset(true);
-			return;
-		}
+		ShowPomResult(false);
+		return;
 	}
 
-	// set the cv
-	if (cv.setCV(CV, Value))
+	// a single byte is handled as for program on main
+	if (count == 1)
 	{
-		// provide feedback that we are programming a valid CV
-		errorTimer.StartTimer(1000);
-		led.SetLED(RgbLed::BLUE, RgbLed::ON);
+		DCCPomHandler(0, instType, firstCV, data[0]);
+		return;
 	}
-	else
+
+	// a read would be answered by railcom, which isn't supported, so the led shows if the cv exists
+	if (instType != CVManager::CV_WRITE || count == 0)
 	{
-		// or provide indication if CV is invalid
-		errorTimer.StartTimer(1000);
-		led.SetLED(RgbLed::YELLOW, RgbLed::ON);
+		ShowPomResult(instType == CVManager::CV_VERIFY && cv.getCVindex(firstCV) >= 0);
+		return;
 	}
 
-	SaveConfig();
+	// set the cvs as for program on main, saving only the ones that are set
+	bool valid = true;
+	for (byte i = 0; i < count; i++)
+	{
+		if (CommandedReset(firstCV + i, data[i])) return;
 
-	// read back values from cv manager
-	occupancySensorSwap = cv.getCV(CV_occupancySensorSwap);
-	dccCommandSwap = cv.getCV(CV_dccCommandSwap);
-	relaySwap = cv.getCV(CV_relaySwap);
+		if (cv.setCV(firstCV + i, data[i]))
+			SaveCV(firstCV + i);
+		else
+			valid = false;
+	}
+	ShowPomResult(valid);
 }
 
 
-void TurnoutBase::LoadConfig()
+// perform a factory reset if it is commanded by a write to the reset cv, returns true if it was
+bool TurnoutBase::CommandedReset(unsigned int CV, uint16_t value)
 {
-	const bool firstBoot = (EEPROM.read(0) == 255);    // default value for unwritten eeprom
+	if (CV != CV_reset) return false;
 
-	if (firstBoot)
-	{ 
+	if (value == CV_softResetValue)
+		FactoryReset(false);
+	else if (value == CV_hardResetValue)
+		FactoryReset(true);
+	else
+		return false;
 
-		// reset cvs to defaults and save
-		cv.resetCVs();
-		SaveConfig();
-	}
+	return true;
+}
+
+
+// save a cv that has been set, the position in its own record, and any other in the patch of the config
+void TurnoutBase::SaveCV(byte cvNum)
+{
+	if (cvNum == CV_turnoutPosition)
+		SavePositionRecord();
 	else
-	{
+		cvStore.SaveCV(cvNum);
+}
 
-		// load stored config struct
-		EEPROM.get(0, configVars);
 
-		// copy stored config to working CVs
-		for (byte i = 0; i < numCVindexes; i++)
-		{
+// show the result of a program on main command on the led
+void TurnoutBase::ShowPomResult(bool valid)
+{
+	// blue if we are programming a valid CV, or yellow if the CV is invalid
+	errorTimer.StartTimer(1000);
+	led.SetLED(valid ? RgbLed::BLUE : RgbLed::YELLOW, RgbLed::ON);
+}
+
 
-			cv.cv[i].cvValue = configVars.CVs[i];
-		}
+// update the cached swap options and signal aspects when one of their cvs is changed
+void TurnoutBase::ConfigCVChanged(byte cvNum, uint16_t value)
+{
+	switch (cvNum)
+	{
+	case CV_occupancySensorSwap:
+		occupancySensorSwap = value;
+		break;
+	case CV_dccCommandSwap:
+		dccCommandSwap = value;
+		break;
+	case CV_relaySwap:
+		relaySwap = value;
+		break;
+	default:
+		if (cvNum >= CV_Aux1Off) signalAspects[cvNum - CV_Aux1Off] = value;
+		break;
 	}
 }
 
+void TurnoutBase::WrapperConfigCVChange(void* context, byte cvNum, uint16_t value) { static_cast<TurnoutBase*>(context)->ConfigCVChanged(cvNum, value); }
+
+
+void TurnoutBase::LoadConfig()
+{
+	// load the stored config, which holds the working CVs. a config from earlier firmware is migrated,
+	// and the CVs are set to defaults on first boot or if the config is not valid.
+	cvStore.Load();
+
+	// the newest turnout position is in its own record, if one has been stored
+	byte storedPosition;
+	if (store.Get(positionKey, storedPosition)) cv.setCV(CV_turnoutPosition, storedPosition);
+}
+
 void TurnoutBase::SaveConfig()
 {
-	// copy working CVs to our storage object
-	for (byte i = 0; i < numCVindexes; i++)
-	{
-		configVars.CVs[i] = cv.cv[i].cvValue;
+	// queue the config, which holds the working CVs, to be written in the background
+	cvStore.Save();
+}
 
-	}
+#if defined(WITH_CV_BACKUP)
+// save the cvs set by a restore as one config record, keeping the current position
+void TurnoutBase::RestoredCVs()
+{
+	// the servos don't move on a restore, so the position cv keeps the current position
+	cv.setCV(CV_turnoutPosition, position);
+	SaveConfig();
+}
+
+void TurnoutBase::WrapperCVRestore(void* context) { static_cast<TurnoutBase*>(context)->RestoredCVs(); }
+#endif
 
-	// store the config
-	EEPROM.put(0, configVars);
+void TurnoutBase::SavePosition()
+{
+	// store the position to the cv, and to its own record rather than rewriting the config
+	cv.setCV(CV_turnoutPosition, position);
+	SavePositionRecord();
+}
+
+void TurnoutBase::SavePositionRecord()
+{
+	// queue the position cv to be saved as its own record, which is read from the config as it is written
+	store.Save(positionKey, configVars.CVs[cv.getCVindex(CV_turnoutPosition)]);
 }
@@ -45,7 +45,16 @@ programming on main packets.
 
 The InitMain method performs the setup for the class, including setting up the DCC packet 
 processor, reading the stored configuration from EEPROM (via the DCCdecoder lib), and getting 
-the stored position of the turnout.
+the stored position of the turnout. The CV numbers, defaults and ranges are a constant table in
+flash, and the working CV values are the config struct that is read from and written to EEPROM.
+The config is stored with its version as a record of a record store, a log of records that spreads
+the writes across the whole EEPROM, and a config stored by earlier firmware is migrated to the current
+CVs by CV number when loaded. The turnout position is written on every throw, so it is stored as a
+record of its own rather than rewriting the config, and takes precedence over the position CV when
+the config is loaded. A save only queues the record in the store, which is written from Update a few
+bytes at a time, no more than fit in the queue of the EEPROM writer, which then writes them in the
+background. A record larger than that queue, or a compaction of the store, is spread over several
+passes of the loop, so that a throw or a CV change doesn't hold up the DCC processing.
 
 The Update method processes timestamps received by the BitStream object, which then sends them 
 to the DCCpacket object to be assembled into a full DCC packet. It also handles millis-related 
@@ -54,9 +63,44 @@ exceeds a configurable max value, a reset of the bitstream object takes place.
 
 The DCCExtCommandHandler processes an extended accessory command, using signal aspects for turning 
 the two auxilliary outputs on and off. It also provides the capability to toggle error indication on
-and off. The DCCPomHandler method processes a program on main packet. It checks for a valid CV, 
-stores the data via the DCCdecoder object, and then re-reads the basic configuration for the turnout. 
-It also provides complete and partial reset via POM commands.
+and off. The DCCPomHandler method processes a program on main packet. A write byte or bit manipulation
+instruction is checked for a valid CV, and the new value, with only the one bit changed for a bit
+manipulation, is stored via the CV manager and saved in the position record, or for any other CV in
+a small patch record of the config, so that a bit write doesn't rewrite every CV. A verify byte or
+verify bit instruction would be answered by RailCom, which isn't supported, so the LED shows whether
+the CV matches. It also provides complete and partial reset via POM commands. The DCCXpomHandler
+method processes the extended form (XPOM), writing up to four consecutive CVs as for program on main,
+so a write to CV55 performs a reset, and only the CVs that are set are saved. The turnout has no CV
+pages, so XPOM reaches CV1-256 with a CV index of 0. The swap options and signal aspects are cached in member variables, which are set
+from the CVs by InitMain, and then updated by a handler subscribed to changes of those CVs, so that a
+CV write only updates the state that depends on it. The derived classes subscribe to the servo CVs
+in the same way.
+
+If built with WITH_CV_BACKUP, the CVs can also be backed up to and restored from a host over the
+serial port by the cvBackup object. A restore sets all of the CVs, as for program on main writes, and
+then saves the config once. The position is not restored, since it has to match where the servos
+are, so it is set back to the current position before the config is saved, and its own record is not
+written. The serial port uses the aux output pins.
+
+The DCC events are queued, and dispatched at compile time to the event methods of the derived class
+from its Update method, after the TurnoutBase updates. The extended accessory and error events are
+handled here, and the basic accessory and program on main events in the derived classes. Service mode
+instructions are also handled in the derived classes, and acknowledged with a pulse of servo power.
+
+A DCC reset or emergency stop is passed directly to the EmergencyStopHandler of the derived class,
+without going through the event queue. If the servos are in motion, they are frozen where they are,
+and the servo power is cut. The relays are left off and the LED flashes yellow, since the points may
+be part way, until the next command moves the servos on. The bitstream capture uses the timer1 input
+capture by default, which the servo library also uses, so it is suspended during motion, and a stop is
+only seen once the motion is done. A board with the DCC signal on pin 2 can be built with
+BITSTREAM_TIMER2 (see Bitstream.h), so that the capture keeps running and a stop is seen while the
+servos move. The other DCC events are held in the queue until the motion is done.
+
+The latency from the end bit of a basic accessory packet to the start of the resulting servo motion
+is collected by the dccLatency object in the derived classes, and the reaction time from the end bit
+of a stop packet to the servo power being cut by the stopLatency object, using the packet time
+provided by the DCCdecoder. In debug builds, both sets of statistics are printed when an 'L' is
+received on the serial port, unless the port is used by the CV backup.
 
 */
 
@@ -75,10 +119,21 @@ It also provides complete and partial reset via POM commands.
 #include "OutputPin.h"
 #include "EventTimer.h"
 #include "CVManager.h"
-#include "EEPROM.h"
+#include "CVStore.h"
+#include "RecordStore.h"
+#include "LatencyRecorder.h"
+#include "EEPROMWriter.h"
 
+// build the serial cv backup and restore. the serial port shares pins 0 and 1 with the aux outputs, as in
+// debug builds, so it is left out of a normal build.
+//#define WITH_CV_BACKUP
 
-class TurnoutBase
+#if defined(WITH_CV_BACKUP)
+#include "CVBackup.h"
+#endif
+
+
+class TurnoutBase : public DCCEventHandler
 {
 protected:
 	TurnoutBase();
@@ -113,6 +168,9 @@ protected:
 	void FactoryReset(bool HardReset);
 	void LoadConfig();
 	void SaveConfig();
+	void SavePosition();
+	void SavePositionRecord();
+	void SaveCV(byte cvNum);
 
 	// Sensors and outputs
 	Button button{ ButtonPin, true };
@@ -126,6 +184,10 @@ protected:
 
 	// DCC decoder
 	DCCdecoder dcc;
+	DCCEventQueue dccEvents;                   // decoded dcc events, dispatched from Update in the derived classes
+	enum : byte { maxDispatchEvents = 2 };     // max dcc events handled per update
+	LatencyRecorder dccLatency;                // latency from the end of a dcc packet to the start of the servo motion
+	LatencyRecorder stopLatency;               // reaction time from the end of an emergency stop packet to the servos stopping
 
 	// other instance variables
 	enum State { STRAIGHT, CURVED };
@@ -135,6 +197,7 @@ protected:
 	bool relaySwap = false;					   // optionally swap the straight/curved relays
 	bool showErrorIndication = false;           // enable or disable LED error indications
 	bool servosActive = false;                 // flag to indicate if servos are active or not
+	bool servosStopped = false;                // servo motion was halted by an emergency stop, short of the position
 	byte currentServo = 0;                     // the servo that is currently in motion
 	bool servoRate = LOW;                      // rate at which the servos will be set
 
@@ -164,8 +227,13 @@ protected:
 		CV_servo4MaxTravel = 67,
 	};
 
+	// signal aspects that control the aux outputs and indications, cached from the cvs by ConfigCVChanged
+	enum : byte { numAspectCVs = CV_errorIndicationToggle - CV_Aux1Off + 1 };
+	byte signalAspects[numAspectCVs];
+	byte SignalAspect(byte cvNum) { return signalAspects[cvNum - CV_Aux1Off]; }
+
 	enum : byte { numCVindexes = 22 };
-	CVManager cv{ numCVindexes };
+	static const CVManager::CVstatic cvSchema[numCVindexes];    // cv numbers, defaults and ranges, in flash
 
 	struct ConfigVars
 	{
@@ -173,6 +241,30 @@ protected:
 	};
 
 	ConfigVars configVars;
+	byte cvLookup[CVManager::IndexSize(CV_AddressLSB, CV_servo4MaxTravel)];    // lookup from cv number to index
+	CVManager cv{ cvSchema, configVars.CVs, numCVindexes, cvLookup, sizeof(cvLookup) };      // working cvs are held in the config struct
+
+	// the config and the turnout position are records in a store that takes up the whole EEPROM. the
+	// position changes on every throw, so it has its own record rather than rewriting the config, and
+	// cvs written by program on main are saved in a patch record of the config.
+	enum : byte { configKey = 0, positionKey = 1, configPatchKey = 2 };
+	RecordStorage storage{ 0, 1024 };
+	RecordStore store{ storage };
+
+	// bump the version when the cv schema changes, and add a layout of the previous version so that a
+	// stored config can be migrated.
+	enum : byte { configVersion = 1, numConfigLayouts = 1 };
+	static const byte cvLayoutV0[numCVindexes];                 // cv order of the config stored without a header
+	static const CVStore::Layout configLayouts[numConfigLayouts];
+	CVStore cvStore{ cv, store, configKey, configVersion, configLayouts, numConfigLayouts };
+
+#if defined(WITH_CV_BACKUP)
+	// the cvs can be backed up and restored over the serial port, with the config saved once after a restore
+	byte backupBuffer[CVBackup::BufferSize(numCVindexes)];
+	CVBackup cvBackup{ Serial, cv, backupBuffer, sizeof(backupBuffer) };
+	void RestoredCVs();
+	static void WrapperCVRestore(void* context);
+#endif
 
 	// factory default settings
 	enum ResetCVs : byte {
@@ -188,6 +280,23 @@ protected:
 	void DCCDecodingError();
 	void DCCExtCommandHandler(unsigned int Addr, unsigned int Data);
 	void DCCPomHandler(unsigned int Addr, byte instType, unsigned int CV, byte Value);
+	void DCCXpomHandler(byte instType, uint16_t cvIndex, byte cvOffset, const byte* data, byte count);
+	void ShowPomResult(bool valid);
+	bool CommandedReset(unsigned int CV, uint16_t value);
+	void ConfigCVChanged(byte cvNum, uint16_t value);
+	static void WrapperConfigCVChange(void* context, byte cvNum, uint16_t value);
+
+	// dcc events common to the turnout managers, dispatched by DCCdecoder::DispatchEvents
+	enum : uint32_t {
+		baseDCCEvents = DCCEvent::Bit(DCCEvent::EXTENDED_ACC) | DCCEvent::Bit(DCCEvent::ACC_XPOM) |
+			DCCEvent::Bit(DCCEvent::BITSTREAM_MAX_ERROR) | DCCEvent::Bit(DCCEvent::PACKET_MAX_ERROR) |
+			DCCEvent::Bit(DCCEvent::DECODING_ERROR)
+	};
+	void DCCExtendedAccEvent(int boardAddress, int outputAddress, byte data) { DCCExtCommandHandler(outputAddress, data); }
+	void DCCAccXpomEvent(int outputAddress, byte instructionType, uint16_t cvIndex, byte cvOffset, const byte* data, byte count) { DCCXpomHandler(instructionType, cvIndex, cvOffset, data, count); }
+	void DCCBitstreamMaxErrorEvent(byte errorCode) { MaxBitErrorHandler(); }
+	void DCCPacketMaxErrorEvent(byte errorCode) { MaxPacketErrorHandler(); }
+	void DCCDecodingErrorEvent(byte errorCode) { DCCDecodingError(); }
 };
 
 #endif
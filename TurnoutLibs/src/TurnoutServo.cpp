@@ -80,7 +80,7 @@ void TurnoutServo::Update(unsigned long CurrentMillis)
             {
                 currentStep = 0;           // reset counter for next movement
                 servoState = READY;        // move is done, set back to ready state
-                if (servoMoveDoneHandler) servoMoveDoneHandler();    // raise event indicating servo motion is complete
+                if (servoMoveDoneHandler) servoMoveDoneHandler(handlerContext);    // raise event indicating servo motion is complete
             }
         }
         return;
@@ -103,8 +103,8 @@ bool TurnoutServo::IsActive() { return (servoState != OFF); }
 // Sets the servo to a position at the specified rate
 void TurnoutServo::Set(bool Position, bool Rate)
 {
-    // if position is new, start servo motion
-    if (Position != positionSet)
+    // if position is new, or the last move was stopped, start servo motion
+    if (Position != positionSet || stopped)
     {
 		MoveTo(Position, Rate);
     }
@@ -112,7 +112,7 @@ void TurnoutServo::Set(bool Position, bool Rate)
 
 
 // Set an extent for the servo (e.g., while adjusting turnout endpoints)
-void TurnoutServo::SetExtent(bool Position, byte Extent)
+void TurnoutServo::SetExtent(bool Position, byte Extent, bool Move)
 { 
     // set the new value
     extent[Position] = Extent;
@@ -120,8 +120,9 @@ void TurnoutServo::SetExtent(bool Position, byte Extent)
     // update steps and intervals
     ComputeSteps();
 
-	// if we're setting the extent for the current position, adjust the servo position
-	if (Position == positionSet)
+	// if we're setting the extent for the current position, adjust the servo position, unless the move
+	// is left to the next command
+	if (Move && Position == positionSet)
 	{
 #ifdef _DEBUG
 		Serial.print("Setting new extent for position ");
@@ -138,6 +139,13 @@ void TurnoutServo::MoveTo(bool Position, bool Rate)
 {
 	if (servoState != READY) return;   // only go to the moving state from the ready state
 
+	// continue from where the servo was stopped, counting from the other end of the steps if reversing
+	if (stopped)
+	{
+		if (Position != positionSet) currentStep = numSteps - currentStep;
+		stopped = false;
+	}
+
 	// update position and rate settings
 	positionSet = Position;
 	rateSet = Rate;
@@ -149,8 +157,11 @@ void TurnoutServo::StartPWM()
 {
 	if (servoState != OFF) return;   // only go to the ready state from the off state or at the end of a move
 
-	// ensure we are sending pulses for the current position
-	write(extent[positionSet]);
+	// ensure we are sending pulses for the current position, which may be part way if the servo was stopped
+	if (stopped && currentStep > 0 && currentStep < numSteps)
+		write(steps[positionSet][currentStep - 1]);
+	else
+		write(extent[positionSet]);
 	attach(servoPin);
 	servoState = READY;
 }
@@ -166,6 +177,18 @@ void TurnoutServo::StopPWM()
 }
 
 
+// stop any motion where it is, without raising the move done event
+void TurnoutServo::Stop()
+{
+	if (servoState == MOVING)
+		servoState = READY;
+	else
+		currentStep = numSteps;    // not moving, so at the endpoint for the current position
+
+	stopped = true;
+}
+
+
 // Set the duration for slow/fast rate
 void TurnoutServo::SetDuration(bool Position, int Duration)
 {
@@ -201,4 +224,4 @@ void TurnoutServo::ComputeSteps()
 
 
 // Assign the callback function for when servo motion is done
-void TurnoutServo::SetServoMoveDoneHandler(ServoEventHandler Handler) { servoMoveDoneHandler = Handler; }
+void TurnoutServo::SetServoMoveDoneHandler(ServoEventHandler Handler, void* Context) { servoMoveDoneHandler = Handler; handlerContext = Context; }
@@ -36,6 +36,7 @@ Example usage:
 		                                                     // position.
 		servo.Set(Position, Rate);               // set the servo to a position at the given rate.
 		servo.Update();                          // check and update the servo state and position.
+		servo.Stop();                            // stop the servo where it is, e.g. on an emergency stop.
 
 Details:
 
@@ -47,7 +48,7 @@ Servo control operates in three states - OFF, READY, and MOVING. In the OFF stat
 servo pin is disabled and the pin output is set low. In the READY state, the PWM signal is active and the 
 servo is ready to receive a move command. In the moving state, the servo is actively moving from one 
 endpoint to the other. The servo is initially in the OFF state. The StartPWM method attaches the servo 
-and sets the state to READY. When the MoveTo method is called, either by the Set or SetExtents methods, 
+and sets the state to READY. When the MoveTo method is called, either by the Set or SetExtent methods, 
 the desired position and rate are set, and the servo state is set to MOVING. After the motion is complete,
 the state reverts to READY. The StopPWM method is used to disable the PWM signal and set the state to OFF.
 
@@ -55,6 +56,12 @@ The Update method performs the actual motion of the servo. While MOVING, when an
 the servo is commanded to the next step. After the final step, the move done handler is called, and
 the state is set back to READY.
 
+The Stop method freezes the servo at its current step, going back to the READY state without calling
+the move done handler. The next move then continues from that step, counting the steps from the
+other end of the sequence if the direction is reversed, so that the servo does not jump back to an
+endpoint. A servo that was not moving when stopped is taken to be at the endpoint of its position, so
+that setting it to the same position again completes at once.
+
 The movement steps of the servo are computed when the extents and/or duration are altered, to 
 avoid repeatedly doing so when moving the servo. The positions corresponding to a given step of
 the motion are based on the extents and the number of steps. The time interval between each step
@@ -77,7 +84,7 @@ is based on the high or low rate duration and the number of steps.
 class TurnoutServo : public Servo
 {
  public:
-    typedef void (*ServoEventHandler)();
+    typedef void (*ServoEventHandler)(void* Context);
 
     TurnoutServo(byte ServoPin);
 	void Initialize(byte ExtentLow, byte ExtentHigh, bool Position);
@@ -87,11 +94,12 @@ class TurnoutServo : public Servo
 	bool IsMoving();
 	bool IsActive();
 	void Set(bool Position, bool Rate);
-	void SetExtent(bool Position, byte Extent);
+	void SetExtent(bool Position, byte Extent, bool Move = true);
 	void StartPWM();
 	void StopPWM();
+	void Stop();
 	void SetDuration(bool Position, int Duration);
-	void SetServoMoveDoneHandler(ServoEventHandler Handler);
+	void SetServoMoveDoneHandler(ServoEventHandler Handler, void* Context = 0);
 
 private:
 	enum ServoState { 
@@ -113,9 +121,11 @@ private:
     bool positionSet = 0;               // the commanded position for the servo
 	bool rateSet = 0;                   // the commanded rate of the servo
 	ServoState servoState = OFF;        // the current state of the servo
+	bool stopped = false;               // motion was stopped part way, at currentStep
 	unsigned long lastUpdate = 0;       // time of the last servo write
 
 	ServoEventHandler servoMoveDoneHandler = 0;     // pointer to handler for when servo motion is complete
+	void* handlerContext = 0;                       // context passed to the handler
 };
 
 #endif
@@ -1,50 +1,79 @@
 
 #include "TurntableMgr.h"
 
-// static pointer for callbacks
+// static pointer for the hall sensor ISR and stepper callbacks
 TurntableMgr* TurntableMgr::currentInstance = 0;
 
 #if defined(ADAFRUIT_METRO_M0_EXPRESS)
-FlashStorage(flashConfig, TurntableMgr::ConfigVars);
+// flash area for the record store, of storeSize bytes and aligned to a flash row
+__attribute__((__aligned__(256))) static const byte storeFlash[2048] = { };
+
+// the state and config stored by earlier firmware, which are imported into the record store
+FlashStorage(flashConfig, TurntableMgr::LegacyConfigVars);
 FlashStorage(flashState, TurntableMgr::StateVars);
 #endif
 
+// factory default CVs
+const CVManager::CVstatic TurntableMgr::configSchema[numCVindexes] PROGMEM =
+{
+	CVManager::CV8(CV_AddressLSB, 50),
+	CVManager::CV8(CV_AddressMSB, 0),
+	CVManager::CV8(CV_WarmupTimeout, 5, 0, 30),
+	CV16_SCHEMA(CV_IdleTimeout, 600, 0, 1200, true),
+};
+
+// default siding positions (set up to match current layout)
+#define SIDING_SCHEMA(siding, steps)  CV16_SCHEMA(siding, steps, 0, 180U * stepsPerDegree, true)
+
+const CVManager::CVstatic TurntableMgr::sidingSchema[numSidingIndexes] PROGMEM =
+{
+	SIDING_SCHEMA(1, 21472),
+	SIDING_SCHEMA(2, 6640),
+	SIDING_SCHEMA(3, 5056),
+	SIDING_SCHEMA(4, 3488),
+	SIDING_SCHEMA(5, 1888),
+	SIDING_SCHEMA(6, 256),
+	SIDING_SCHEMA(7, 27472),
+	SIDING_SCHEMA(8, 8288),
+	SIDING_SCHEMA(9, 0),
+	SIDING_SCHEMA(10, 0),
+	SIDING_SCHEMA(11, 0),
+	SIDING_SCHEMA(12, 0),
+	SIDING_SCHEMA(13, 0),
+	SIDING_SCHEMA(14, 0),
+	SIDING_SCHEMA(15, 0),
+	SIDING_SCHEMA(16, 0),
+	SIDING_SCHEMA(17, 0),
+	SIDING_SCHEMA(18, 0),
+};
+
+const CVPages::Page TurntableMgr::sidingPageTable[1] PROGMEM =
+{
+	{ sidingPageIndex, sidingSchema, numSidingIndexes, 0 },
+};
+
 TurntableMgr::TurntableMgr()
+	#if defined(ADAFRUIT_METRO_M0_EXPRESS)
+	: storage((uint32_t)storeFlash, storeSize)
+	#else
+	: storage(0, storeSize)
+	#endif
 {
 	// pointer for callback functions
 	currentInstance = this;
+
+	// the siding page is stored in its buffer, which is saved as a record
+	sidingPages.SetStorage(ReadSidingStorage, WriteSidingStorage, this);
+
+	#if defined(WITH_CV_BACKUP)
+	// a backup holds the config cvs and the siding page, and a restore is saved as the config and siding records
+	cvBackup.SetPage(sidingPages, sidingPageIndex);
+	cvBackup.SetRestoreHandler(WrapperCVRestore, this);
+	#endif // WITH_CV_BACKUP
 }
 
 void TurntableMgr::Initialize()
 {
-	// configure factory default CVs
-	byte index = 0;
-	index = configCVs.initCV(index, CV_AddressLSB, 50);
-	index = configCVs.initCV(index, CV_AddressMSB, 0);
-	index = configCVs.initCV(index, CV_WarmupTimeout, 5, 0, 30);
-	configCVs.initCV16(index, CV_IdleTimeout, 600, 0, 1200);
-
-	// configure default siding positions (set up to match current layout)
-	index = 0;
-	index = sidingCVs.initCV16(index, 1, 21472, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 2, 6640, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 3, 5056, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 4, 3488, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 5, 1888, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 6, 256, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 7, 27472, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 8, 8288, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 9, 0, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 10, 0, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 11, 0, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 12, 0, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 13, 0, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 14, 0, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 15, 0, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 16, 0, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 17, 0, 0, 180U * stepsPerDegree);
-	index = sidingCVs.initCV16(index, 18, 0, 0, 180U * stepsPerDegree);
-
 	// load config and last saved state
 	LoadState();
 	LoadConfig();
@@ -53,27 +82,27 @@ void TurntableMgr::Initialize()
 	ConfigureStepper();
 
 	// configure callbacks
-	idleTimer.SetTimerHandler(WrapperIdleTimerHandler);
-	warmupTimer.SetTimerHandler(WrapperWarmupTimerHandler);
-	errorTimer.SetTimerHandler(WrapperErrorTimerHandler);
+	idleTimer.SetTimerHandler(WrapperIdleTimerHandler, this);
+	warmupTimer.SetTimerHandler(WrapperWarmupTimerHandler, this);
+	errorTimer.SetTimerHandler(WrapperErrorTimerHandler, this);
 
 	#if defined(WITH_DCC)
-	// Configure and initialize the DCC packet processor
-	byte addr = (configCVs.getCV(CV_AddressMSB) << 8) + configCVs.getCV(CV_AddressLSB);
-	dcc.SetAddress(addr);
+	// Configure and initialize the DCC packet processor, and update the address when its cvs change
+	SetDCCAddress();
+	configCVs.subscribe(CV_AddressLSB, CV_AddressMSB, WrapperAddressCVChange, this);
 
-	// configure dcc event handlers
-	dcc.SetBasicAccessoryDecoderPacketHandler(WrapperDCCAccPacket);
-	dcc.SetExtendedAccessoryDecoderPacketHandler(WrapperDCCExtPacket);
-	dcc.SetBasicAccessoryPomPacketHandler(WrapperDCCAccPomPacket);
-	dcc.SetBitstreamMaxErrorHandler(WrapperMaxBitErrors);
-	dcc.SetPacketMaxErrorHandler(WrapperMaxPacketErrors);
-	dcc.SetDecodingErrorHandler(WrapperDCCDecodingError);
+	// configure the dcc events, which are dispatched to our event methods from the state updates
+	dcc.EnableEvents(DCCEvent::Bit(DCCEvent::BASIC_ACC) | DCCEvent::Bit(DCCEvent::EXTENDED_ACC) |
+		DCCEvent::Bit(DCCEvent::BASIC_ACC_POM) | DCCEvent::Bit(DCCEvent::ACC_XPOM));
+	dcc.SetEventQueue(&dccEvents);
+
+	// dcc resets and emergency stops are handled immediately, in any state
+	dcc.SetEmergencyStopHandler(WrapperEmergencyStop, this);
 	#endif
 
 	#if defined(WITH_TOUCHSCREEN)
 	touchpad.Init();
-	touchpad.SetGraphicButtonHandler(WrapperGraphicButtonHandler);
+	touchpad.SetGraphicButtonHandler(WrapperGraphicButtonHandler, this);
 	touchpad.SetButtonPress(currentSiding, true);    // set display to show initial siding on startup
 	#endif // defined(WITH_TOUCHSCREEN)
 
@@ -88,6 +117,17 @@ void TurntableMgr::Update()
 	// perform the current state function
 	if (ttStateFunctions[currentState])
 		(*this.*ttStateFunctions[currentState])();
+
+	#if defined(WITH_DCC) && defined(_DEBUG) && !defined(WITH_CV_BACKUP)
+	// print the latency statistics on demand, when an L is received on the serial port
+	if (Serial.available() > 0 && Serial.read() == 'L')
+	{
+		Serial.print("Command ");
+		dccLatency.Report(Serial);
+		Serial.print("Emergency stop ");
+		stopLatency.Report(Serial);
+	}
+	#endif
 }
 
 
@@ -113,12 +153,17 @@ void TurntableMgr::StateIdle()
 
 	#if defined(WITH_DCC)
 	dcc.ProcessTimeStamps();
+	dcc.DispatchEvents(*this, maxDispatchEvents);
 	#endif // defined(WITH_DCC)
 
 	#if defined(WITH_TOUCHSCREEN)
 	touchpad.Update();
 	#endif // defined(WITH_TOUCHSCREEN)
 
+	#if defined(WITH_CV_BACKUP)
+	cvBackup.Update();                   // backup and restore only while idle, not during a move
+	#endif // defined(WITH_CV_BACKUP)
+
 	errorTimer.Update();
 }
 
@@ -127,11 +172,6 @@ void TurntableMgr::StateMoving()
 {
 	if (subState == 0)     // transition to state
 	{
-
-		#if defined(WITH_DCC)
-		dcc.SuspendBitstream();
-		#endif   // WITH_DCC
-
 		flasher.SetLED(RgbLed::RED, RgbLed::FLASH, 500, 500);
 
 		// move to the specified siding at normal speed
@@ -147,10 +187,18 @@ void TurntableMgr::StateMoving()
 	accelStepper.run();
 	flasher.Update(currentMillis);
 
+	#if defined(WITH_DCC)
+	dcc.ProcessTimeStamps();     // for emergency stops, other dcc commands are held until we stop
+	#endif
+
 	#if defined(WITH_TOUCHSCREEN)
 	touchpad.Update();
 	#endif // defined(WITH_TOUCHSCREEN)
 
+	// an emergency stop has left the move, halting the stepper short of the siding, so don't save
+	// the siding as reached
+	if (currentState != MOVING) return;
+
 	if (accelStepper.distanceToGo() == 0)    // move is done
 	{
 		SaveState();    // TODO: add checks here to minimize flash/eeprom writes
@@ -165,10 +213,6 @@ void TurntableMgr::StateSeek()
 	{
 	case 0:                 // transition to seek state
 
-		#if defined(WITH_DCC)
-		dcc.SuspendBitstream();
-		#endif
-
 		// start moving in a complete clockwise circle at normal speed
 		accelStepper.setMaxSpeed(stepperMaxSpeed / 2);
 		accelStepper.setAcceleration(stepperAcceleration);
@@ -219,6 +263,10 @@ void TurntableMgr::StateSeek()
 	// do the update functions for this state
 	hallSensor.Update();
 	accelStepper.run();
+
+	#if defined(WITH_DCC)
+	dcc.ProcessTimeStamps();     // for emergency stops, other dcc commands are held until we stop
+	#endif
 }
 
 
@@ -229,10 +277,6 @@ void TurntableMgr::StateCalibrate()
 
 		flasher.SetLED(RgbLed::RED, RgbLed::FLASH, 500, 500);
 
-		#if defined(WITH_DCC)
-		dcc.SuspendBitstream();
-		#endif   // WITH_DCC
-
 		accelStepper.setMaxSpeed(stepperMaxSpeed);
 		accelStepper.setAcceleration(10 * stepperAcceleration);
 
@@ -244,6 +288,10 @@ void TurntableMgr::StateCalibrate()
 	accelStepper.run();
 	flasher.Update(currentMillis);
 
+	#if defined(WITH_DCC)
+	dcc.ProcessTimeStamps();     // for emergency stops, other dcc commands are held until we stop
+	#endif
+
 	#if defined(WITH_TOUCHSCREEN)
 	touchpad.Update();
 	#endif // defined(WITH_TOUCHSCREEN)
@@ -290,6 +338,7 @@ void TurntableMgr::StatePowered()
 
 	#if defined(WITH_DCC)
 	dcc.ProcessTimeStamps();
+	dcc.DispatchEvents(*this, maxDispatchEvents);
 	#endif // deinfed(WITH_DCC)
 
 	#if defined(WITH_TOUCHSCREEN)
@@ -306,11 +355,6 @@ void TurntableMgr::StateWarmup()
 {
 	if (subState == 0)     // transition to state
 	{
-
-		#if defined(WITH_DCC)
-		dcc.SuspendBitstream();
-		#endif   // WITH_DCC
-
 		flasher.SetLED(RgbLed::RED, RgbLed::FLASH, 500, 500);
 
 		// start the timer for the transition to moving state
@@ -323,6 +367,10 @@ void TurntableMgr::StateWarmup()
 	uint32_t currentMillis = millis();
 	flasher.Update(currentMillis);
 	warmupTimer.Update(currentMillis);
+
+	#if defined(WITH_DCC)
+	dcc.ProcessTimeStamps();     // for emergency stops, other dcc commands are held until we stop
+	#endif
 }
 
 
@@ -364,7 +412,7 @@ void TurntableMgr::ConfigureStepper()
 	accelStepper.setAcceleration(stepperAcceleration);
 
 	// set stepper position to correspond to current siding
-	accelStepper.setCurrentPosition(sidingCVs.getCV(currentSiding));
+	accelStepper.setCurrentPosition(sidingPages.getValue(sidingPageIndex, SidingOffset(currentSiding)));
 }
 
 
@@ -439,41 +487,74 @@ int32_t TurntableMgr::FindFullStep(int32_t microsteps)
 
 // event handlers and static wrappers
 
-void TurntableMgr::WrapperIdleTimerHandler() { currentInstance->RaiseEvent(IDLETIMER); }
-void TurntableMgr::WrapperWarmupTimerHandler() { currentInstance->RaiseEvent(WARMUPTIMER); }
-void TurntableMgr::WrapperErrorTimerHandler() {	currentInstance->flasher.SetLED(RgbLed::OFF); }
+void TurntableMgr::WrapperIdleTimerHandler(void* context) { static_cast<TurntableMgr*>(context)->RaiseEvent(IDLETIMER); }
+void TurntableMgr::WrapperWarmupTimerHandler(void* context) { static_cast<TurntableMgr*>(context)->RaiseEvent(WARMUPTIMER); }
+void TurntableMgr::WrapperErrorTimerHandler(void* context) {	static_cast<TurntableMgr*>(context)->flasher.SetLED(RgbLed::OFF); }
 
-void TurntableMgr::WrapperGraphicButtonHandler(byte buttonID, bool state)
+void TurntableMgr::WrapperGraphicButtonHandler(void* context, byte buttonID, bool state)
 {
-	currentInstance->CommandHandler(buttonID, state);
+	static_cast<TurntableMgr*>(context)->CommandHandler(buttonID, state);
 }
 
-void TurntableMgr::WrapperDCCAccPacket(int boardAddress, int outputAddress, byte activate, byte data)
+void TurntableMgr::WrapperEmergencyStop(void* context) { static_cast<TurntableMgr*>(context)->EmergencyStopHandler(); }
+void TurntableMgr::WrapperAddressCVChange(void* context, byte cvNum, uint16_t value) { static_cast<TurntableMgr*>(context)->SetDCCAddress(); }
+void TurntableMgr::WrapperCVRestore(void* context) { static_cast<TurntableMgr*>(context)->SaveConfig(); }
+
+// siding page storage, in the page buffer
+byte TurntableMgr::ReadSidingStorage(void* context, int address) { return static_cast<TurntableMgr*>(context)->sidingPageBuffer[address]; }
+void TurntableMgr::WriteSidingStorage(void* context, int address, byte value) { static_cast<TurntableMgr*>(context)->sidingPageBuffer[address] = value; }
+
+#if defined(WITH_DCC)
+void TurntableMgr::DCCBasicAccEvent(int boardAddress, int outputAddress, byte activate, byte data)
 {
-	if (data == 1) currentInstance->CommandHandler(1, true);    // accessory command for siding 1
+	if (data == 1) DCCCommandHandler(1);    // accessory command for siding 1
 }
 
-void TurntableMgr::WrapperDCCExtPacket(int boardAddress, int outputAddress, byte data)
+void TurntableMgr::DCCExtendedAccEvent(int boardAddress, int outputAddress, byte data)
 {
-	currentInstance->CommandHandler(data, true);
+	DCCCommandHandler(data);
 }
 
-void TurntableMgr::WrapperDCCAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data)
+void TurntableMgr::DCCBasicAccPomEvent(int boardAddress, int outputAddress, byte instructionType, int cv, byte data)
 {
-	currentInstance->DCCPomHandler(outputAddress, instructionType, cv, data);
+	DCCPomHandler(outputAddress, instructionType, cv, data);
 }
 
-void TurntableMgr::WrapperMaxBitErrors(byte errorCode)
+void TurntableMgr::DCCAccXpomEvent(int outputAddress, byte instructionType, uint16_t cvIndex, byte cvOffset, const byte* data, byte count)
 {
+	DCCXpomHandler(instructionType, cvIndex, cvOffset, data, count);
 }
+#endif // WITH_DCC
 
-void TurntableMgr::WrapperMaxPacketErrors(byte errorCode)
+// stop the turntable where it is and power off the stepper, on a dcc reset or emergency stop
+void TurntableMgr::EmergencyStopHandler()
 {
+	if (currentState == IDLE || currentState == POWERED) return;
+
+	// halt the stepper at its current position, clearing its speed and target, and release it now
+	// rather than waiting for the idle state
+	accelStepper.setCurrentPosition(accelStepper.currentPosition());
+	afStepper->release();
+	if (currentState == SEEK) detachInterrupt(digitalPinToInterrupt(hallSensorPin));
+	calCmd.type = CalCmd::none;
+	RaiseEvent(BUTTON_ESTOP);
+
+	// record the reaction time from the end of the stop packet
+	#if defined(WITH_DCC)
+	stopLatency.Record(dcc.PacketTime());
+	#endif
 }
 
-void TurntableMgr::WrapperDCCDecodingError(byte errorCode)
+#if defined(WITH_DCC)
+// handle a dcc command as a button press, and record the latency from the end of the dcc packet if the
+// command was acted on, starting a move
+void TurntableMgr::DCCCommandHandler(byte buttonID)
 {
+	const ttState lastState = currentState;
+	CommandHandler(buttonID, true);
+	if (currentState != lastState) dccLatency.Record(dcc.PacketTime());
 }
+#endif // WITH_DCC
 
 
 void TurntableMgr::SaveState()
@@ -482,52 +563,52 @@ void TurntableMgr::SaveState()
 	stateVars.currentSiding = currentSiding;
 	stateVars.isValid = true;
 
-	#if defined(ADAFRUIT_METRO_M0_EXPRESS)
-	flashState.write(stateVars);
-	#else
-	EEPROM.put(0, stateVars);
-	#endif
+	// the record is only written if the state has changed
+	store.Put(stateKey, stateVars);
 }
 
 void TurntableMgr::LoadState()
 {
-	// determine if first boot or not
-	#if defined(ADAFRUIT_METRO_M0_EXPRESS)
-	StateVars tempStateVars = flashState.read();
-	const bool firstBoot = !tempStateVars.isValid;  // this is false on read of unitialized flash
-	#else
-	const bool firstBoot = (EEPROM.read(0) == 255);
-	#endif
-	
-	// if not first boot, then load stored state, otherwise use default statevars initialization below
-	if (!firstBoot)   
-	{
-		#if defined(ADAFRUIT_METRO_M0_EXPRESS)
-		stateVars = tempStateVars;
-		#else
-		EEPROM.get(0, stateVars);    // get the last state from eeprom
-		#endif // defined(ADAFRUIT_METRO_M0_EXPRESS)
-	}
+	// the state and config saved by earlier firmware are imported the first time the store is used
+	if (!store.IsFormatted()) ImportLegacyStorage();
+
+	// if not first boot, then load stored state, otherwise use default statevars initialization
+	store.Get(stateKey, stateVars);
 
 	// set state and siding locals
 	currentState = stateVars.currentState;
 	currentSiding = stateVars.currentSiding;
 }
 
-void TurntableMgr::SaveConfig()
+void TurntableMgr::ImportLegacyStorage()
 {
-	// copy working CVs to our storage object
-	for (byte i = 0; i < numCVindexes; i++)
-		configVars.CVs[i] = configCVs.cv[i].cvValue;
-	for (byte i = 0; i < numSidingIndexes; i++)
-		configVars.sidingSteps[i] = sidingCVs.cv[i].cvValue;
+	StateVars legacyState;
+	LegacyConfigVars legacyConfig;
 
-	// store the config
 	#if defined(ADAFRUIT_METRO_M0_EXPRESS)
-	flashConfig.write(configVars);
+	legacyState = flashState.read();
+	if (!legacyState.isValid) return;    // this is false on read of unitialized flash
+	legacyConfig = flashConfig.read();
 	#else
-	EEPROM.put(sizeof(stateVars), configVars);   // store the config vars struct starting after the state vars in EEPROM
+	if (EEWriter.Read(0) == 255) return;    // unwritten eeprom
+	EEWriter.Get(0, legacyState);
+	EEWriter.Get(sizeof(StateVars), legacyConfig);    // the config vars were stored after the state vars
 	#endif
+
+	// the config cvs and the siding page become records of their own
+	memcpy(configVars.CVs, legacyConfig.CVs, sizeof(configVars.CVs));
+	for (byte i = 0; i < numSidingIndexes; i++)
+		sidingPageBuffer[i] = legacyConfig.sidingSteps[i];
+
+	store.Put(stateKey, legacyState);
+	SaveConfig();
+}
+
+void TurntableMgr::SaveConfig()
+{
+	// store the config CVs and the siding page, each record is only written if it has changed
+	store.Put(configKey, configVars);
+	store.Put(sidingKey, sidingPageBuffer);
 }
 
 void TurntableMgr::LoadConfig()
@@ -537,33 +618,20 @@ void TurntableMgr::LoadConfig()
 
 void TurntableMgr::LoadConfig(bool reset)
 {
-	// if this is the first boot on fresh eeprom/flash, or reset requested
+	// if this is the first boot on fresh eeprom/flash, or reset requested, or the config is missing
 	// NOTE: must load state from flash before loading config so that stateVars is set properly
-	if (!stateVars.isValid || reset)   
+	if (!stateVars.isValid || reset || !store.Get(configKey, configVars) || !store.Get(sidingKey, sidingPageBuffer))
 	{
-
 		//load default values for config vars and sidings
 		configCVs.resetCVs();
-		sidingCVs.resetCVs();
+		sidingPages.resetPages();
 
 		SaveState();
 		SaveConfig();
 	}
-	else   // normal boot, load config from eeprom/flash
-	{
 
-		#if defined(ADAFRUIT_METRO_M0_EXPRESS)
-		configVars = flashConfig.read();
-		#else
-		EEPROM.get(sizeof(stateVars), configVars);   // load the config vars struct starting after the state vars in EEPROM
-		#endif
-
-		// copy stored config to working CVs
-		for (byte i = 0; i < numCVindexes; i++)
-			configCVs.cv[i].cvValue = configVars.CVs[i];
-		for (byte i = 0; i < numSidingIndexes; i++)
-			sidingCVs.cv[i].cvValue = configVars.sidingSteps[i];
-	}
+	// the siding page held in its buffer may have been replaced, so it is loaded again when next used
+	sidingPages.reloadPage();
 }
 
 void TurntableMgr::SetSidingCal()
@@ -572,7 +640,7 @@ void TurntableMgr::SetSidingCal()
 	long pos = accelStepper.currentPosition();
 	uint16_t basicPos = FindBasicPosition(pos);
 	int32_t fullstepPos = FindFullStep(basicPos);
-	sidingCVs.setCV(currentSiding, fullstepPos);
+	sidingPages.setValue(sidingPageIndex, SidingOffset(currentSiding), fullstepPos);
 
 	// store the turntable state and cv struct to nvram
 	SaveConfig();
@@ -612,7 +680,7 @@ void TurntableMgr::CommandHandler(byte buttonID, bool state)
 		case Touchpad::numpad17:
 		case Touchpad::numpad18:
 			currentSiding = buttonID;
-			moveCmd.targetPos = sidingCVs.getCV(currentSiding);
+			moveCmd.targetPos = sidingPages.getValue(sidingPageIndex, SidingOffset(currentSiding));
 
 			#if defined(WITH_TOUCHSCREEN)
 			touchpad.SetButtonPress(currentSiding, true);
@@ -723,8 +791,61 @@ void TurntableMgr::DCCPomHandler(unsigned int Addr, byte instType, unsigned int
 
 	// TODO: check for and perform reset
 
-	// set the cv
-	if (configCVs.setCV(CV,Value))
+	// verify or set the cv, the siding positions are on the page selected by CV31 and CV32
+	const bool valid = ProgramCV(instType, 0, CV, Value);
+	ShowPomResult(valid);
+
+	// save the new config, which the store skips if nothing changed
+	if (valid) SaveConfig();
+}
+
+void TurntableMgr::DCCXpomHandler(byte instType, uint16_t cvIndex, byte cvOffset, const byte* data, byte count)
+{
+	// with an index of 0 the offset addresses CV1-256, otherwise a cv of the page with that index
+	const unsigned int firstCV = (cvIndex == 0) ? cvOffset + 1 : cvOffset;
+
+	// a read would be answered by railcom, which isn't supported, so the led shows if the cv exists
+	if (count == 0)
+	{
+		ShowPomResult(ReadCV(cvIndex, firstCV) >= 0);
+		return;
+	}
+
+	// a write sets up to four cvs, which are saved together
+	bool valid = true;
+	for (byte i = 0; i < count; i++)
+		if (!ProgramCV(instType, cvIndex, firstCV + i, data[i])) valid = false;
+	ShowPomResult(valid);
+
+	SaveConfig();
+}
+
+// apply a program on main instruction to a cv, given by number with a page index of 0, or by its offset
+// on the page with the given index. returns true for a valid write, or a verify that matches.
+bool TurntableMgr::ProgramCV(byte instType, uint16_t pageIndex, unsigned int cv, byte data)
+{
+	const int16_t value = ReadCV(pageIndex, cv);
+	if (value < 0) return false;
+
+	// a bit manipulation changes only the one bit
+	const int16_t writeValue = CVManager::getNewValue(instType, value, data);
+	if (writeValue < 0) return CVManager::verifyValue(instType, value, data);
+
+	if (pageIndex != 0) return sidingPages.setCV(pageIndex, cv, writeValue);
+	return sidingPages.isPagedCV(cv) ? sidingPages.setCV(cv, writeValue) : configCVs.setCV(cv, writeValue);
+}
+
+// read a cv, as for ProgramCV. returns -1 if there is no such cv.
+int16_t TurntableMgr::ReadCV(uint16_t pageIndex, unsigned int cv)
+{
+	if (pageIndex != 0) return (cv <= 255) ? sidingPages.getCV(pageIndex, cv) : -1;
+	if (sidingPages.isPagedCV(cv)) return sidingPages.getCV(cv);
+	return (configCVs.getCVindex(cv) >= 0) ? configCVs.getCV(cv) : -1;
+}
+
+void TurntableMgr::ShowPomResult(bool valid)
+{
+	if (valid)
 	{
 		errorTimer.StartTimer(250);
 		flasher.SetLED(RgbLed::RED, RgbLed::FLASH, 50, 50);
@@ -734,13 +855,14 @@ void TurntableMgr::DCCPomHandler(unsigned int Addr, byte instType, unsigned int
 		errorTimer.StartTimer(1000);
 		flasher.SetLED(RgbLed::RED, RgbLed::FLASH, 250, 250);
 	}
+}
 
+
+// set the dcc address from the cvs, when they are loaded or changed
+void TurntableMgr::SetDCCAddress()
+{
 	#if defined(WITH_DCC)
-	// update dcc address
-	byte addr = (configCVs.getCV(CV_AddressMSB) << 8) + configCVs.getCV(CV_AddressLSB);
+	const uint16_t addr = (configCVs.getCV(CV_AddressMSB) << 8) + configCVs.getCV(CV_AddressLSB);
 	dcc.SetAddress(addr);
-	#endif
-
-	// save the new config
-	SaveConfig();
+	#endif // WITH_DCC
 }
@@ -14,12 +14,22 @@
 #define WITH_DCC
 #define WITH_TOUCHSCREEN
 
+// build the serial cv backup and restore
+#define WITH_CV_BACKUP
+
 #include "Button.h"
 #include "EventTimer.h"
 #include "RGB_LED.h"
 #include "AccelStepper.h"
 #include "Adafruit_MotorShield.h"
 #include "CVManager.h"
+#include "CVPages.h"
+#include "LatencyRecorder.h"
+#include "RecordStore.h"
+
+#if defined(WITH_CV_BACKUP)
+#include "CVBackup.h"
+#endif // WITH_CV_BACKUP
 
 #if defined(WITH_DCC)
 #include "DCCdecoder.h"
@@ -30,12 +40,15 @@
 #if defined (ADAFRUIT_METRO_M0_EXPRESS)
 #include "FlashStorage.h"
 #else
-#include "EEPROM.h"
+#include "EEPROMWriter.h"
 #endif
 
 
 
 class TurntableMgr
+#if defined(WITH_DCC)
+	: public DCCEventHandler
+#endif
 {
 public:
 	TurntableMgr();
@@ -70,8 +83,8 @@ private:
 	{
 		IDLE,           // stationary, with motor powered off, listening for dcc and touchscreen
 		POWERED,        // stationary, with motor powered on, listening for dcc and touchscreen, flasher on
-		WARMUP,         // stationary but with pending move, dcc and touchscreen suspended, flasher on
-		MOVING,         // rotating, dcc and touchscreen suspended, flasher on
+		WARMUP,         // stationary but with pending move, dcc commands held except emergency stop, flasher on
+		MOVING,         // rotating, dcc commands held except emergency stop, flasher on
 		SEEK,           // seeking the hall sensor at high speed in the clockwise direction
 		CALIBRATE,      // state for calibrating siding positions
 	};
@@ -125,7 +138,7 @@ private:
 		ttState nextState;
 	};
 
-	stateTransMatrixRow stateTransMatrix[14] =
+	stateTransMatrixRow stateTransMatrix[16] =
 	{
 		// CURR STATE     // EVENT           // NEXT STATE
 		{ WARMUP,         WARMUPTIMER,       MOVING },
@@ -142,6 +155,8 @@ private:
 		{ MOVING,         BUTTON_ESTOP,      IDLE },
 		{ POWERED,        BUTTON_ESTOP,      IDLE },
 		{ SEEK,           BUTTON_ESTOP,      IDLE },
+		{ WARMUP,         BUTTON_ESTOP,      IDLE },
+		{ CALIBRATE,      BUTTON_ESTOP,      IDLE },
 	};
 
 
@@ -212,6 +227,10 @@ private:
 
 	#if defined(WITH_DCC)
 	DCCdecoder dcc;
+	DCCEventQueue dccEvents;         // decoded dcc events waiting to be handled
+	enum : byte { maxDispatchEvents = 2 };     // max dcc events handled per update
+	LatencyRecorder dccLatency;      // latency from the end of a dcc packet to the move it starts, printed on an L from serial in debug builds
+	LatencyRecorder stopLatency;     // reaction time from the end of an emergency stop packet to the stepper being released
 	#endif	// WITH_DCC
 
 	// define our available cv's  (allowable range 33-81 per 9.2.2)
@@ -235,11 +254,17 @@ private:
 		numCVindexes = 5,
 		numSidingIndexes = 36   // note sidingIndexes is 2x number of sidings as they are 16 bit CVs
 	};
-	CVManager configCVs{ numCVindexes };
-	CVManager sidingCVs{ numSidingIndexes };
+	static const CVManager::CVstatic configSchema[numCVindexes];        // cv numbers, defaults and ranges, in flash
+	static const CVManager::CVstatic sidingSchema[numSidingIndexes];
 
 public:       // these are public so we can use them with FlashStorage globals
 	struct ConfigVars
+	{
+		byte CVs[numCVindexes];
+	};
+
+	// the config stored by earlier firmware, with the siding page held one cv per word
+	struct LegacyConfigVars
 	{
 		byte CVs[numCVindexes];
 		uint16_t sidingSteps[numSidingIndexes];
@@ -256,16 +281,50 @@ private:
 	ConfigVars configVars;
 	StateVars stateVars = { IDLE, 1, false };
 
+	byte cvLookup[CVManager::IndexSize(CV_AddressLSB, CV_IdleTimeout)];    // lookup from cv number to index
+	CVManager configCVs{ configSchema, configVars.CVs, numCVindexes, cvLookup, sizeof(cvLookup) };
+
+	// the siding positions are a page of cvs, CV257-292 with CV31 = 16 and CV32 = 0, holding the high then
+	// low byte of each position. it is the only page, so its buffer is also its storage, which is saved
+	// as a record of its own.
+	enum : uint16_t { sidingPageIndex = CVPages::firstManufacturerPage };
+	static const CVPages::Page sidingPageTable[1];
+	byte sidingPageBuffer[numSidingIndexes];
+	CVPages sidingPages{ sidingPageTable, 1, sidingPageBuffer, numSidingIndexes };
+	static byte SidingOffset(byte siding) { return 2 * (siding - 1); }
+	static byte ReadSidingStorage(void* context, int address);
+	static void WriteSidingStorage(void* context, int address, byte value);
+
+	// the state, config and siding page are records in a store, in a flash area on the Metro M0, or the
+	// whole EEPROM on AVR. the state is saved on each move, so the store spreads the writes across the area.
+	#if defined(ADAFRUIT_METRO_M0_EXPRESS)
+	enum : uint16_t { storeSize = 2048 };
+	#else
+	enum : uint16_t { storeSize = 1024 };
+	#endif
+	enum : byte { stateKey = 0, configKey = 1, sidingKey = 2 };
+	RecordStorage storage;
+	RecordStore store{ storage };
+
+	void ImportLegacyStorage();
 	void SaveState();
 	void LoadState();
 	void SaveConfig();
 	void LoadConfig();
 	void LoadConfig(bool reset);
 
+	// the config cvs and the siding page can be backed up and restored over the serial port, with the
+	// config and siding page saved after a restore
+	#if defined(WITH_CV_BACKUP)
+	byte backupBuffer[CVBackup::BufferSize(numCVindexes, numSidingIndexes)];
+	CVBackup cvBackup{ Serial, configCVs, backupBuffer, sizeof(backupBuffer) };
+	#endif // WITH_CV_BACKUP
+
 
 	// event handlers  ===========================================================================
 
-	// pointer to allow us to access member objects from callbacks
+	// pointer for the hall sensor ISR and the stepper callbacks, which take no context.
+	// the other callbacks are given this instance as their context.
 	static TurntableMgr* currentInstance;
 
 	static void HallIrq();
@@ -274,20 +333,31 @@ private:
 	static void StepperClockwiseStep();
 	static void StepperCounterclockwiseStep();
 	void DCCPomHandler(unsigned int Addr, byte instType, unsigned int CV, byte Value);
+	void DCCXpomHandler(byte instType, uint16_t cvIndex, byte cvOffset, const byte* data, byte count);
+	bool ProgramCV(byte instType, uint16_t pageIndex, unsigned int cv, byte data);
+	int16_t ReadCV(uint16_t pageIndex, unsigned int cv);
+	void ShowPomResult(bool valid);
+	void EmergencyStopHandler();
+	void DCCCommandHandler(byte buttonID);
+	void SetDCCAddress();
 
 	// wrappers for callbacks
-	static void WrapperIdleTimerHandler();
-	static void WrapperWarmupTimerHandler();
-	static void WrapperErrorTimerHandler();
-	static void WrapperGraphicButtonHandler(byte buttonID, bool state);
-
-	// DCC event handler wrappers
-	static void WrapperDCCAccPacket(int boardAddress, int outputAddress, byte activate, byte data);
-	static void WrapperDCCExtPacket(int boardAddress, int outputAddress, byte data);
-	static void WrapperDCCAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data);
-	static void WrapperMaxBitErrors(byte errorCode);
-	static void WrapperMaxPacketErrors(byte errorCode);
-	static void WrapperDCCDecodingError(byte errorCode);
+	static void WrapperIdleTimerHandler(void* context);
+	static void WrapperWarmupTimerHandler(void* context);
+	static void WrapperErrorTimerHandler(void* context);
+	static void WrapperGraphicButtonHandler(void* context, byte buttonID, bool state);
+	static void WrapperEmergencyStop(void* context);
+	static void WrapperAddressCVChange(void* context, byte cvNum, uint16_t value);
+	static void WrapperCVRestore(void* context);
+
+	// DCC events, called directly from DCCdecoder::DispatchEvents
+	#if defined(WITH_DCC)
+	friend class DCCdecoder;
+	void DCCBasicAccEvent(int boardAddress, int outputAddress, byte activate, byte data);
+	void DCCExtendedAccEvent(int boardAddress, int outputAddress, byte data);
+	void DCCBasicAccPomEvent(int boardAddress, int outputAddress, byte instructionType, int cv, byte data);
+	void DCCAccXpomEvent(int outputAddress, byte instructionType, uint16_t cvIndex, byte cvOffset, const byte* data, byte count);
+	#endif // WITH_DCC
 };
 
 #endif
@@ -61,7 +61,7 @@ void Button::Update(unsigned long CurrentMillis)
 		numUpdates++;       // for testing
 
 		// raise event
-		if (buttonPressHandler) buttonPressHandler(switchState);
+		if (buttonPressHandler) buttonPressHandler(handlerContext, switchState);
 	}
 }
 
@@ -94,4 +94,4 @@ int Button::NumUpdates() { return numUpdates; }
 bool Button::HasChanged() { return hasChanged; }
 
 // Assign the callback function for the button press event
-void Button::SetButtonPressHandler(ButtonPressHandlerFunc Handler) { buttonPressHandler = Handler; }
+void Button::SetButtonPressHandler(ButtonPressHandlerFunc Handler, void* Context) { buttonPressHandler = Handler; handlerContext = Context; }
@@ -36,7 +36,7 @@ Example usage:
 
 	Button button(ButtonPin, true);            // create a button object on a given pin, with pullup enabled
 	button.Update(currentMillis);              // update state of the debounce logic
-	button.SetButtonPressHandler(handler);     // set the handler for the button press
+	button.SetButtonPressHandler(handler, this);   // set the handler for the button press, and the context passed to it
 
 */
 
@@ -53,7 +53,7 @@ Example usage:
 class Button
 {
 public:
-    typedef void (*ButtonPressHandlerFunc)(bool switchState);
+    typedef void (*ButtonPressHandlerFunc)(void* Context, bool switchState);
 
     Button(byte Pin, bool EnablePullup);
 	void Update(unsigned long CurrentMillis);
@@ -63,7 +63,7 @@ public:
 	int NumUpdates();
 	int NumInterrupts();
 	bool HasChanged();
-	void SetButtonPressHandler(ButtonPressHandlerFunc Handler);
+	void SetButtonPressHandler(ButtonPressHandlerFunc Handler, void* Context = 0);
 
 private:
 	bool readEnable = false;            // enable reading the switch after debounce interval
@@ -76,6 +76,7 @@ private:
 	int numInterrupts = 0;              // number of times the raw state has changed
 	bool hasChanged = false;            // has the state of the switch changed (this is reset after reading the value)
 	ButtonPressHandlerFunc buttonPressHandler = 0;   // pointer to handler for button press event
+	void* handlerContext = 0;           // context passed to the handler
 };
 
 #endif
@@ -0,0 +1,336 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "CVBackup.h"
+
+CVBackup::CVBackup(Stream& Port, CVManager& CVs, byte* Buffer, byte BufferSize)
+	: port(Port), cvs(CVs), buffer(Buffer), bufferSize(BufferSize)
+{
+}
+
+
+void CVBackup::SetPage(CVPages& Pages, uint16_t PageIndex)
+{
+	pages = &Pages;
+	pageIndex = PageIndex;
+}
+
+
+void CVBackup::SetRestoreHandler(RestoreHandler Handler, void* Context)
+{
+	restoreHandler = Handler;
+	restoreContext = Context;
+}
+
+
+// read the bytes received from the port, and handle a command when its frame is complete
+void CVBackup::Update()
+{
+	while (port.available() > 0)
+	{
+		const byte data = port.read();
+		if (data != 0)
+		{
+			// the rest of a frame that doesn't fit is dropped
+			if (received < bufferSize)
+				buffer[received++] = data;
+			else
+				overflow = true;
+			continue;
+		}
+
+		// a zero byte ends the frame
+		const byte length = received;
+		const bool tooLong = overflow;
+		received = 0;
+		overflow = false;
+
+		if (tooLong)
+		{
+			buffer[0] = CMD_RESTORE;    // only a restore is long enough to overflow
+			buffer[1] = RESULT_TOO_LONG;
+			SendFrame(replySize);
+			return;
+		}
+
+		// handle at most one command per update
+		if (length > 0)
+		{
+			HandleCommand(DecodeFrame(length));
+			return;
+		}
+	}
+}
+
+
+// handle a decoded command frame, and send the reply
+void CVBackup::HandleCommand(byte length)
+{
+	if (length == 0) return;    // not a valid frame
+
+	const byte command = buffer[0];
+	byte replyLength = replySize;
+	Result result;
+
+	switch (command)
+	{
+	case CMD_BACKUP:
+		replyLength = Backup();
+		result = (replyLength > replySize) ? RESULT_OK : RESULT_TOO_LONG;
+		break;
+
+	case CMD_RESTORE:
+		result = Restore(buffer + 1, length - 1);
+		break;
+
+	default:
+		result = RESULT_BAD_COMMAND;
+		break;
+	}
+
+#ifdef _DEBUG
+	Serial.print("CV backup command ");
+	Serial.print(command, DEC);
+	Serial.print(", result ");
+	Serial.println(result, DEC);
+#endif
+
+	buffer[0] = command;
+	buffer[1] = result;
+	SendFrame(replyLength);
+}
+
+
+// build the blob in the buffer after the reply header, returns the length of the reply
+byte CVBackup::Backup()
+{
+	const byte pageCVs = PageSize();
+	const uint16_t size = replySize + headerSize + sectionSize + 2 * cvs.numCVs + ((pageCVs > 0) ? sectionSize + pageCVs : 0) + crcSize;
+	if (size > bufferSize) return replySize;
+
+	byte* const blob = buffer + replySize;
+	byte length = 0;
+	blob[length++] = lowByte(blobMagic);
+	blob[length++] = highByte(blobMagic);
+	blob[length++] = formatVersion;
+	blob[length++] = (pageCVs > 0) ? 2 : 1;
+
+	// the cvs by number, in schema order
+	blob[length++] = lowByte(cvSection);
+	blob[length++] = highByte(cvSection);
+	blob[length++] = cvs.numCVs;
+	for (byte i = 0; i < cvs.numCVs; i++)
+	{
+		blob[length++] = cvs.getCVnum(i);
+		blob[length++] = cvs.cvValue[i];
+	}
+
+	// then the values of the page, from CV257
+	if (pageCVs > 0)
+	{
+		blob[length++] = lowByte(pageIndex);
+		blob[length++] = highByte(pageIndex);
+		blob[length++] = pageCVs;
+		for (byte offset = 0; offset < pageCVs; offset++)
+			blob[length++] = pages->getCV(pageIndex, offset);
+	}
+
+	const uint16_t crc = BlobCRC(blob, length);
+	blob[length++] = lowByte(crc);
+	blob[length++] = highByte(crc);
+
+	return replySize + length;
+}
+
+
+// check a blob, then set all of its cvs and save them. nothing is set if any of the cvs can't be.
+CVBackup::Result CVBackup::Restore(const byte* blob, byte length)
+{
+	if (length < headerSize + crcSize) return RESULT_BAD_FORMAT;
+
+	length -= crcSize;
+	const uint16_t crc = blob[length] + (blob[length + 1] << 8);
+	if (crc != BlobCRC(blob, length)) return RESULT_BAD_CRC;
+
+	const uint16_t magic = blob[0] + (blob[1] << 8);
+	if (magic != blobMagic || blob[2] != formatVersion) return RESULT_BAD_FORMAT;
+
+	// check every cv before any are set
+	const Result result = RestoreSections(blob, length, false);
+	if (result != RESULT_OK) return result;
+
+	RestoreSections(blob, length, true);
+
+#ifdef _DEBUG
+	Serial.println("Restored CVs from backup.");
+#endif
+
+	// then save them together
+	if (restoreHandler) restoreHandler(restoreContext);
+	return RESULT_OK;
+}
+
+
+// check the cvs of each section of a blob, or set them
+CVBackup::Result CVBackup::RestoreSections(const byte* blob, byte length, bool write)
+{
+	const byte numSections = blob[3];
+	byte offset = headerSize;
+	for (byte i = 0; i < numSections; i++)
+	{
+		if (offset + sectionSize > length) return RESULT_BAD_FORMAT;
+
+		const uint16_t index = blob[offset] + (blob[offset + 1] << 8);
+		const byte count = blob[offset + 2];
+		const uint16_t size = (index == cvSection) ? 2 * count : count;
+		offset += sectionSize;
+		if (offset + size > length) return RESULT_BAD_FORMAT;
+
+		const Result result = (index == cvSection) ?
+			RestoreCVs(blob + offset, count, write) : RestorePage(index, blob + offset, count, write);
+		if (result != RESULT_OK) return result;
+
+		offset += size;
+	}
+
+	return (offset == length) ? RESULT_OK : RESULT_BAD_FORMAT;
+}
+
+
+// check the cvs of a CVManager section, given as a cv number and value for each, or set them
+CVBackup::Result CVBackup::RestoreCVs(const byte* entries, byte count, bool write)
+{
+	for (byte i = 0; i < count; i++)
+	{
+		const byte cvNum = entries[2 * i];
+		uint16_t value = entries[2 * i + 1];
+
+		const int16_t index = cvs.getCVindex(cvNum);
+		if (index < 0) return RESULT_UNKNOWN_CV;
+
+		// the low byte of a 16 bit cv follows the high byte, with a cv number of 0
+		if (cvs.is16bit(index))
+		{
+			if (i + 1 >= count || entries[2 * (i + 1)] != 0) return RESULT_BAD_FORMAT;
+			i++;
+			value = (value << 8) + entries[2 * i + 1];
+		}
+
+		if (write)
+			cvs.setCV(cvNum, value);
+		else if (!cvs.checkCV(cvNum, value))
+			return RESULT_OUT_OF_RANGE;
+	}
+
+	return RESULT_OK;
+}
+
+
+// check the cvs of a page section, given as the values from CV257, or set them
+CVBackup::Result CVBackup::RestorePage(uint16_t index, const byte* values, byte count, bool write)
+{
+	if (!pages) return RESULT_UNKNOWN_CV;
+
+	for (byte offset = 0; offset < count; offset++)
+	{
+		if (pages->getCV(index, offset) < 0) return RESULT_UNKNOWN_CV;
+
+		// a 16 bit value is set as a whole, at the offset of the high byte
+		const byte valueOffset = offset;
+		uint16_t value = values[offset];
+		if (pages->is16bit(index, offset))
+		{
+			if (offset + 1 >= count) return RESULT_BAD_FORMAT;
+			offset++;
+			value = (value << 8) + values[offset];
+		}
+
+		if (write)
+			pages->setValue(index, valueOffset, value);
+		else if (!pages->checkValue(index, valueOffset, value))
+			return RESULT_OUT_OF_RANGE;
+	}
+
+	return RESULT_OK;
+}
+
+
+// get the number of cvs on the backed up page, 0 if there is none
+byte CVBackup::PageSize()
+{
+	if (!pages) return 0;
+
+	byte count = 0;
+	while (count < 255 && pages->getCV(pageIndex, count) >= 0) count++;
+	return count;
+}
+
+
+// crc of a blob, using the crc of the record store
+uint16_t CVBackup::BlobCRC(const byte* blob, byte length)
+{
+	uint16_t crc = 0xFFFF;
+	for (byte i = 0; i < length; i++) crc = RecordStore::UpdateCRC(crc, blob[i]);
+	return crc;
+}
+
+
+// COBS decode a received frame in place, returns the decoded length, or 0 if the frame is not valid
+byte CVBackup::DecodeFrame(byte length)
+{
+	byte decoded = 0;
+	byte i = 0;
+	while (i < length)
+	{
+		// each code is followed by code - 1 bytes, then a zero unless the code is 255 or ends the frame
+		const byte code = buffer[i++];
+		for (byte j = 1; j < code; j++)
+		{
+			if (i >= length) return 0;
+			buffer[decoded++] = buffer[i++];
+		}
+		if (code < 0xFF && i < length) buffer[decoded++] = 0;
+	}
+
+	return decoded;
+}
+
+
+// COBS encode the reply in the buffer as it is written to the port, then end the frame
+void CVBackup::SendFrame(byte length)
+{
+	byte start = 0;
+	while (true)
+	{
+		// each run of up to 254 bytes without a zero is written after its length + 1
+		byte end = start;
+		while (end < length && buffer[end] != 0 && end - start < 254) end++;
+
+		const byte run = end - start;
+		port.write(run + 1);
+		port.write(buffer + start, run);
+		if (end >= length) break;
+
+		// skip the zero that ended the run, which the code stands for
+		start = (run == 254) ? end : end + 1;
+	}
+
+	port.write((byte)0);
+}
@@ -0,0 +1,155 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+CV Backup
+
+A serial endpoint to back up all the CVs of a decoder as one binary blob, and to restore them from one.
+
+Summary:
+
+Setting up a replacement decoder with program on main takes a packet per CV, each shown on the LED and
+saved to storage on its own. This class instead answers a backup command on a serial port with a blob
+holding the CVs of a CVManager, and optionally a page of CVs, protected by a CRC. A restore command
+sends a blob back, which is checked as a whole, and then set as one transaction, with the config saved
+once at the end. The host side tool Tools/cvbackup.py saves the blobs to files, and shows, compares and
+merges them.
+
+Example usage:
+
+		CVBackup backup{ Serial, cv, buffer, sizeof(buffer) };    // create the endpoint for a CVManager,
+		                                                        // with a buffer from BufferSize
+		backup.SetPage(sidingPages, sidingPageIndex);           // optionally add a page of CVs
+		backup.SetRestoreHandler(handler, this);                // set the handler that saves the config
+		                                                        // after a restore, and its context
+		backup.Update();                                        // handle any command from the port
+
+Details:
+
+Each command and reply is a frame, COBS encoded and terminated with a zero byte as for the packet
+sniffer, so that the host can find the start of a reply among any debug output. A command frame is a
+command byte, followed by the blob for a restore. A reply frame is the command byte and a result code,
+followed by the blob for a backup. The blob consists of:
+
+	byte 0-1     magic number 0x4243, little endian
+	byte 2       blob format version
+	byte 3       number of sections
+	sections     a section index (uint16, little endian), a count, and the count entries:
+	             index 0 holds the CVs of the CVManager, as a cv number and value for each index of the
+	             schema, with a cv number of 0 for the low byte of a 16 bit CV
+	             any other index is a page of CVs, with the value of each CV from CV257
+	byte n-2     CRC-16/CCITT of the blob before the CRC, little endian
+
+The CVs are listed by number, so a blob can be restored to a decoder with a different schema version,
+and a blob holding only some of the CVs restores just those. A restore first checks the CRC, and that
+every CV is in the schema and its value in range, and only then sets any CVs, so a blob that can't be
+restored in full changes nothing. The CVs are set through the CVManager, so the handlers subscribed to
+them are called as for a program on main write, and then the restore handler is called once, so that
+the manager saves its config as a single record.
+
+The frames are read from the port as the bytes arrive, into a buffer owned by the manager, and the reply
+is encoded as it is written. A command is handled from Update when its frame is complete. The reply is
+written without waiting for room in the output, since a backup or restore is done with the layout idle.
+
+*/
+
+#ifndef _CVBACKUP_h
+#define _CVBACKUP_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "CVManager.h"
+#include "CVPages.h"
+#include "RecordStore.h"
+
+
+class CVBackup
+{
+public:
+	// handler called after the cvs of a blob have been restored, to save the config
+	typedef void(*RestoreHandler)(void* context);
+
+	enum Command : byte { CMD_BACKUP = 1, CMD_RESTORE = 2 };
+	enum Result : byte
+	{
+		RESULT_OK = 0,
+		RESULT_BAD_COMMAND,         // unknown command
+		RESULT_TOO_LONG,            // the frame or blob doesn't fit in the buffer
+		RESULT_BAD_CRC,             // the blob failed the crc check
+		RESULT_BAD_FORMAT,          // the blob is not in a known format
+		RESULT_UNKNOWN_CV,          // a cv of the blob is not in the schema
+		RESULT_OUT_OF_RANGE,        // a cv value of the blob is out of range
+	};
+
+	// buffer size for the blob of a CVManager and page with the given number of cvs, with the reply
+	// header and the overhead of the encoding
+	static constexpr byte BufferSize(byte numCVs, byte numPageCVs = 0)
+	{
+		return replySize + headerSize + sectionSize + 2 * numCVs + ((numPageCVs > 0) ? sectionSize + numPageCVs : 0) + crcSize + 1;
+	}
+
+	CVBackup(Stream& Port, CVManager& CVs, byte* Buffer, byte BufferSize);
+	void SetPage(CVPages& Pages, uint16_t PageIndex);
+	void SetRestoreHandler(RestoreHandler Handler, void* Context = 0);
+	void Update();
+
+private:
+	enum : uint16_t { blobMagic = 0x4243, cvSection = 0 };
+	enum : byte
+	{
+		formatVersion = 1,
+		replySize = 2,              // command and result
+		headerSize = 4,             // magic, format version and number of sections
+		sectionSize = 3,            // section index and count
+		crcSize = 2,
+	};
+
+	Stream& port;
+	CVManager& cvs;
+	byte* const buffer;             // the received frame, or the reply being built
+	const byte bufferSize;
+	byte received = 0;              // number of frame bytes received
+	bool overflow = false;          // the frame being received doesn't fit in the buffer
+
+	CVPages* pages = 0;             // optional page of cvs
+	uint16_t pageIndex = 0;
+
+	RestoreHandler restoreHandler = 0;
+	void* restoreContext = 0;
+
+	void HandleCommand(byte length);
+	byte Backup();
+	Result Restore(const byte* blob, byte length);
+	Result RestoreSections(const byte* blob, byte length, bool write);
+	Result RestoreCVs(const byte* entries, byte count, bool write);
+	Result RestorePage(uint16_t index, const byte* values, byte count, bool write);
+	byte PageSize();
+	static uint16_t BlobCRC(const byte* blob, byte length);
+
+	byte DecodeFrame(byte length);
+	void SendFrame(byte length);
+};
+
+#endif
@@ -1,103 +1,191 @@
 
 #include "CVManager.h"
 
-CVManager::CVManager(byte num) : numCVs(num), cvStatic(new CVstatic[num]), cv(new CV[num])
+CVManager::CVManager(const CVstatic* schema, byte* values, byte num, byte* index, byte indexSize)
+	: numCVs(num), cvValue(values), cvSchema(schema), cvIndex(index)
 {
+	buildIndex(indexSize);
 }
 
-CVManager::~CVManager()
+// subscribe a handler to changes of the cvs from firstCV to lastCV. returns false if there are no free subscriptions.
+bool CVManager::subscribe(byte firstCV, byte lastCV, CVChangeHandler handler, void* context)
 {
-	delete[] cvStatic;
-	delete[] cv;
+	if (numSubscriptions >= maxSubscriptions) return false;
+
+	subscriptions[numSubscriptions++] = Subscription{ firstCV, lastCV, handler, context };
+	return true;
+}
+
+// call the handlers subscribed to a cv
+void CVManager::notify(byte cvNum, uint16_t value)
+{
+	for (byte i = 0; i < numSubscriptions; i++)
+	{
+		const Subscription& sub = subscriptions[i];
+		if (cvNum >= sub.firstCV && cvNum <= sub.lastCV) sub.handler(sub.context, cvNum, value);
+	}
+}
+
+// read the schema entry for a cv index from flash
+CVManager::CVstatic CVManager::getSchema(byte index)
+{
+	CVstatic entry;
+	memcpy_P(&entry, &cvSchema[index], sizeof(CVstatic));
+	return entry;
 }
 
 void CVManager::resetCVs()
 {
 	for (byte i = 0; i < numCVs; i++)
-		cv[i].cvValue = cvStatic[i].cvDefault;
+		cvValue[i] = pgm_read_byte(&cvSchema[i].cvDefault);
 }
 
-int16_t CVManager::getCVindex(byte cvNum)
+int16_t CVManager::getCVindex(uint16_t cvNum)
 {
-	byte i = 0;
-	while ((i < numCVs) && (cvStatic[i].cvNum != cvNum)) i++;    // find the index of the cv in the array
-
-	// check for invalid cv provided
-	if (i == numCVs) return -1;
+	// check for invalid cv provided, including cv numbers above 255 from the 10 bit cv address of a packet
+	if (cvNum < firstCV || cvNum - firstCV >= indexSpan) return -1;
+	const byte offset = cvNum - firstCV;
+	if (cvIndex[offset] == noIndex) return -1;
 
 	// otherwise return the cv index
-	return i;
+	return cvIndex[offset];
 }
 
-byte CVManager::initCV(byte index, byte cvNum, byte CVDefault, byte rangeMin, byte rangeMax, bool softReset)
+// get the cv number at an index, 0 for the low byte of a 16 bit cv
+byte CVManager::getCVnum(byte index)
 {
-	if (index >= numCVs) return 0;
-
-	cvStatic[index].cvNum = cvNum;
-	cvStatic[index].cvDefault = CVDefault;
-	cvStatic[index].rangeMin = rangeMin;
-	cvStatic[index].rangeMax = rangeMax;
-	cvStatic[index].softReset = softReset;
-	cvStatic[index].is16bit = false;
+	return (index < numCVs) ? pgm_read_byte(&cvSchema[index].cvNum) : 0;
+}
 
-	// return next available index
-	return (index < 255) ? index + 1 : 0;
+// check if the cv at an index is the high byte of a 16 bit cv
+bool CVManager::is16bit(byte index)
+{
+	return (index < numCVs) && pgm_read_byte(&cvSchema[index].is16bit);
 }
 
-byte CVManager::initCV16(byte index, byte cvNum, uint16_t CVDefault, uint16_t rangeMin, uint16_t rangeMax, bool softReset)
+// build the lookup table from cv number to index, so each cv access is a single table read rather
+// than a search of the cvs. the table spans only the range of cv numbers in use, and any cvs above
+// the end of a table that is too small are not found.
+void CVManager::buildIndex(byte indexSize)
 {
-	if (index >= numCVs) return 0;
+	// find the range of cv numbers, cv 0 marks the low byte of a 16 bit cv
+	byte minCV = 255, maxCV = 0;
+	for (byte i = 0; i < numCVs; i++)
+	{
+		const byte cvNum = pgm_read_byte(&cvSchema[i].cvNum);
+		if (cvNum == 0) continue;
+		if (cvNum < minCV) minCV = cvNum;
+		if (cvNum > maxCV) maxCV = cvNum;
+	}
+
+	if (maxCV < minCV) return;    // no cvs
 
-	cvStatic[index].cvNum = cvNum;
-	cvStatic[index].cvDefault = highByte(CVDefault);
-	cvStatic[index + 1].cvDefault = lowByte(CVDefault);
-	cvStatic[index].rangeMin = highByte(rangeMin);
-	cvStatic[index + 1].rangeMin = lowByte(rangeMin);
-	cvStatic[index].rangeMax = highByte(rangeMax);
-	cvStatic[index + 1].rangeMax = lowByte(rangeMax);
-	cvStatic[index].softReset = softReset;
-	cvStatic[index].is16bit = true;
+	firstCV = minCV;
+	indexSpan = maxCV - minCV + 1;
+	if (indexSpan > indexSize)
+	{
+#ifdef _DEBUG
+		Serial.println("CV index is too small for the schema.");
+#endif
+		indexSpan = indexSize;
+	}
 
-	// return next available index
-	return (index < 255) ? index + 2 : 0;
+	for (byte i = 0; i < indexSpan; i++) cvIndex[i] = noIndex;
+	for (byte i = 0; i < numCVs; i++)
+	{
+		const byte cvNum = pgm_read_byte(&cvSchema[i].cvNum);
+		if (cvNum != 0 && cvNum - firstCV < indexSpan) cvIndex[cvNum - firstCV] = i;
+	}
 }
 
-uint16_t CVManager::getCV(byte cvNum)
+uint16_t CVManager::getCV(uint16_t cvNum)
 {
 	const int16_t cvIndex = getCVindex(cvNum);
 	if (cvIndex == -1) return 0;    // requested cv was not found in our collection
 
-	if (cvStatic[cvIndex].is16bit)
-		return (cv[cvIndex].cvValue << 8) + cv[cvIndex + 1].cvValue;
+	if (pgm_read_byte(&cvSchema[cvIndex].is16bit))
+		return (cvValue[cvIndex] << 8) + cvValue[cvIndex + 1];
 	else
-		return cv[cvIndex].cvValue;
+		return cvValue[cvIndex];
 }
 
-bool CVManager::setCV(byte cvNum, uint16_t value)
+bool CVManager::setCV(uint16_t cvNum, uint16_t value)
 {
+	if (!checkCV(cvNum, value)) return false;    // requested cv was not found in our collection, or out of range
 	const int16_t cvIndex = getCVindex(cvNum);
-	if (cvIndex == -1) return false;    // requested cv was not found in our collection
 
-	if (cvStatic[cvIndex].is16bit)
+	// value supplied is ok, so store it
+	if (pgm_read_byte(&cvSchema[cvIndex].is16bit))
 	{
-		// check for valid range of data provided
-		const uint16_t min = (cvStatic[cvIndex].rangeMin << 8) + cvStatic[cvIndex + 1].rangeMin;
-		const uint16_t max = (cvStatic[cvIndex].rangeMax << 8) + cvStatic[cvIndex + 1].rangeMax;
-		if (value < min || value > max) return false;
-
-		// value supplied is ok, so store it
-		cv[cvIndex].cvValue = highByte(value);
-		cv[cvIndex + 1].cvValue = lowByte(value);
+		if (value == getCV(cvNum)) return true;
+		cvValue[cvIndex] = highByte(value);
+		cvValue[cvIndex + 1] = lowByte(value);
 	}
 	else
 	{
-		// check for valid range of data provided
-		if (value < cvStatic[cvIndex].rangeMin || value > cvStatic[cvIndex].rangeMax) return false;
-
-		// value supplied is ok, so store it
-		cv[cvIndex].cvValue = value;
+		if (value == cvValue[cvIndex]) return true;
+		cvValue[cvIndex] = value;
 	}
 
+	// then let the subscribers update any state derived from the cv
+	notify(cvNum, value);
 	return true;
 }
 
+// check that a value is in the range of a cv, without setting it. returns false for an unknown cv.
+bool CVManager::checkCV(uint16_t cvNum, uint16_t value)
+{
+	const int16_t cvIndex = getCVindex(cvNum);
+	if (cvIndex == -1) return false;
+
+	const CVstatic entry = getSchema(cvIndex);
+	if (entry.is16bit)
+	{
+		// a 16 bit value is checked against the range of the high and low bytes together
+		const CVstatic lowEntry = getSchema(cvIndex + 1);
+		const uint16_t min = (entry.rangeMin << 8) + lowEntry.rangeMin;
+		const uint16_t max = (entry.rangeMax << 8) + lowEntry.rangeMax;
+		return value >= min && value <= max;
+	}
+
+	return value >= entry.rangeMin && value <= entry.rangeMax;
+}
+
+// check a verify byte, or a bit manipulation with data 1110DBBB, against the cv. returns false for
+// other instructions or an unknown cv.
+bool CVManager::verifyCV(byte instructionType, unsigned int cvNum, byte data)
+{
+	if (getCVindex(cvNum) == -1) return false;
+
+	return verifyValue(instructionType, getCV(cvNum), data);
+}
+
+// get the value to store for a write byte, or a bit manipulation with data 1111DBBB. returns -1 for
+// other instructions, or a bit write to an unknown cv.
+int16_t CVManager::getWriteValue(byte instructionType, unsigned int cvNum, byte data)
+{
+	if (instructionType == CV_WRITE) return data;
+	if (getCVindex(cvNum) == -1) return -1;
+
+	return getNewValue(instructionType, getCV(cvNum), data);
+}
+
+// check a verify byte or verify bit instruction against a value, for cvs held outside of a CVManager
+bool CVManager::verifyValue(byte instructionType, uint16_t value, byte data)
+{
+	if (instructionType == CV_VERIFY) return value == data;
+	if (instructionType == CV_BIT && (data & 0xF0) == 0xE0) return bitRead(value, data & 0x07) == bitRead(data, 3);
+	return false;
+}
+
+// get the new value for a write byte or write bit instruction, from the current value. returns -1 for
+// other instructions.
+int16_t CVManager::getNewValue(byte instructionType, byte value, byte data)
+{
+	if (instructionType == CV_WRITE) return data;
+	if (instructionType != CV_BIT || (data & 0xF0) != 0xF0) return -1;
+
+	bitWrite(value, data & 0x07, bitRead(data, 3));
+	return value;
+}
+
@@ -9,42 +9,107 @@
 	#include "WProgram.h"
 #endif
 
+// The cv schema (numbers, defaults and ranges) is constant, so it is defined by each manager as a table
+// in flash (PROGMEM), and read with pgm_read. Only the live cv values are held in RAM, in an array also
+// owned by the manager, normally the CVs array of the config struct that is stored in EEPROM. A 16 bit
+// cv takes two indexes, for the high and low bytes, and is added to the schema with CV16_SCHEMA. The
+// lookup table from cv number to index is a third array owned by the manager, sized with IndexSize for
+// the lowest and highest cv numbers of the schema, so that nothing is allocated on the heap.
+//
+// A manager that keeps state derived from its cvs (servo extents, address, output mapping) subscribes to
+// the range of cvs that state depends on. When setCV changes the value of a cv, the handlers subscribed to
+// it are called with the cv number and new value, so only the affected state is recomputed, and the state
+// can be held in member variables rather than read through getCV where it is used. Loading or resetting
+// the cvs doesn't call the handlers, so the state is set up from the cvs when the manager initializes.
+
+// schema entries for a 16 bit cv
+#define CV16_SCHEMA(cvNum, cvDefault, rangeMin, rangeMax, softReset) \
+	CVManager::CV16High(cvNum, cvDefault, rangeMin, rangeMax, softReset), CVManager::CV16Low(cvDefault, rangeMin, rangeMax)
+
 class CVManager
 {
 public:
-	explicit CVManager(byte numCVs);
-	~CVManager();
-
-	void resetCVs();
-	int16_t getCVindex(byte cvNum);
-
-	byte initCV(byte index, byte cvNum, byte CVDefault, byte rangeMin = 0, byte rangeMax = 255, bool softReset = true);
-	byte initCV16(byte index, byte cvNum, uint16_t CVDefault, uint16_t rangeMin = 0, uint16_t rangeMax = 65535, bool softReset = true);
-	uint16_t getCV(byte cvNum);
-	bool setCV(byte cvNum, uint16_t value);
-	
 	struct CVstatic
 	{
-		byte cvNum = 0;             // cv number
-		byte cvDefault = 0;         // default value for the cv
-		byte rangeMin = 0;          // valid range of CV value
-		byte rangeMax = 255;
-		bool softReset = true;      // should this cv get reset during a soft reset
-		bool is16bit = false;       // is this a 16 bit cv, so we aggregate it with the next index
+		byte cvNum;             // cv number, 0 for the low byte of a 16 bit cv
+		byte cvDefault;         // default value for the cv
+		byte rangeMin;          // valid range of CV value
+		byte rangeMax;
+		bool softReset;         // should this cv get reset during a soft reset
+		bool is16bit;           // is this a 16 bit cv, so we aggregate it with the next index
 	};
 
-	struct CV
+	// schema entry for an 8 bit cv
+	static constexpr CVstatic CV8(byte cvNum, byte cvDefault, byte rangeMin = 0, byte rangeMax = 255, bool softReset = true)
 	{
-		byte cvNum = 0;
-		byte cvValue = 0;
-	};
+		return CVstatic{ cvNum, cvDefault, rangeMin, rangeMax, softReset, false };
+	}
+
+	// schema entries for the high and low bytes of a 16 bit cv
+	static constexpr CVstatic CV16High(byte cvNum, uint16_t cvDefault, uint16_t rangeMin, uint16_t rangeMax, bool softReset)
+	{
+		return CVstatic{ cvNum, highByte(cvDefault), highByte(rangeMin), highByte(rangeMax), softReset, true };
+	}
+	static constexpr CVstatic CV16Low(uint16_t cvDefault, uint16_t rangeMin, uint16_t rangeMax)
+	{
+		return CVstatic{ 0, lowByte(cvDefault), lowByte(rangeMin), lowByte(rangeMax), false, false };
+	}
+
+	// handler for a change to a cv value, with the cv number and the new value
+	typedef void(*CVChangeHandler)(void* context, byte cvNum, uint16_t value);
+
+	// size of the index for the cv numbers from firstCV to lastCV, the lowest and highest in the schema
+	static constexpr byte IndexSize(byte firstCV, byte lastCV) { return lastCV - firstCV + 1; }
 
-	byte numCVs;
-	CVstatic* cvStatic;
-	CV* cv;
+	CVManager(const CVstatic* schema, byte* values, byte numCVs, byte* index, byte indexSize);
+
+	bool subscribe(byte firstCV, byte lastCV, CVChangeHandler handler, void* context = 0);
+
+	void resetCVs();
+	int16_t getCVindex(uint16_t cvNum);
+	byte getCVnum(byte index);
+	bool is16bit(byte index);
+
+	uint16_t getCV(uint16_t cvNum);
+	bool setCV(uint16_t cvNum, uint16_t value);
+	bool checkCV(uint16_t cvNum, uint16_t value);
+
+	// cv access instructions, as sent in program on main and service mode packets
+	enum CVInstruction : byte { CV_VERIFY = 1, CV_BIT = 2, CV_WRITE = 3 };
+	bool verifyCV(byte instructionType, unsigned int cvNum, byte data);
+	int16_t getWriteValue(byte instructionType, unsigned int cvNum, byte data);
+	static bool verifyValue(byte instructionType, uint16_t value, byte data);
+	static int16_t getNewValue(byte instructionType, byte value, byte data);
+
+	const byte numCVs;
+	byte* const cvValue;          // live cv values, by index
 
 private:
+	const CVstatic* const cvSchema;    // cv schema in flash, by index
+	CVstatic getSchema(byte index);
+
+	// lookup table from cv number to index, covering the cv numbers from firstCV to firstCV + indexSpan - 1.
+	// owned by the manager, with a size from IndexSize, and built by the constructor.
+	enum : byte { noIndex = 255 };
+	void buildIndex(byte indexSize);
+
+	byte* const cvIndex;
+	byte firstCV = 0;
+	byte indexSpan = 0;
+
+	// handlers subscribed to changes of a range of cvs
+	struct Subscription
+	{
+		byte firstCV;
+		byte lastCV;
+		CVChangeHandler handler;
+		void* context;
+	};
 
+	enum : byte { maxSubscriptions = 4 };
+	Subscription subscriptions[maxSubscriptions];
+	byte numSubscriptions = 0;
+	void notify(byte cvNum, uint16_t value);
 };
 
 #endif
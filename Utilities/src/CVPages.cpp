@@ -0,0 +1,256 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "CVPages.h"
+
+CVPages::CVPages(const Page* pages, byte num, byte* buffer, byte size)
+	: pageTable(pages), numPages(num), pageBuffer(buffer), bufferSize(size)
+{
+	// select the first page at power on
+	selectedIndex = (numPages > 0) ? pgm_read_word(&pageTable[0].index) : (uint16_t)firstManufacturerPage;
+}
+
+
+void CVPages::SetStorage(ReadHandler reader, WriteHandler writer, void* context)
+{
+	readHandler = reader;
+	writeHandler = writer;
+	storageContext = context;
+	pageLoaded = false;
+}
+
+
+// check if a cv is one of the index cvs or a paged cv
+bool CVPages::isPagedCV(uint16_t cvNum)
+{
+	return cvNum == CV_IndexHigh || cvNum == CV_IndexLow || (cvNum >= firstPagedCV && cvNum <= lastPagedCV);
+}
+
+
+// read an index cv, or a cv of the selected page. returns -1 if the cv is not on the page.
+int16_t CVPages::getCV(uint16_t cvNum)
+{
+	if (cvNum == CV_IndexHigh) return highByte(selectedIndex);
+	if (cvNum == CV_IndexLow) return lowByte(selectedIndex);
+	if (cvNum < firstPagedCV || cvNum > lastPagedCV) return -1;
+
+	return getCV(selectedIndex, cvNum - firstPagedCV);
+}
+
+
+// write an index cv, or a cv of the selected page. returns false if the cv is not on the page, or the
+// value is out of range.
+bool CVPages::setCV(uint16_t cvNum, byte value)
+{
+	// the page is only loaded when one of its cvs is accessed
+	if (cvNum == CV_IndexHigh)
+	{
+		selectedIndex = (value << 8) + lowByte(selectedIndex);
+		return true;
+	}
+	if (cvNum == CV_IndexLow)
+	{
+		selectedIndex = (selectedIndex & 0xFF00) + value;
+		return true;
+	}
+	if (cvNum < firstPagedCV || cvNum > lastPagedCV) return false;
+
+	return setCV(selectedIndex, cvNum - firstPagedCV, value);
+}
+
+
+// read a cv of a page, by its offset from CV257. returns -1 if the cv is not on the page.
+int16_t CVPages::getCV(uint16_t pageIndex, byte offset)
+{
+	if (!LoadPage(pageIndex) || offset >= loadedPage.numCVs) return -1;
+
+	return pageBuffer[offset];
+}
+
+
+// write a cv of a page, by its offset from CV257. returns false if the cv is not on the page, or the
+// value is out of range.
+bool CVPages::setCV(uint16_t pageIndex, byte offset, byte value)
+{
+	if (!LoadPage(pageIndex) || offset >= loadedPage.numCVs) return false;
+	if (!CheckRange(offset, value)) return false;
+
+	return WriteCV(offset, value);
+}
+
+
+// read a value from a page, 16 bit if the offset is the high byte of a 16 bit value. returns 0 if the
+// value is not on the page.
+uint16_t CVPages::getValue(uint16_t pageIndex, byte offset)
+{
+	if (!LoadPage(pageIndex) || offset >= loadedPage.numCVs) return 0;
+
+	if (is16bit(pageIndex, offset))
+		return (pageBuffer[offset] << 8) + pageBuffer[offset + 1];
+	else
+		return pageBuffer[offset];
+}
+
+
+// write a value to a page, 16 bit if the offset is the high byte of a 16 bit value. returns false if the
+// value is not on the page, or is out of range.
+bool CVPages::setValue(uint16_t pageIndex, byte offset, uint16_t value)
+{
+	if (!checkValue(pageIndex, offset, value)) return false;
+
+	if (is16bit(pageIndex, offset))
+		return WriteCV(offset, highByte(value)) && WriteCV(offset + 1, lowByte(value));
+
+	return WriteCV(offset, value);
+}
+
+
+// check that a value is in range for a page, without writing it. returns false if the value is not on
+// the page.
+bool CVPages::checkValue(uint16_t pageIndex, byte offset, uint16_t value)
+{
+	if (!LoadPage(pageIndex) || offset >= loadedPage.numCVs) return false;
+
+	CVManager::CVstatic entry;
+	memcpy_P(&entry, &loadedPage.schema[offset], sizeof(CVManager::CVstatic));
+	if (is16bit(pageIndex, offset))
+	{
+		// check the whole value against the range of the high and low bytes
+		CVManager::CVstatic lowEntry;
+		memcpy_P(&lowEntry, &loadedPage.schema[offset + 1], sizeof(CVManager::CVstatic));
+		const uint16_t min = (entry.rangeMin << 8) + lowEntry.rangeMin;
+		const uint16_t max = (entry.rangeMax << 8) + lowEntry.rangeMax;
+		return value >= min && value <= max;
+	}
+
+	return value >= entry.rangeMin && value <= entry.rangeMax;
+}
+
+
+// check if the cv at an offset of a page is the high byte of a 16 bit value
+bool CVPages::is16bit(uint16_t pageIndex, byte offset)
+{
+	if (!LoadPage(pageIndex) || offset + 1 >= loadedPage.numCVs) return false;
+
+	return pgm_read_byte(&loadedPage.schema[offset].is16bit);
+}
+
+
+// write the defaults of all the pages to storage
+void CVPages::resetPages()
+{
+	Page page;
+	for (byte i = 0; i < numPages; i++)
+	{
+		memcpy_P(&page, &pageTable[i], sizeof(Page));
+		for (byte j = 0; j < page.numCVs; j++)
+			WriteStorage(page.address + j, pgm_read_byte(&page.schema[j].cvDefault));
+	}
+
+	// the buffer no longer matches storage
+	pageLoaded = false;
+}
+
+
+// read the page from storage again on the next access, after the storage has been changed
+void CVPages::reloadPage()
+{
+	pageLoaded = false;
+}
+
+
+// load a page into the buffer, if it is not already loaded. returns false if there is no such page.
+bool CVPages::LoadPage(uint16_t pageIndex)
+{
+	if (pageLoaded && loadedPage.index == pageIndex) return true;
+
+	Page page;
+	for (byte i = 0; i < numPages; i++)
+	{
+		memcpy_P(&page, &pageTable[i], sizeof(Page));
+		if (page.index != pageIndex) continue;
+		if (page.numCVs > bufferSize) return false;
+
+		for (byte j = 0; j < page.numCVs; j++)
+			pageBuffer[j] = ReadStorage(page.address + j);
+
+		loadedPage = page;
+		pageLoaded = true;
+		return true;
+	}
+
+	return false;
+}
+
+
+// check a byte written to the loaded page. the low byte of a 16 bit value is checked with the high byte
+// in the buffer, and the high byte only against its own range.
+bool CVPages::CheckRange(byte offset, byte value)
+{
+	CVManager::CVstatic entry;
+	memcpy_P(&entry, &loadedPage.schema[offset], sizeof(CVManager::CVstatic));
+
+	if (entry.cvNum == 0 && offset > 0 && pgm_read_byte(&loadedPage.schema[offset - 1].is16bit))
+	{
+		CVManager::CVstatic highEntry;
+		memcpy_P(&highEntry, &loadedPage.schema[offset - 1], sizeof(CVManager::CVstatic));
+		const uint16_t min = (highEntry.rangeMin << 8) + entry.rangeMin;
+		const uint16_t max = (highEntry.rangeMax << 8) + entry.rangeMax;
+		const uint16_t newValue = (pageBuffer[offset - 1] << 8) + value;
+		return newValue >= min && newValue <= max;
+	}
+
+	return value >= entry.rangeMin && value <= entry.rangeMax;
+}
+
+
+// write a cv of the loaded page to the buffer and to storage
+bool CVPages::WriteCV(byte offset, byte value)
+{
+	pageBuffer[offset] = value;
+	WriteStorage(loadedPage.address + offset, value);
+	return true;
+}
+
+
+byte CVPages::ReadStorage(int address)
+{
+	if (readHandler) return readHandler(storageContext, address);
+
+#if !defined(ADAFRUIT_METRO_M0_EXPRESS)
+	return EEWriter.Read(address);
+#else
+	return 0;    // no default storage
+#endif
+}
+
+
+void CVPages::WriteStorage(int address, byte value)
+{
+	if (writeHandler)
+	{
+		writeHandler(storageContext, address, value);
+		return;
+	}
+
+#if !defined(ADAFRUIT_METRO_M0_EXPRESS)
+	EEWriter.Write(address, value);
+#endif
+}
@@ -0,0 +1,150 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+CV Pages
+
+Indexed CV pages, selected by CV31 and CV32, for tables of CVs too large to keep in RAM.
+
+Summary:
+
+The NMRA indexed CVs give a decoder up to 256 CVs per page, accessed as CV257-CV512, with the page
+selected by the index in CV31 (high byte) and CV32 (low byte). Each page is a table of byte CVs held
+in storage, with the defaults and ranges in a schema in flash. Only the page in use is held in RAM,
+in a buffer owned by the manager, and it is loaded from storage on the first access after a
+different page is selected. A write to a paged CV updates the buffer and writes just that byte to
+storage.
+
+Example usage:
+
+		CVPages pages(pageTable, 2, buffer, 36);   // create the pages from a table in flash, with a buffer
+		                                           // sized for the largest page
+		pages.SetStorage(reader, writer, this);    // optionally store the pages other than in EEPROM
+		pages.isPagedCV(cvNum);                    // check if a cv is CV31, CV32 or a paged cv
+		pages.setCV(cvNum, value);                 // write CV31, CV32 or a cv of the selected page
+		pages.getCV(cvNum);                        // read CV31, CV32 or a cv of the selected page
+		pages.setCV(pageIndex, offset, value);     // write a cv of a page by its offset from CV257, as
+		pages.getCV(pageIndex, offset);            // for XPOM, without selecting the page
+		pages.getValue(pageIndex, offset);         // read a value from a page, without selecting it
+		pages.resetPages();                        // write the defaults of all pages to storage
+		pages.reloadPage();                        // read the page from storage again on the next access
+
+Details:
+
+The pages are described by a table in flash, giving for each page its index, its schema, the number
+of CVs, and its address in storage. The first CV of a page, CV257, is at offset 0 of the page, so
+access to a CV of the loaded page is a read of the buffer at the offset, with no search. The page
+table is only searched when the selected page changes. Index values up to 4095 (CV31 = 0-15) are
+reserved by the NMRA, so manufacturer pages start at index 4096, CV31 = 16. CV31 and CV32 are held
+in RAM, and select the first page in the table at power on.
+
+A 16 bit value is held on a page as two CVs, the high byte then the low byte, as in the schema given
+by CV16_SCHEMA, and is read and written by the manager with getValue and setValue at the offset of the
+high byte. When the high byte is written over DCC only its own range is checked, since the low byte
+may not have been written yet, and when the low byte is written the whole value is checked.
+
+The manager may access a page other than the one selected by CV31 and CV32, in which case that page
+is loaded in place of the selected page, and the selected page is loaded again on the next DCC access.
+By default the pages are stored in EEPROM through the EEPROM writer on AVR, at the page address. A
+reader and writer may instead be set, for example to store the pages in a config struct in flash on
+the Metro M0, where there is no default storage. If the storage is changed other than through the
+pages, such as when a stored config is loaded, reloadPage makes the next access read the page again.
+
+*/
+
+#ifndef _CVPAGES_h
+#define _CVPAGES_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "CVManager.h"
+
+#if !defined(ADAFRUIT_METRO_M0_EXPRESS)
+#include "EEPROMWriter.h"
+#endif
+
+
+class CVPages
+{
+public:
+	// a page of cvs, selected by CV31 and CV32
+	struct Page
+	{
+		uint16_t index;                        // page index, CV31 * 256 + CV32
+		const CVManager::CVstatic* schema;     // defaults and ranges of the cvs on the page, in flash
+		byte numCVs;                           // number of cvs on the page, from CV257
+		int address;                           // storage address of the first cv
+	};
+
+	// handlers for storing the pages other than in EEPROM
+	typedef byte(*ReadHandler)(void* context, int address);
+	typedef void(*WriteHandler)(void* context, int address, byte value);
+
+	enum : uint16_t { CV_IndexHigh = 31, CV_IndexLow = 32, firstPagedCV = 257, lastPagedCV = 512 };
+	enum : uint16_t { firstManufacturerPage = 4096 };
+
+	CVPages(const Page* pages, byte numPages, byte* buffer, byte bufferSize);
+	void SetStorage(ReadHandler reader, WriteHandler writer, void* context = 0);
+
+	// cv access through CV31 and CV32, as from dcc packets
+	bool isPagedCV(uint16_t cvNum);
+	int16_t getCV(uint16_t cvNum);
+	bool setCV(uint16_t cvNum, byte value);
+
+	// cv access by page and offset, as from xpom packets with a 24 bit cv address
+	int16_t getCV(uint16_t pageIndex, byte offset);
+	bool setCV(uint16_t pageIndex, byte offset, byte value);
+
+	// value access by page and offset, 16 bit values are read and written at the offset of the high byte
+	uint16_t getValue(uint16_t pageIndex, byte offset);
+	bool setValue(uint16_t pageIndex, byte offset, uint16_t value);
+	bool checkValue(uint16_t pageIndex, byte offset, uint16_t value);
+	bool is16bit(uint16_t pageIndex, byte offset);
+
+	void resetPages();
+	void reloadPage();
+
+private:
+	const Page* const pageTable;    // in flash
+	const byte numPages;
+	byte* const pageBuffer;         // cvs of the loaded page
+	const byte bufferSize;
+
+	ReadHandler readHandler = 0;
+	WriteHandler writeHandler = 0;
+	void* storageContext = 0;
+
+	uint16_t selectedIndex;         // page selected by CV31 and CV32
+	Page loadedPage;                // page held in the buffer
+	bool pageLoaded = false;
+
+	bool LoadPage(uint16_t pageIndex);
+	bool CheckRange(byte offset, byte value);
+	bool WriteCV(byte offset, byte value);
+	byte ReadStorage(int address);
+	void WriteStorage(int address, byte value);
+};
+
+#endif
@@ -0,0 +1,245 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "CVStore.h"
+
+CVStore::CVStore(CVManager& CVs, RecordStore& Store, byte Key, byte Version, const Layout* Layouts, byte NumLayouts)
+	: cvs(CVs), store(Store), key(Key), version(Version), layouts(Layouts), numLayouts(NumLayouts)
+{
+}
+
+
+void CVStore::SetMigrationHandler(MigrationHandler Handler, void* Context)
+{
+	migrationHandler = Handler;
+	migrationContext = Context;
+}
+
+
+void CVStore::SetPatchKey(byte Key)
+{
+	patchKey = Key;
+}
+
+
+// load the cvs, migrating them from an earlier version, or setting the defaults if there is no valid config
+CVStore::LoadResult CVStore::Load()
+{
+	// a config that is still queued is written before it is read back
+	store.Flush();
+
+	const byte length = store.Length(key);
+	byte storedVersion;
+	Layout layout;
+
+	if (length > 0 && store.Read(key, &storedVersion, 1))
+	{
+		// the current version is loaded as is
+		if (storedVersion == version && length == cvs.numCVs + 1)
+		{
+			store.Read(key, cvs.cvValue, cvs.numCVs, 1);
+			LoadPatch();
+			return LOADED;
+		}
+
+		// an earlier version is migrated
+		if (FindLayout(storedVersion, layout) && length == layout.numCVs + 1)
+		{
+			Migrate(layout);
+			return MIGRATED;
+		}
+	}
+#if !defined(ADAFRUIT_METRO_M0_EXPRESS)
+	else if (!store.IsFormatted())
+	{
+		// a config stored by firmware from before the record store
+		if (LoadLegacy()) return MIGRATED;
+	}
+#endif
+
+#ifdef _DEBUG
+	Serial.println("No valid config, setting CVs to defaults.");
+#endif
+
+	// first boot, or a config that can't be used
+	cvs.resetCVs();
+	Save();
+	return DEFAULTS;
+}
+
+
+// queue the cvs to be saved as a record, after the version, and clear the patch
+void CVStore::Save()
+{
+	const bool clearPatch = patchKey != noKey && (patchCount > 0 || store.Length(patchKey) > sizeof(patchBase));
+	if (clearPatch)
+	{
+		// finish writing the patch, so that the cleared patch is written after the config
+		if (store.IsSaving(patchKey)) store.Flush();
+		patchCount = 0;
+	}
+
+	store.Save(key, &version, 1, cvs.cvValue, cvs.numCVs);
+	patchBase = ConfigCRC();
+	if (clearPatch) store.Save(patchKey, patch, 0, &patchBase, sizeof(patchBase));
+}
+
+
+// queue a change to a single cv to be saved in the patch, or the whole config if there is no room
+void CVStore::SaveCV(byte cvNum)
+{
+	const int16_t index = cvs.getCVindex(cvNum);
+	if (index < 0) return;
+
+	// the config is saved as a whole if it is still being written, since it may include the change
+	if (patchKey == noKey || store.IsSaving(key) ||
+		!AddToPatch(index) || (cvs.is16bit(index) && !AddToPatch(index + 1)))
+	{
+		Save();
+		return;
+	}
+
+	store.Save(patchKey, patch, 2 * patchCount, &patchBase, sizeof(patchBase));
+}
+
+
+// apply the stored patch to the loaded config, if it was saved after the config
+void CVStore::LoadPatch()
+{
+	patchCount = 0;
+	patchBase = ConfigCRC();
+	if (patchKey == noKey) return;
+
+	// the patch is the index and value of each cv, followed by the crc of the config
+	const byte length = store.Length(patchKey);
+	if (length < sizeof(patchBase) || length > sizeof(patch) + sizeof(patchBase) || (length & 1) != 0) return;
+
+	uint16_t base;
+	const byte patchLength = length - sizeof(patchBase);
+	if (!store.Read(patchKey, &base, sizeof(base), patchLength) || base != patchBase) return;
+	if (!store.Read(patchKey, patch, patchLength)) return;
+
+	for (byte i = 0; i < patchLength; i += 2)
+	{
+		if (patch[i] >= cvs.numCVs) return;
+		cvs.cvValue[patch[i]] = patch[i + 1];
+	}
+	patchCount = patchLength / 2;
+}
+
+
+// set the value of a cv index in the patch, adding it if it isn't there, returns false if the patch is full
+bool CVStore::AddToPatch(byte index)
+{
+	byte i = 0;
+	while (i < patchCount && patch[2 * i] != index) i++;
+	if (i == maxPatchCVs) return false;
+
+	patch[2 * i] = index;
+	patch[2 * i + 1] = cvs.cvValue[index];
+	if (i == patchCount) patchCount++;
+	return true;
+}
+
+
+// crc of the config record, the version and then the cvs
+uint16_t CVStore::ConfigCRC()
+{
+	uint16_t crc = RecordStore::UpdateCRC(0xFFFF, version);
+	for (byte i = 0; i < cvs.numCVs; i++) crc = RecordStore::UpdateCRC(crc, cvs.cvValue[i]);
+	return crc;
+}
+
+
+// read a cv of the config being migrated, by its index in the old layout
+byte CVStore::OldValue(byte index)
+{
+#if !defined(ADAFRUIT_METRO_M0_EXPRESS)
+	if (legacySource) return EEWriter.Read(legacyAddress + index);
+#endif
+
+	byte value = 0;
+	store.Read(key, &value, 1, index + 1);
+	return value;
+}
+
+
+// get the layout of an earlier version, returns false if there is none
+bool CVStore::FindLayout(byte oldVersion, Layout& layout)
+{
+	for (byte i = 0; i < numLayouts; i++)
+	{
+		memcpy_P(&layout, &layouts[i], sizeof(Layout));
+		if (layout.version == oldVersion) return true;
+	}
+
+	return false;
+}
+
+
+// set the cvs from a config of an earlier version, and save them with the current version
+void CVStore::Migrate(const Layout& layout)
+{
+#ifdef _DEBUG
+	Serial.print("Migrating config from version ");
+	Serial.println(layout.version, DEC);
+#endif
+
+	// cvs that are new in this version get their defaults
+	cvs.resetCVs();
+
+	// copy the cvs that are in both versions, by cv number
+	for (byte i = 0; i < layout.numCVs; i++)
+	{
+		const byte cvNum = pgm_read_byte(&layout.cvNums[i]);
+		const int16_t index = (cvNum != 0) ? cvs.getCVindex(cvNum) : -1;
+		if (index < 0) continue;
+
+		cvs.cvValue[index] = OldValue(i);
+
+		// the low byte of a 16 bit cv follows the high byte in both versions
+		const bool oldLowByte = (i + 1 < layout.numCVs) && pgm_read_byte(&layout.cvNums[i + 1]) == 0;
+		if (oldLowByte && cvs.is16bit(index))
+			cvs.cvValue[index + 1] = OldValue(i + 1);
+	}
+
+	// then any conversions that the manager needs to make
+	if (migrationHandler) migrationHandler(migrationContext, layout.version);
+
+	Save();
+}
+
+
+#if !defined(ADAFRUIT_METRO_M0_EXPRESS)
+
+// migrate the config stored without a header in eeprom by earlier firmware, as version 0, and save it
+// to the record store. returns false if there is no legacy config that can be used.
+bool CVStore::LoadLegacy()
+{
+	Layout layout;
+	if (EEWriter.Read(legacyAddress) == 255 || !FindLayout(0, layout)) return false;    // default value for unwritten eeprom
+
+	legacySource = true;
+	Migrate(layout);
+	legacySource = false;
+	return true;
+}
+
+#endif    // !defined(ADAFRUIT_METRO_M0_EXPRESS)
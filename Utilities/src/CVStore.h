@@ -0,0 +1,155 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+CV Store
+
+Storage of the CVs of a CVManager as a versioned record in a record store.
+
+Summary:
+
+The CVs are stored as a record of the record store, which checks them with a CRC, after a byte holding
+the version of the CV schema. When the CVs are loaded, the version and length are checked so that a
+config stored by different firmware is never loaded as is. A config stored with an earlier schema
+version is migrated to the current schema, keeping the values of the CVs that are in both. On AVR, a
+config stored directly in EEPROM by earlier firmware is migrated into the record store the first time
+it is loaded.
+
+Example usage:
+
+		CVStore cvStore(cv, store, 0, 2, layouts, 2);   // create a store for a CVManager, as the record with
+		                                                // key 0 in a record store, for schema version 2,
+		                                                // with the layouts of earlier versions.
+		cvStore.SetMigrationHandler(handler, this);     // set an optional handler for migrating CVs that
+		                                                // can't be copied as is, and its context.
+		cvStore.SetPatchKey(1);                         // optionally save single CVs as a patch record,
+		                                                // here with key 1.
+		cvStore.Load();                                 // load the CVs, migrating or resetting them as needed.
+		cvStore.Save();                                 // queue the CVs to be saved by the store's Update.
+		cvStore.SaveCV(29);                             // queue a change to one CV, here CV29, to be saved.
+
+Details:
+
+Each earlier schema version that can be migrated is described by a Layout, which lists the CV number
+stored at each index, with 0 for the low byte of a 16 bit CV. The layout tables are kept in flash.
+
+When a config of an earlier version is loaded, the CVs are first set to their defaults, then each CV
+of the old layout that is also in the current schema is copied to its current index. The migration
+handler, if one is set, is then called with the old version, and may read the old CVs with OldValue
+to convert any whose meaning has changed, before the migrated config is saved with the current
+version. A config of a version with no layout is replaced with the default CVs.
+
+Before the record store was added, the config was stored at the start of EEPROM with no header, as
+version 0. If the record store has not been written, the config is migrated from there with the
+layout of version 0, and then saved to the store, which replaces it. Once the store is in use it is
+never read again.
+
+A config is saved as a single record, so a loss of power while it is saved leaves the config that was
+saved before it. A save that doesn't change any CVs is not written. Save only queues the record, which
+is written from the Update of the record store, a few bytes at a time on AVR, so that a CV write
+doesn't wait for the EEPROM. The CVs are read from the CVManager as they are written, and Load writes
+any queued records first, so that it reads the config that was last saved.
+
+If a patch key is set, a change to a single CV, such as a program on main write, is saved with SaveCV
+as a patch record rather than as the whole config. The patch holds the index and value of each CV
+changed since the config was last saved, followed by the CRC of that config, so a bit write appends a
+few bytes rather than every CV. Load applies the patch only if its CRC matches the loaded config, so a
+patch left from before a later save of the config is ignored. A full save writes the config and then
+clears the patch, and a save that doesn't fit in the patch, or a change made while the config is still
+being written, saves the whole config. If the patch is still being written when the whole config is
+saved, it is written first, so that the two are always written in order.
+
+*/
+
+#ifndef _CVSTORE_h
+#define _CVSTORE_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "CVManager.h"
+#include "RecordStore.h"
+#if !defined(ADAFRUIT_METRO_M0_EXPRESS)
+#include "EEPROMWriter.h"
+#endif
+
+
+class CVStore
+{
+public:
+	// the layout of the cvs stored by an earlier schema version
+	struct Layout
+	{
+		byte version;
+		byte numCVs;
+		const byte* cvNums;     // cv number at each index, in flash
+	};
+
+	// handler for migrating a config from an earlier version, which is passed the old version. the old
+	// cvs can be read with OldValue while it is called.
+	typedef void(*MigrationHandler)(void* context, byte oldVersion);
+
+	enum LoadResult : byte { LOADED, MIGRATED, DEFAULTS };
+
+	CVStore(CVManager& CVs, RecordStore& Store, byte Key, byte Version, const Layout* Layouts = 0, byte NumLayouts = 0);
+	void SetMigrationHandler(MigrationHandler Handler, void* Context = 0);
+	void SetPatchKey(byte Key);
+	LoadResult Load();
+	void Save();
+	void SaveCV(byte cvNum);
+	byte OldValue(byte index);
+
+private:
+	enum : byte { noKey = 255, maxPatchCVs = 4 };
+
+	bool FindLayout(byte version, Layout& layout);
+	void Migrate(const Layout& layout);
+	void LoadPatch();
+	bool AddToPatch(byte index);
+	uint16_t ConfigCRC();
+
+	CVManager& cvs;
+	RecordStore& store;
+	const byte key;
+	const byte version;
+	const Layout* layouts;      // layouts of the earlier versions, in flash
+	const byte numLayouts;
+	MigrationHandler migrationHandler = 0;
+	void* migrationContext = 0;
+
+	byte patchKey = noKey;          // key of the patch record, noKey if single cvs are saved with the config
+	byte patchCount = 0;            // number of cv indexes in the patch
+	uint16_t patchBase = 0;         // crc of the stored config that the patch applies to
+	byte patch[2 * maxPatchCVs];    // the index and value of each cv changed since the config was saved
+
+#if !defined(ADAFRUIT_METRO_M0_EXPRESS)
+	// the config stored without a header at the start of eeprom, by firmware from before the record store
+	enum : int { legacyAddress = 0 };
+
+	bool LoadLegacy();
+	bool legacySource = false;  // the old cvs being migrated are in the legacy config
+#endif
+};
+
+#endif
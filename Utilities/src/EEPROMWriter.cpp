@@ -0,0 +1,163 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "EEPROMWriter.h"
+
+#if !defined(ADAFRUIT_METRO_M0_EXPRESS)
+
+EEPROMWriter EEWriter;
+
+
+// write the next queued byte when the previous write is complete
+ISR(EE_READY_vect)
+{
+	EEWriter.WriteNext();
+}
+
+
+// read a byte, returning the queued value if it has not been written yet
+byte EEPROMWriter::Read(int Address)
+{
+	for (;;)
+	{
+		const byte oldSREG = SREG;   // store the current irq state, then disable
+		cli();
+
+		const int index = FindQueued(Address);
+		if (index >= 0)
+		{
+			const byte value = queue[index].value;
+			SREG = oldSREG;
+			return value;
+		}
+
+		// the eeprom can't be read while a write is in progress, so let the write complete and try again
+		if (!(EECR & (1 << EEPE)))
+		{
+			EEAR = Address;
+			EECR |= (1 << EERE);
+			const byte value = EEDR;
+			SREG = oldSREG;
+			return value;
+		}
+
+		SREG = oldSREG;    // restore previous irq state
+	}
+}
+
+
+// queue a byte to write, if it has changed
+void EEPROMWriter::Write(int Address, byte Value)
+{
+	if (Read(Address) == Value) return;
+
+	// wait for the interrupt to write the oldest byte if the queue is full
+	while (queueSize >= queueLength) {}
+
+	const byte oldSREG = SREG;   // store the current irq state, then disable
+	cli();
+
+	// replace the value of a queued write to the same address, otherwise add it to the queue
+	const int index = FindQueued(Address);
+	if (index >= 0)
+	{
+		queue[index].value = Value;
+	}
+	else
+	{
+		byte writeIndex = readIndex + queueSize;
+		if (writeIndex >= queueLength) writeIndex -= queueLength;
+
+		queue[writeIndex].address = Address;
+		queue[writeIndex].value = Value;
+		queueSize++;
+	}
+
+	EECR |= (1 << EERIE);    // enable the eeprom ready interrupt
+
+	SREG = oldSREG;    // restore previous irq state
+}
+
+
+// write all queued bytes, and wait for the last write to complete
+void EEPROMWriter::Flush()
+{
+	const byte oldSREG = SREG;   // store the current irq state, then disable
+	cli();
+
+	EECR &= ~(1 << EERIE);
+	while (queueSize > 0)
+	{
+		while (EECR & (1 << EEPE)) {}
+		WriteNext();
+	}
+	while (EECR & (1 << EEPE)) {}
+
+	SREG = oldSREG;    // restore previous irq state
+}
+
+
+// get the number of bytes waiting to be written
+byte EEPROMWriter::Pending()
+{
+	return queueSize;
+}
+
+
+// get the number of bytes that can be queued without waiting for room
+byte EEPROMWriter::Room()
+{
+	return queueLength - queueSize;
+}
+
+
+// start the write of the oldest queued byte. interrupts must be disabled, and no write in progress.
+void EEPROMWriter::WriteNext()
+{
+	if (queueSize > 0)
+	{
+		EEAR = queue[readIndex].address;
+		EEDR = queue[readIndex].value;
+		EECR |= (1 << EEMPE);    // EEPE must be set within four cycles of EEMPE
+		EECR |= (1 << EEPE);
+
+		if (++readIndex >= queueLength) readIndex = 0;
+		queueSize--;
+	}
+
+	// disable the interrupt once the queue is empty, since it fires continuously while the eeprom is ready
+	if (queueSize == 0) EECR &= ~(1 << EERIE);
+}
+
+
+// get the queue index of a byte queued for an address, or -1 if there is none
+int EEPROMWriter::FindQueued(int Address)
+{
+	byte index = readIndex;
+	for (byte i = 0; i < queueSize; i++)
+	{
+		if (queue[index].address == Address) return index;
+		if (++index >= queueLength) index = 0;
+	}
+
+	return -1;
+}
+
+#endif    // !defined(ADAFRUIT_METRO_M0_EXPRESS)
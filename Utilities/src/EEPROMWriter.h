@@ -0,0 +1,121 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+EEPROM Writer
+
+A queue of EEPROM writes, which are made in the background from the EEPROM ready interrupt (AVR only).
+
+Summary:
+
+Writing a byte to EEPROM takes about 3.3 ms, and the EEPROM library waits for each write to complete
+before starting the next. Saving a config struct from the main loop can then hold up the processing
+of DCC timestamps for long enough that the timestamp queue overflows. The EEPROM writer instead adds
+the changed bytes to a queue, and returns immediately. The EEPROM ready interrupt then writes the
+queued bytes one at a time, each as the previous write completes.
+
+Example usage:
+
+		EEWriter.Put(0, configVars);          // queue the changed bytes of an object to write at address 0
+		EEWriter.Write(address, value);       // queue a byte to write, if it has changed
+		EEWriter.Get(0, configVars);          // read an object, including any bytes still queued
+		value = EEWriter.Read(address);       // read a byte, the queued value if it is still to be written
+		EEWriter.Flush();                     // write all queued bytes before returning
+
+Details:
+
+EEWriter is the single instance of the class, as for the EEPROM object of the EEPROM library. Bytes
+that are unchanged are not queued, as for EEPROM.update. A byte queued for an address that is already
+in the queue replaces the queued value, and otherwise the bytes are written in the order they were
+queued. Reads return the queued value of a byte still to be written, so that the EEPROM contents
+always appear to be up to date. If the queue is full, Write waits for the interrupt to make room, so
+it must not be called with interrupts disabled. Room gives the number of bytes that can be queued
+without waiting, so that a caller with more to write can spread it over several passes of the loop.
+
+The EEPROM ready interrupt is enabled while there are bytes in the queue, and fires whenever no EEPROM
+write is in progress. Its handler only starts the next write, so it adds just a few microseconds of
+latency to the DCC capture interrupt. All EEPROM access should go through the writer while writes are
+queued, since the EEPROM address register can't be changed during a write.
+
+The Flush method writes any queued bytes with interrupts disabled, and waits for the last write to
+complete. It may be called from a power fail handler, such as an interrupt from a supply voltage
+monitor, so that queued bytes are not lost when power is removed. Flushing a full queue takes up to
+about 50 ms.
+
+*/
+
+#ifndef _EEPROMWRITER_h
+#define _EEPROMWRITER_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#if !defined(ADAFRUIT_METRO_M0_EXPRESS)
+
+class EEPROMWriter
+{
+public:
+	byte Read(int Address);
+	void Write(int Address, byte Value);
+	void Flush();
+	byte Pending();
+	byte Room();
+	void WriteNext();    // called from the EEPROM ready interrupt
+
+	// read an object, as for EEPROM.get
+	template<typename T> T& Get(int Address, T& Object)
+	{
+		byte* data = (byte*)&Object;
+		for (unsigned int i = 0; i < sizeof(T); i++) data[i] = Read(Address + i);
+		return Object;
+	}
+
+	// queue the changed bytes of an object, as for EEPROM.put
+	template<typename T> const T& Put(int Address, const T& Object)
+	{
+		const byte* data = (const byte*)&Object;
+		for (unsigned int i = 0; i < sizeof(T); i++) Write(Address + i, data[i]);
+		return Object;
+	}
+
+private:
+	struct QueuedByte
+	{
+		int address;
+		byte value;
+	};
+
+	enum : byte { queueLength = 16 };
+	QueuedByte queue[queueLength];
+	volatile byte queueSize = 0;
+	volatile byte readIndex = 0;
+
+	int FindQueued(int Address);
+};
+
+extern EEPROMWriter EEWriter;
+
+#endif    // !defined(ADAFRUIT_METRO_M0_EXPRESS)
+
+#endif
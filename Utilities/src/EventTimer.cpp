@@ -36,6 +36,13 @@ void EventTimer::StartTimer(unsigned long Duration)
 }
 
 
+// cancel the timer without raising the event
+void EventTimer::StopTimer()
+{
+	isActive = false;
+}
+
+
 // check if the timer has elapsed, should be called in millis interrupt or similar
 void EventTimer::Update(unsigned long CurrentMillis)
 {
@@ -46,7 +53,7 @@ void EventTimer::Update(unsigned long CurrentMillis)
 		isActive = false;
 
 		// raise event
-		if (timerHandler) timerHandler();
+		if (timerHandler) timerHandler(handlerContext);
 	}
 }
 
@@ -63,4 +70,4 @@ bool EventTimer::IsActive() { return isActive; }
 
 
 // set the handler for the timer event
-void EventTimer::SetTimerHandler(EventTimerHandlerFunc Handler) { timerHandler = Handler; }
+void EventTimer::SetTimerHandler(EventTimerHandlerFunc Handler, void* Context) { timerHandler = Handler; handlerContext = Context; }
@@ -28,7 +28,8 @@ Example usage:
 
 		EventTimer timer;                 // create an instance of an event timer.
 		timer.StartTimer(250);            // start the timer with the spcified duration.
-		timer.SetTimerHandler(handler);   // set the handler to call when the duration has elapsed.
+		timer.SetTimerHandler(handler, this);   // set the handler to call when the duration has elapsed,
+		                                        // and the context (e.g. the owning instance) passed to it.
 
 */
 
@@ -45,20 +46,22 @@ Example usage:
 class EventTimer
 {
 public:
-    typedef void (*EventTimerHandlerFunc)();
+    typedef void (*EventTimerHandlerFunc)(void* Context);
 
     EventTimer();
 	void StartTimer(unsigned long Duration);
+	void StopTimer();
 	void Update(unsigned long CurrentMillis);
 	void Update();
 	bool IsActive();
-	void SetTimerHandler(EventTimerHandlerFunc Handler);
+	void SetTimerHandler(EventTimerHandlerFunc Handler, void* Context = 0);
 
 private:
 	unsigned long startTime = 0;
 	unsigned long duration = 0;
 	bool isActive = false;
 	EventTimerHandlerFunc timerHandler = 0;   // pointer to handler for the timer event
+	void* handlerContext = 0;                 // context passed to the handler
 };
 
 #endif
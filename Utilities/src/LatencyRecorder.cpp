@@ -0,0 +1,117 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "LatencyRecorder.h"
+
+
+// constructor
+LatencyRecorder::LatencyRecorder()
+{
+	Reset();
+}
+
+
+// record the latency from the given start time until now, unless the start time is 0 for not known
+void LatencyRecorder::Record(unsigned long StartMicros)
+{
+	if (StartMicros == 0) return;
+	RecordLatency(micros() - StartMicros);
+}
+
+
+// add a latency to the statistics and histogram
+void LatencyRecorder::RecordLatency(unsigned long Latency)
+{
+	if (Latency < minLatency) minLatency = Latency;
+	if (Latency > maxLatency) maxLatency = Latency;
+
+	// stop accumulating once the count would overflow, so the stats remain consistent
+	if (count == 0xFFFF) return;
+	totalLatency += Latency;
+	count++;
+
+	// find the histogram bin, each bin is double the width of the previous one
+	byte bin = 0;
+	unsigned long limit = Latency >> firstBinShift;
+	while (limit && bin < numBins - 1)
+	{
+		limit >>= 1;
+		bin++;
+	}
+	bins[bin]++;
+}
+
+
+// clear all the statistics
+void LatencyRecorder::Reset()
+{
+	minLatency = 0xFFFFFFFF;
+	maxLatency = 0;
+	totalLatency = 0;
+	count = 0;
+	for (byte i = 0; i < numBins; i++)
+		bins[i] = 0;
+}
+
+
+unsigned long LatencyRecorder::Min() { return (count > 0) ? minLatency : 0; }
+unsigned long LatencyRecorder::Max() { return maxLatency; }
+unsigned long LatencyRecorder::Average() { return (count > 0) ? totalLatency / count : 0; }
+unsigned int LatencyRecorder::Count() { return count; }
+unsigned int LatencyRecorder::BinCount(byte Bin) { return (Bin < numBins) ? bins[Bin] : 0; }
+
+
+// upper limit (us) of a histogram bin, the last bin has no upper limit
+unsigned long LatencyRecorder::BinLimit(byte Bin)
+{
+	if (Bin >= numBins - 1) return 0xFFFFFFFF;
+	return 1UL << (firstBinShift + Bin);
+}
+
+
+// print the statistics and the non-empty histogram bins
+void LatencyRecorder::Report(Print& Output)
+{
+	Output.print("Latency (us) count: ");
+	Output.print(count, DEC);
+	Output.print("  min: ");
+	Output.print(Min(), DEC);
+	Output.print("  avg: ");
+	Output.print(Average(), DEC);
+	Output.print("  max: ");
+	Output.println(maxLatency, DEC);
+
+	for (byte i = 0; i < numBins; i++)
+	{
+		if (bins[i] == 0) continue;
+		if (i < numBins - 1)
+		{
+			Output.print("  < ");
+			Output.print(BinLimit(i), DEC);
+		}
+		else
+		{
+			Output.print("  >= ");
+			Output.print(BinLimit(i - 1), DEC);
+		}
+		Output.print(": ");
+		Output.println(bins[i], DEC);
+	}
+}
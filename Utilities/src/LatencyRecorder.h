@@ -0,0 +1,82 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Latency Recorder
+
+A class for collecting statistics on the latency between an event and the response to it.
+
+Summary:
+
+Each call to Record provides the start time (micros) of an event, and the latency is taken as the time
+elapsed since then. A start time of 0 means that the time of the event isn't known, such as for a DCC
+packet received before the bitstream has a time base, and nothing is recorded. The minimum, maximum, and average latency are maintained, along with a histogram
+of the latencies. The histogram bins are powers of two, with the first bin covering latencies below
+256 us, the next below 512 us, and so on, with the last bin collecting everything above that.
+
+Example usage:
+
+		LatencyRecorder latency;                 // create an instance of the latency recorder.
+		latency.Record(startMicros);             // record the latency from startMicros until now.
+		latency.Report(Serial);                  // print the statistics and histogram.
+
+*/
+
+
+#ifndef _LATENCYRECORDER_h
+#define _LATENCYRECORDER_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+class LatencyRecorder
+{
+public:
+	enum : byte
+	{
+		numBins = 12,          // number of histogram bins
+		firstBinShift = 8,     // first bin is below 2^8 = 256 us
+	};
+
+	LatencyRecorder();
+	void Record(unsigned long StartMicros);
+	void RecordLatency(unsigned long Latency);
+	void Reset();
+	unsigned long Min();
+	unsigned long Max();
+	unsigned long Average();
+	unsigned int Count();
+	unsigned int BinCount(byte Bin);
+	unsigned long BinLimit(byte Bin);
+	void Report(Print& Output);
+
+private:
+	unsigned long minLatency = 0xFFFFFFFF;     // smallest latency recorded (us)
+	unsigned long maxLatency = 0;              // largest latency recorded (us)
+	unsigned long totalLatency = 0;            // sum of latencies, for the average
+	unsigned int count = 0;                    // number of latencies recorded
+	unsigned int bins[numBins];                // histogram counts
+};
+
+#endif
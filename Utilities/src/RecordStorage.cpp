@@ -0,0 +1,141 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "RecordStorage.h"
+
+#if defined(RECORD_STORAGE_RAM)
+
+// ========================================================================================================
+// RAM stand-in, which behaves as flash
+
+RecordStorage::RecordStorage(uint32_t Address, uint16_t Size) : size(Size)
+{
+	memory = new byte[size];
+	memset(memory, 0, size);    // as for a flash area that has never been erased
+}
+
+void RecordStorage::Read(uint16_t offset, void* data, uint16_t length)
+{
+	memcpy(data, memory + offset, length);
+}
+
+void RecordStorage::Write(uint16_t offset, const void* data, uint16_t length)
+{
+	// a write can only clear bits, as for flash
+	const byte* source = (const byte*)data;
+	for (uint16_t i = 0; i < length; i++) memory[offset + i] &= source[i];
+}
+
+void RecordStorage::Erase(uint16_t offset, uint16_t length)
+{
+	memset(memory + offset, 255, length);
+}
+
+uint16_t RecordStorage::Room()
+{
+	return 0xFFFF;
+}
+
+#elif defined(ADAFRUIT_METRO_M0_EXPRESS)
+
+// ========================================================================================================
+// NVM flash on the Metro M0
+
+static FlashClass flash;    // nvm controller access, with the addresses given for each operation
+
+RecordStorage::RecordStorage(uint32_t Address, uint16_t Size) : address(Address), size(Size)
+{
+}
+
+void RecordStorage::Read(uint16_t offset, void* data, uint16_t length)
+{
+	memcpy(data, (const void*)(address + offset), length);
+}
+
+void RecordStorage::Write(uint16_t offset, const void* data, uint16_t length)
+{
+	const byte* source = (const byte*)data;
+	uint32_t target = address + offset;
+
+	while (length > 0)
+	{
+		// the bytes are written in whole words, a page at a time, so the words of the page that are
+		// written are read first and the new bytes put into them
+		const uint32_t pageEnd = (target & ~(uint32_t)(flashPageSize - 1)) + flashPageSize;
+		const uint16_t count = (target + length < pageEnd) ? length : pageEnd - target;
+		const uint32_t wordStart = target & ~(uint32_t)3;
+		const uint32_t wordEnd = (target + count + 3) & ~(uint32_t)3;
+
+		uint32_t words[flashPageSize / 4];
+		memcpy(words, (const void*)wordStart, wordEnd - wordStart);
+		memcpy((byte*)words + (target - wordStart), source, count);
+		flash.write((const volatile void*)wordStart, words, wordEnd - wordStart);
+
+		source += count;
+		target += count;
+		length -= count;
+	}
+}
+
+void RecordStorage::Erase(uint16_t offset, uint16_t length)
+{
+	flash.erase((const volatile void*)(address + offset), length);
+}
+
+uint16_t RecordStorage::Room()
+{
+	// the flash is written before Write returns
+	return 0xFFFF;
+}
+
+#else
+
+// ========================================================================================================
+// EEPROM on AVR, written through the EEPROM writer
+
+RecordStorage::RecordStorage(uint32_t Address, uint16_t Size) : address(Address), size(Size)
+{
+}
+
+void RecordStorage::Read(uint16_t offset, void* data, uint16_t length)
+{
+	byte* target = (byte*)data;
+	for (uint16_t i = 0; i < length; i++) target[i] = EEWriter.Read(address + offset + i);
+}
+
+void RecordStorage::Write(uint16_t offset, const void* data, uint16_t length)
+{
+	// the writes are queued in order, so the last byte given is the last written
+	const byte* source = (const byte*)data;
+	for (uint16_t i = 0; i < length; i++) EEWriter.Write(address + offset + i, source[i]);
+}
+
+void RecordStorage::Erase(uint16_t offset, uint16_t length)
+{
+	// eeprom doesn't need to be erased before it is written
+}
+
+uint16_t RecordStorage::Room()
+{
+	// the bytes that fit in the queue of the eeprom writer
+	return EEWriter.Room();
+}
+
+#endif
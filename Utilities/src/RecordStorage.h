@@ -0,0 +1,108 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Record Storage
+
+The non-volatile memory that holds a record store, EEPROM on AVR or NVM flash on the Metro M0.
+
+Summary:
+
+The record storage gives the record store byte access to an area of the board's non-volatile memory,
+by offset from the start of the area. On AVR the area is in EEPROM, written in the background by the
+EEPROM writer. On the Metro M0 it is in flash, in rows that are erased as a whole, with the bytes
+then written through the NVM page buffer. If RECORD_STORAGE_RAM is defined, the area is instead held
+in RAM, so that the record store, and the managers using it, can be tested on a host.
+
+Example usage:
+
+		RecordStorage storage(0, 1024);           // an area at address 0 of 1024 bytes, the address is
+		                                          // the EEPROM address on AVR, or of the flash on M0
+		storage.Read(offset, &data, length);      // read bytes from the area
+		storage.Write(offset, &data, length);     // write bytes, to erased memory unless canOverwrite
+		storage.Erase(offset, length);            // erase whole rows, offset and length are multiples of eraseSize
+		room = storage.Room();                    // number of bytes that can be written without waiting
+
+Details:
+
+EEPROM cells can be written again without being erased, so canOverwrite is true on AVR, and Erase
+does nothing. Flash bits can only be cleared by a write, so bytes must be erased before they are
+written, and Erase sets whole 256 byte rows to 255. The flash area must be aligned to a row. The
+writes are made a page at a time, with the bytes of each page around the written bytes read back
+into the page buffer, so that bytes may be written at any offset. The RAM stand-in behaves as flash,
+clearing bits on a write and erasing rows, so a host test finds any write to memory that was not
+erased.
+
+Room gives the number of bytes that can be written without holding up the caller. On AVR it is the
+room in the queue of the EEPROM writer, so that the record store can write a record over several
+passes of the loop. Flash and RAM are written as the write is made, so there is no limit.
+
+*/
+
+#ifndef _RECORDSTORAGE_h
+#define _RECORDSTORAGE_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#if defined(RECORD_STORAGE_RAM)
+#elif defined(ADAFRUIT_METRO_M0_EXPRESS)
+#include "FlashStorage.h"
+#else
+#include "EEPROMWriter.h"
+#endif
+
+
+class RecordStorage
+{
+public:
+	RecordStorage(uint32_t Address, uint16_t Size);
+
+	uint16_t Size() { return size; }
+	void Read(uint16_t offset, void* data, uint16_t length);
+	void Write(uint16_t offset, const void* data, uint16_t length);
+	void Erase(uint16_t offset, uint16_t length);
+	uint16_t Room();
+
+#if defined(RECORD_STORAGE_RAM) || defined(ADAFRUIT_METRO_M0_EXPRESS)
+	static constexpr bool canOverwrite = false;     // bytes must be erased before they are written
+	enum : uint16_t { eraseSize = 256 };            // flash row
+#else
+	static constexpr bool canOverwrite = true;      // eeprom cells are written without an erase
+	enum : uint16_t { eraseSize = 1 };
+#endif
+
+private:
+#if defined(RECORD_STORAGE_RAM)
+	byte* memory;
+#elif defined(ADAFRUIT_METRO_M0_EXPRESS)
+	enum : uint16_t { flashPageSize = 64 };
+	uint32_t address;
+#else
+	int address;
+#endif
+	uint16_t size;
+};
+
+#endif
@@ -0,0 +1,495 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "RecordStore.h"
+
+RecordStore::RecordStore(RecordStorage& Storage)
+	: storage(Storage), sectorSize(Storage.Size() / 2)
+{
+}
+
+
+// check if the store has a valid sector, which it won't until it is first written
+bool RecordStore::IsFormatted()
+{
+	if (!scanned) Scan();
+	return formatted;
+}
+
+
+// get the length of the newest record with a key, 0 if there is none
+byte RecordStore::Length(byte key)
+{
+	if (!scanned) Scan();
+	if (key >= maxKeys || recordOffset[key] == noRecord) return 0;
+
+	RecordHeader header;
+	storage.Read(SectorBase(activeSector) + recordOffset[key], &header, sizeof(header));
+	return header.length;
+}
+
+
+// read part of the newest record with a key, returns false if there is no record or it is too short
+bool RecordStore::Read(byte key, void* data, byte length, byte offset)
+{
+	if (offset + length > Length(key) || length == 0) return false;
+
+	storage.Read(SectorBase(activeSector) + recordOffset[key] + sizeof(RecordHeader) + offset, data, length);
+	return true;
+}
+
+
+// save a record, returns false if it won't fit in the store
+bool RecordStore::Write(byte key, const void* data, byte length)
+{
+	return Write(key, 0, 0, data, length);
+}
+
+
+// save a record made up of a header and data, returns false if it won't fit in the store. any queued
+// records are written first, and the record is written before returning.
+bool RecordStore::Write(byte key, const void* header, byte headerLength, const void* data, byte dataLength)
+{
+	Flush();
+
+	dropped = false;
+	if (!Save(key, header, headerLength, data, dataLength)) return false;
+	Flush();
+
+	return !dropped;
+}
+
+
+// queue a record to be saved by Update, returns false if it can't be a record
+bool RecordStore::Save(byte key, const void* data, byte length)
+{
+	return Save(key, 0, 0, data, length);
+}
+
+
+// queue a record made up of a header and data to be saved by Update, returns false if it can't be a
+// record. both parts must stay in memory until the record has been written.
+bool RecordStore::Save(byte key, const void* header, byte headerLength, const void* data, byte dataLength)
+{
+	if (key >= maxKeys || headerLength + dataLength > 255) return false;
+
+	const Source source = { header, data, key, headerLength, dataLength };
+
+	// a record that is already queued is saved once, with the data it holds when it is written
+	for (byte i = 0; i < numSaves; i++)
+	{
+		if (saves[i].key == key)
+		{
+			saves[i] = source;
+			return true;
+		}
+	}
+
+	// if the queue is full, wait for the oldest record to be started
+	while (numSaves >= maxSaves) Update();
+
+	saves[numSaves++] = source;
+	return true;
+}
+
+
+// write the queued records, as many bytes as the storage has room for without waiting
+void RecordStore::Update()
+{
+	bool progress = true;
+	while (progress && storage.Room() > 0)
+	{
+		switch (writeState)
+		{
+		case IDLE:
+			progress = StartSave();
+			break;
+		case APPENDING:
+			progress = AppendNext(storage.Room());
+			break;
+		case COMPACTING:
+			progress = CompactNext(storage.Room());
+			break;
+		}
+	}
+}
+
+
+// write the queued records before returning
+void RecordStore::Flush()
+{
+	while (IsSaving()) Update();
+}
+
+
+// check if a record with a key is queued, or being written
+bool RecordStore::IsSaving(byte key)
+{
+	if (writeState != IDLE && current.key == key) return true;
+
+	for (byte i = 0; i < numSaves; i++)
+		if (saves[i].key == key) return true;
+
+	return false;
+}
+
+
+// erase all the records, and start the log in the first sector
+void RecordStore::Format()
+{
+	activeSector = 0;
+	generation = (formatted) ? generation + 1 : 0;
+	endOffset = sizeof(SectorHeader);
+	full = false;
+	for (byte i = 0; i < maxKeys; i++) recordOffset[i] = noRecord;
+
+	storage.Erase(0, storage.Size());
+
+	// the log is empty
+	const byte endKey = emptyKey;
+	if (RecordStorage::canOverwrite) storage.Write(endOffset + offsetof(RecordHeader, key), &endKey, 1);
+
+	// then write the header, and invalidate the other sector where it can't be erased
+	SectorHeader sectorHeader = { generation, storeMagic };
+	storage.Write(SectorBase(0), &sectorHeader, sizeof(sectorHeader));
+	if (RecordStorage::canOverwrite)
+	{
+		const uint16_t noMagic = 0xFFFF;
+		storage.Write(SectorBase(1) + offsetof(SectorHeader, magic), &noMagic, sizeof(noMagic));
+	}
+
+	formatted = true;
+	scanned = true;
+}
+
+
+// add a byte to a CRC-16/CCITT
+uint16_t RecordStore::UpdateCRC(uint16_t crc, byte data)
+{
+	crc ^= (uint16_t)data << 8;
+	for (byte i = 0; i < 8; i++)
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+
+	return crc;
+}
+
+
+// find the active sector, the newest record with each key, and the end of the log
+void RecordStore::Scan()
+{
+	scanned = true;
+	formatted = false;
+	for (byte i = 0; i < maxKeys; i++) recordOffset[i] = noRecord;
+
+	// the active sector is the valid one with the newest generation
+	SectorHeader header[2];
+	for (byte sector = 0; sector < 2; sector++)
+	{
+		storage.Read(SectorBase(sector), &header[sector], sizeof(SectorHeader));
+		if (header[sector].magic != storeMagic) continue;
+
+		if (!formatted || (int16_t)(header[sector].generation - generation) > 0)
+		{
+			activeSector = sector;
+			generation = header[sector].generation;
+			formatted = true;
+		}
+	}
+
+	if (!formatted) return;
+
+	// scan the records, to the first that isn't valid
+	const uint16_t base = SectorBase(activeSector);
+	uint16_t offset = sizeof(SectorHeader);
+	while (offset + sizeof(RecordHeader) <= sectorSize)
+	{
+		RecordHeader recordHeader;
+		storage.Read(base + offset, &recordHeader, sizeof(recordHeader));
+		if (recordHeader.key == emptyKey || !CheckRecord(offset, recordHeader)) break;
+
+		if (recordHeader.key < maxKeys) recordOffset[recordHeader.key] = offset;
+		offset += RecordSize(recordHeader.length);
+	}
+	endOffset = offset;
+
+	// flash past the end of the log must be erased before another record can be written there
+	full = false;
+	if (!RecordStorage::canOverwrite)
+	{
+		byte data;
+		for (uint16_t i = endOffset; i < sectorSize && !full; i++)
+		{
+			storage.Read(base + i, &data, 1);
+			full = (data != 255);
+		}
+	}
+}
+
+
+// check the crc of a record in the active sector
+bool RecordStore::CheckRecord(uint16_t offset, const RecordHeader& header)
+{
+	if (offset + RecordSize(header.length) > sectorSize) return false;
+
+	uint16_t crc = generation;
+	crc = UpdateCRC(crc, header.key);
+	crc = UpdateCRC(crc, header.length);
+
+	byte chunk[chunkSize];
+	uint16_t address = SectorBase(activeSector) + offset + sizeof(RecordHeader);
+	for (byte remaining = header.length; remaining > 0; )
+	{
+		const byte count = (remaining < chunkSize) ? remaining : chunkSize;
+		storage.Read(address, chunk, count);
+		for (byte i = 0; i < count; i++) crc = UpdateCRC(crc, chunk[i]);
+
+		address += count;
+		remaining -= count;
+	}
+
+	return crc == header.crc;
+}
+
+
+// start saving the oldest queued record, returns false if there is none
+bool RecordStore::StartSave()
+{
+	if (numSaves == 0) return false;
+
+	current = saves[0];
+	numSaves--;
+	for (byte i = 0; i < numSaves; i++) saves[i] = saves[i + 1];
+
+	if (!scanned) Scan();
+	if (!formatted) Format();
+
+	// don't write a record that is unchanged
+	if (Matches(current.key, current.header, current.headerLength, current.data, current.dataLength)) return true;
+
+	compacted = false;
+	BeginAppend();
+	return true;
+}
+
+
+// start appending the current record, compacting the log first if it won't fit
+void RecordStore::BeginAppend()
+{
+	const uint16_t size = RecordSize(current.headerLength + current.dataLength);
+	if (full || endOffset + size > sectorSize)
+	{
+		if (!compacted)
+		{
+			BeginCompact();
+			return;
+		}
+
+#ifdef _DEBUG
+		Serial.println("Record store full, record not saved.");
+#endif
+		dropped = true;
+		writeState = IDLE;
+		return;
+	}
+
+	writeCRC = generation;
+	writeCRC = UpdateCRC(writeCRC, current.key);
+	writeCRC = UpdateCRC(writeCRC, current.headerLength + current.dataLength);
+	written = 0;
+	endMarked = false;
+	writeState = APPENDING;
+}
+
+
+// write the next part of the current record, returns false if there isn't room for it
+bool RecordStore::AppendNext(uint16_t room)
+{
+	const byte length = current.headerLength + current.dataLength;
+	const uint16_t size = RecordSize(length);
+	const uint16_t base = SectorBase(activeSector);
+
+	// mark the end of the log after this record, where eeprom may hold old data
+	if (!endMarked)
+	{
+		if (RecordStorage::canOverwrite && endOffset + size + sizeof(RecordHeader) <= sectorSize)
+		{
+			const byte endKey = emptyKey;
+			storage.Write(base + endOffset + size + offsetof(RecordHeader, key), &endKey, 1);
+		}
+		endMarked = true;
+		return true;
+	}
+
+	// write the data, the header part and then the data part, as far as there is room
+	if (written < length)
+	{
+		const bool headerPart = written < current.headerLength;
+		const byte* source = headerPart ? (const byte*)current.header + written : (const byte*)current.data + (written - current.headerLength);
+		uint16_t count = (headerPart ? current.headerLength : length) - written;
+		if (count > room) count = room;
+
+		for (byte i = 0; i < count; i++) writeCRC = UpdateCRC(writeCRC, source[i]);
+		storage.Write(base + endOffset + sizeof(RecordHeader) + written, source, count);
+		written += count;
+		return true;
+	}
+
+	// then the header, with the key written last, which adds the record to the log
+	if (room < sizeof(RecordHeader)) return false;
+
+	RecordHeader recordHeader;
+	recordHeader.length = length;
+	recordHeader.crc = writeCRC;
+	recordHeader.key = current.key;
+	storage.Write(base + endOffset, &recordHeader, sizeof(recordHeader));
+
+	recordOffset[current.key] = endOffset;
+	endOffset += size;
+	writeState = IDLE;
+	return true;
+}
+
+
+// start copying the newest record with each key to the other sector
+void RecordStore::BeginCompact()
+{
+#ifdef _DEBUG
+	Serial.println("Compacting record store.");
+#endif
+
+	storage.Erase(SectorBase(1 - activeSector), sectorSize);
+
+	copyKey = 0;
+	copyOffset = sizeof(SectorHeader);
+	written = 0;
+	compacted = true;
+	writeState = COMPACTING;
+}
+
+
+// copy the next part of a record to the other sector, and make it the active sector once all the
+// records have been copied. returns false if there isn't room for the next part.
+bool RecordStore::CompactNext(uint16_t room)
+{
+	const byte newSector = 1 - activeSector;
+	const uint16_t oldBase = SectorBase(activeSector);
+	const uint16_t newBase = SectorBase(newSector);
+	const uint16_t newGeneration = generation + 1;
+
+	while (copyKey < maxKeys && recordOffset[copyKey] == noRecord) copyKey++;
+
+	if (copyKey < maxKeys)
+	{
+		RecordHeader recordHeader;
+		storage.Read(oldBase + recordOffset[copyKey], &recordHeader, sizeof(recordHeader));
+
+		// copy the data, and calculate the crc for the new generation
+		if (written == 0)
+		{
+			writeCRC = newGeneration;
+			writeCRC = UpdateCRC(writeCRC, copyKey);
+			writeCRC = UpdateCRC(writeCRC, recordHeader.length);
+		}
+
+		if (written < recordHeader.length)
+		{
+			byte chunk[chunkSize];
+			uint16_t count = recordHeader.length - written;
+			if (count > chunkSize) count = chunkSize;
+			if (count > room) count = room;
+
+			storage.Read(oldBase + recordOffset[copyKey] + sizeof(RecordHeader) + written, chunk, count);
+			storage.Write(newBase + copyOffset + sizeof(RecordHeader) + written, chunk, count);
+			for (byte i = 0; i < count; i++) writeCRC = UpdateCRC(writeCRC, chunk[i]);
+
+			written += count;
+			return true;
+		}
+
+		if (room < sizeof(RecordHeader)) return false;
+
+		recordHeader.crc = writeCRC;
+		storage.Write(newBase + copyOffset, &recordHeader, sizeof(recordHeader));
+
+		copyOffset += RecordSize(recordHeader.length);
+		copyKey++;
+		written = 0;
+		return true;
+	}
+
+	// mark the end of the log, then write the header, which makes this the active sector
+	if (room < sizeof(SectorHeader) + 1) return false;
+
+	if (RecordStorage::canOverwrite && copyOffset + sizeof(RecordHeader) <= sectorSize)
+	{
+		const byte endKey = emptyKey;
+		storage.Write(newBase + copyOffset + offsetof(RecordHeader, key), &endKey, 1);
+	}
+
+	SectorHeader sectorHeader = { newGeneration, storeMagic };
+	storage.Write(newBase, &sectorHeader, sizeof(sectorHeader));
+
+	// the records were copied in key order
+	uint16_t newOffset = sizeof(SectorHeader);
+	for (byte key = 0; key < maxKeys; key++)
+	{
+		if (recordOffset[key] == noRecord) continue;
+
+		RecordHeader recordHeader;
+		storage.Read(oldBase + recordOffset[key], &recordHeader, sizeof(recordHeader));
+		recordOffset[key] = newOffset;
+		newOffset += RecordSize(recordHeader.length);
+	}
+
+	activeSector = newSector;
+	generation = newGeneration;
+	endOffset = copyOffset;
+	full = false;
+
+	// then append the record that needed the room
+	BeginAppend();
+	return true;
+}
+
+
+// check if the newest record with a key holds the given data
+bool RecordStore::Matches(byte key, const void* header, byte headerLength, const void* data, byte dataLength)
+{
+	if (Length(key) != headerLength + dataLength) return false;
+
+	byte chunk[chunkSize];
+	uint16_t address = SectorBase(activeSector) + recordOffset[key] + sizeof(RecordHeader);
+	for (byte part = 0; part < 2; part++)
+	{
+		const byte* expected = (const byte*)((part == 0) ? header : data);
+		for (byte remaining = (part == 0) ? headerLength : dataLength; remaining > 0; )
+		{
+			const byte count = (remaining < chunkSize) ? remaining : chunkSize;
+			storage.Read(address, chunk, count);
+			if (memcmp(chunk, expected, count) != 0) return false;
+
+			address += count;
+			expected += count;
+			remaining -= count;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,207 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Record Store
+
+A wear leveled store of keyed records, written as an append-only log in EEPROM or flash.
+
+Summary:
+
+Each manager saves its state and config as records, identified by a key. A record that is saved is
+appended to a log, rather than written over its last value, so the writes are spread across the whole
+storage area, and on flash no row needs to be erased for each save. The newest record with a key is
+the one that is read. When the log is full, the newest records are copied to a second sector, and
+the log continues from there, which frees the space of the records that were replaced.
+
+Example usage:
+
+		RecordStorage storage(0, 1024);            // create the storage, here the whole EEPROM of an AVR
+		RecordStore store(storage);                // create a store in the storage
+		store.Put(stateKey, stateVars);            // save an object as the record with a key
+		if (store.Get(stateKey, stateVars)) ...    // read the record into an object, returns false if there
+		                                           // is no record of that size.
+		store.Write(key, &header, 1, data, 20);    // save a record made up of two parts
+		store.Save(configKey, configVars);         // queue an object to be saved in the background
+		store.Update();                            // write the queued records, as far as there is room
+		store.Flush();                             // write the queued records before returning
+		store.IsSaving(key);                       // check if a record with a key is still to be written
+		store.Read(key, data, 20, 1);              // read part of a record, here from an offset of 1
+		store.IsFormatted();                       // check if the store has been written, so that data
+		                                           // saved by earlier firmware can be imported if not
+
+Details:
+
+The storage area is split into two sectors, each a multiple of the storage erase size. The active
+sector starts with a header holding a magic number and a generation count, followed by the records.
+Each record has a header with its key, length and a CRC, then its data, padded to a multiple of four
+bytes so that the records are word aligned in flash. The CRC starts from the generation of the
+sector, so a record left over from an earlier generation is not mistaken for a current one.
+
+On the first access, the store finds the active sector, the valid sector with the newest generation,
+and scans its records to find the newest record with each key, and the end of the log. The offsets
+of the newest records are kept in RAM, so that a read goes straight to its record. A record with a
+bad CRC, such as one torn by a loss of power, ends the log.
+
+A record is written data first, and then its header, with the key written last. Until the key is
+written the record is not part of the log, so a loss of power part way through a save leaves the last
+record with that key as the newest. A record that is the same as the newest with its key is not
+written again. In EEPROM, which is written without an erase, the key of the next record is set to 255
+to mark the end of the log. In flash, the rest of the sector is checked to be erased when it is
+scanned, and a sector with bytes written past the end of the log is treated as full.
+
+When a record doesn't fit in the active sector, the store compacts the log. The other sector is
+erased, the newest record with each key is copied to it, and then the header is written with the
+next generation, which makes it the active sector. If power is lost before the header is written,
+the old sector is still the newest. Each compaction alternates the sectors, so the writes and erases
+are spread across the whole area.
+
+Put and Write save a record before they return. In EEPROM the bytes go through the queue of the EEPROM
+writer, which holds 16 bytes, so a record or a compaction that doesn't fit in the queue waits about
+3.3 ms for each byte beyond that. They are meant for setup and for flash. A manager that saves while
+DCC packets are arriving queues the record with Save instead, and calls Update from its loop. Update
+writes only as many bytes as the storage has room for without waiting, so a record, and a compaction
+that it needs, is written over as many passes of the loop as it takes. The data is read from the
+object as it is written, so the object must stay in memory, and a record that is queued again before
+it is written is saved once, with its latest value. A record changed while it is being written is
+still consistent, since its CRC covers the bytes as written, and it is queued again to save the rest
+of the change. Reads return the newest record that has been written, so a manager that reads its
+records back calls Flush first.
+
+*/
+
+#ifndef _RECORDSTORE_h
+#define _RECORDSTORE_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "RecordStorage.h"
+
+
+class RecordStore
+{
+public:
+	enum : byte { maxKeys = 8 };    // keys are 0 to maxKeys - 1
+
+	RecordStore(RecordStorage& Storage);
+
+	bool IsFormatted();
+	byte Length(byte key);
+	bool Read(byte key, void* data, byte length, byte offset = 0);
+	bool Write(byte key, const void* data, byte length);
+	bool Write(byte key, const void* header, byte headerLength, const void* data, byte dataLength);
+	bool Save(byte key, const void* data, byte length);
+	bool Save(byte key, const void* header, byte headerLength, const void* data, byte dataLength);
+	void Update();
+	void Flush();
+	bool IsSaving() { return writeState != IDLE || numSaves > 0; }
+	bool IsSaving(byte key);
+	void Format();
+
+	// read a record into an object, if the record is the size of the object
+	template<typename T> bool Get(byte key, T& Object)
+	{
+		return Length(key) == sizeof(T) && Read(key, &Object, sizeof(T));
+	}
+
+	// save an object as a record
+	template<typename T> bool Put(byte key, const T& Object)
+	{
+		return Write(key, &Object, sizeof(T));
+	}
+
+	// queue an object to be saved as a record by Update, the object must stay in memory until it is written
+	template<typename T> bool Save(byte key, const T& Object)
+	{
+		return Save(key, &Object, sizeof(T));
+	}
+
+	static uint16_t UpdateCRC(uint16_t crc, byte data);
+
+private:
+	struct SectorHeader
+	{
+		uint16_t generation;
+		uint16_t magic;         // written last, so the header is valid only once it is complete
+	};
+
+	struct RecordHeader
+	{
+		byte length;
+		uint16_t crc;
+		byte key;               // written last, to add the record to the log
+	} __attribute__((packed));
+
+	// a record queued to be saved, from data in memory that is read as it is written
+	struct Source
+	{
+		const void* header;
+		const void* data;
+		byte key;
+		byte headerLength;
+		byte dataLength;
+	};
+
+	enum WriteState : byte { IDLE, APPENDING, COMPACTING };
+	enum : uint16_t { storeMagic = 0x5352, noRecord = 0 };
+	enum : byte { emptyKey = 255, chunkSize = 16, maxSaves = 4 };
+
+	void Scan();
+	bool CheckRecord(uint16_t offset, const RecordHeader& header);
+	bool StartSave();
+	void BeginAppend();
+	bool AppendNext(uint16_t room);
+	void BeginCompact();
+	bool CompactNext(uint16_t room);
+	bool Matches(byte key, const void* header, byte headerLength, const void* data, byte dataLength);
+
+	uint16_t SectorBase(byte sector) { return sector * sectorSize; }
+	static uint16_t RecordSize(byte length) { return sizeof(RecordHeader) + ((length + 3) & ~3); }
+
+	RecordStorage& storage;
+	const uint16_t sectorSize;
+
+	bool scanned = false;           // the active sector has been found and scanned
+	bool formatted = false;         // there is a valid sector
+	bool full = false;              // no more records can be appended to the active sector
+	byte activeSector = 0;
+	uint16_t generation = 0;
+	uint16_t endOffset = 0;         // offset of the end of the log in the active sector
+	uint16_t recordOffset[maxKeys]; // offset of the newest record with each key in the active sector
+
+	Source saves[maxSaves];         // records queued to be saved, oldest first
+	byte numSaves = 0;
+	Source current;                 // the record being appended
+	WriteState writeState = IDLE;
+	bool endMarked = false;         // the end of the log has been marked after the record being appended
+	bool compacted = false;         // the log has been compacted to make room for the record being appended
+	bool dropped = false;           // a record didn't fit in the store
+	byte written = 0;               // bytes written of the record being appended or copied
+	uint16_t writeCRC = 0;          // crc of the bytes written
+	byte copyKey = 0;               // key of the record being copied by a compaction
+	uint16_t copyOffset = 0;        // offset of the record being copied in the new sector
+};
+
+#endif
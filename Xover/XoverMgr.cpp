@@ -28,30 +28,30 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 // TurnoutMgr constructor
 XoverMgr::XoverMgr()
 {
-	// set pointer to this instance of the turnout manager, so that we can reference it in callbacks
-	currentInstance = this;
-
 	// configure sensor/servo event handlers
-	button.SetButtonPressHandler(WrapperButtonPress);
-	osAB.SetButtonPressHandler(WrapperOSAB);
-	osCD.SetButtonPressHandler(WrapperOSCD);
-
-	// configure dcc event handlers
-	dcc.SetBasicAccessoryDecoderPacketHandler(WrapperDCCAccPacket);
-	dcc.SetExtendedAccessoryDecoderPacketHandler(WrapperDCCExtPacket);
-	dcc.SetBasicAccessoryPomPacketHandler(WrapperDCCAccPomPacket);
-	dcc.SetBitstreamMaxErrorHandler(WrapperMaxBitErrors);
-	dcc.SetPacketMaxErrorHandler(WrapperMaxPacketErrors);
-	dcc.SetDecodingErrorHandler(WrapperDCCDecodingError);
+	button.SetButtonPressHandler(WrapperButtonPress, this);
+	osAB.SetButtonPressHandler(WrapperOSAB, this);
+	osCD.SetButtonPressHandler(WrapperOSCD, this);
+
+	// enable the dcc events handled here, in addition to those handled in TurnoutBase
+	dcc.EnableEvents(DCCEvent::Bit(DCCEvent::BASIC_ACC) | DCCEvent::Bit(DCCEvent::BASIC_ACC_POM) |
+		DCCEvent::Bit(DCCEvent::SERVICE_MODE));
+
+	// dcc resets and emergency stops are handled immediately, rather than through the event queue
+	dcc.SetEmergencyStopHandler(WrapperEmergencyStop, this);
 
 	// configure timer event handlers
-	errorTimer.SetTimerHandler(WrapperErrorTimer);
-	resetTimer.SetTimerHandler(WrapperResetTimer);
-	servoTimer.SetTimerHandler(WrapperServoTimer);
+	errorTimer.SetTimerHandler(WrapperErrorTimer, this);
+	resetTimer.SetTimerHandler(WrapperResetTimer, this);
+	servoTimer.SetTimerHandler(WrapperServoTimer, this);
 
 	// configure servo event handlers
 	for (byte i = 0; i < numServos; i++)
-		servo[i].SetServoMoveDoneHandler(WrapperServoMoveDone);
+		servo[i].SetServoMoveDoneHandler(WrapperServoMoveDone, this);
+
+	// update the servos when their cvs change
+	cv.subscribe(CV_servo1MinTravel, CV_servoHighSpeed, WrapperServoCVChange, this);
+	cv.subscribe(CV_servo2MinTravel, CV_servo4MaxTravel, WrapperServoCVChange, this);
 }
 
 
@@ -81,6 +81,9 @@ void XoverMgr::Update()
 	// do all the updates that TurnoutBase handles
 	TurnoutBase::Update();
 
+	// handle the decoded dcc events, leaving them queued while the servos are in motion
+	if (!servosActive) dcc.DispatchEvents(*this, maxDispatchEvents);
+
 	// then update our sensors and servo
 	const unsigned long currentMillis = millis();
 	osAB.Update(currentMillis);
@@ -116,17 +119,15 @@ void XoverMgr::InitMain()
 
 
 // set the turnout to a new position
-void XoverMgr::BeginServoMove()
+void XoverMgr::BeginServoMove(unsigned long packetTime)
 {
-	// store new position to cv
-	cv.setCV(CV_turnoutPosition, position);
-	SaveConfig();
-
 	// set the led to indicate servo is in motion
 	led.SetLED((position == STRAIGHT) ? RgbLed::GREEN : RgbLed::RED, RgbLed::FLASH);
 
-	// stop the bitstream capture
+	// stop the bitstream capture, if it shares timer1 with the servos
+#if defined(BITSTREAM_USES_TIMER1)
 	dcc.SuspendBitstream();
+#endif
 
 	// turn off the relays
 	for (byte i = 0; i < numServos; i++)
@@ -141,8 +142,14 @@ void XoverMgr::BeginServoMove()
 
 	// set the servo index to the first servo and start moving the servos in sequence
 	servosActive = true;
+	servosStopped = false;
 	currentServo = 0;
 	ServoMoveDoneHandler();
+
+	// record the latency from the end of a dcc packet to the start of the servo motion, before the new
+	// position is stored, so that it doesn't include the save
+	dccLatency.Record(packetTime);
+	SavePosition();
 }
 
 
@@ -163,9 +170,11 @@ void XoverMgr::EndServoMove()
 	for (byte i = 0; i < numServos; i++)
 		relay[i].SetPin(relayState[i][position]);
 
-	// resume the bitstream capture
+	// resume the bitstream capture, if it was suspended for the motion
 	servosActive = false;
+#if defined(BITSTREAM_USES_TIMER1)
 	dcc.ResumeBitstream();
+#endif
 }
 
 
@@ -180,9 +189,9 @@ void XoverMgr::EndServoMove()
 void XoverMgr::ResetTimerHandler()
 {
 	// enable button/occupancy sensor handlers
-	button.SetButtonPressHandler(WrapperButtonPress);
-	osAB.SetButtonPressHandler(WrapperOSAB);
-	osCD.SetButtonPressHandler(WrapperOSCD);
+	button.SetButtonPressHandler(WrapperButtonPress, this);
+	osAB.SetButtonPressHandler(WrapperOSAB, this);
+	osCD.SetButtonPressHandler(WrapperOSCD, this);
 
 	// run the main init after the reset timer expires
 	InitMain();
@@ -257,7 +266,7 @@ void XoverMgr::DCCAccCommandHandler(unsigned int Addr, unsigned int Direction)
 	if (dccCommandSwap) dccState = (State)!dccState; // swap the interpretation of dcc command if needed
 
 	// if we are already in the desired position, just exit
-	if (dccState == position) return;
+	if (dccState == position && !servosStopped) return;
 
 #ifdef _DEBUG
 	Serial.print("Received dcc command to position ");
@@ -270,7 +279,7 @@ void XoverMgr::DCCAccCommandHandler(unsigned int Addr, unsigned int Direction)
 		// set switch state based on dcc command
 		position = dccState;
 		servoRate = LOW;
-		BeginServoMove();
+		BeginServoMove(dcc.PacketTime());
 	}
 	else
 	{
@@ -281,69 +290,101 @@ void XoverMgr::DCCAccCommandHandler(unsigned int Addr, unsigned int Direction)
 }
 
 
-// handle a DCC program on main command
-void XoverMgr::DCCPomHandler(unsigned int Addr, byte instType, unsigned int CV, byte Value)
+// freeze the servos where they are and cut their power, on a dcc reset or emergency stop
+void XoverMgr::EmergencyStopHandler()
 {
-	// do most of the program on main stuff in TurnoutBase
-	TurnoutBase::DCCPomHandler(Addr, instType, CV, Value);
+	if (!servosActive) return;
 
-	// update servo vars from eeprom
-	if (CV == CV_servo1MinTravel) servo[0].SetExtent(LOW, cv.getCV(CV_servo1MinTravel));
-	if (CV == CV_servo1MaxTravel) servo[0].SetExtent(HIGH, cv.getCV(CV_servo1MaxTravel));
+	servoPower.SetPin(LOW);
+	for (byte i = 0; i < numServos; i++)
+	{
+		servo[i].Stop();
+		servo[i].StopPWM();
+	}
 
-	if (CV == CV_servo2MinTravel) servo[1].SetExtent(LOW, cv.getCV(CV_servo2MinTravel));
-	if (CV == CV_servo2MaxTravel) servo[1].SetExtent(HIGH, cv.getCV(CV_servo2MaxTravel));
+	// the points may be part way, so leave the relays off and flash an error until the next move
+	servoTimer.StopTimer();
+	servosActive = false;
+	servosStopped = true;
+	led.SetLED(RgbLed::YELLOW, RgbLed::FLASH);
 
-	if (CV == CV_servo3MinTravel) servo[2].SetExtent(LOW, cv.getCV(CV_servo3MinTravel));
-	if (CV == CV_servo3MaxTravel) servo[2].SetExtent(HIGH, cv.getCV(CV_servo3MaxTravel));
+	// record the reaction time from the end of the stop packet
+	stopLatency.Record(dcc.PacketTime());
+}
+
+
+// update the servos when one of their cvs is changed
+void XoverMgr::ServoCVChanged(byte cvNum, uint16_t value)
+{
+	// a service mode write only sets the extent, since the servo power is the ack output on the
+	// programming track, and the servos move to it with the next command
+	const bool move = !dcc.IsServiceMode();
 
-	if (CV == CV_servo4MinTravel) servo[3].SetExtent(LOW, cv.getCV(CV_servo4MinTravel));
-	if (CV == CV_servo4MaxTravel) servo[3].SetExtent(HIGH, cv.getCV(CV_servo4MaxTravel));
-	
-	if (CV == CV_servoLowSpeed)
+	switch (cvNum)
+	{
+	case CV_servo1MinTravel: servo[0].SetExtent(LOW, value, move); break;
+	case CV_servo1MaxTravel: servo[0].SetExtent(HIGH, value, move); break;
+	case CV_servo2MinTravel: servo[1].SetExtent(LOW, value, move); break;
+	case CV_servo2MaxTravel: servo[1].SetExtent(HIGH, value, move); break;
+	case CV_servo3MinTravel: servo[2].SetExtent(LOW, value, move); break;
+	case CV_servo3MaxTravel: servo[2].SetExtent(HIGH, value, move); break;
+	case CV_servo4MinTravel: servo[3].SetExtent(LOW, value, move); break;
+	case CV_servo4MaxTravel: servo[3].SetExtent(HIGH, value, move); break;
+
+	case CV_servoLowSpeed:
 		for (byte i = 0; i < numServos; i++)
-			servo[i].SetDuration(LOW, cv.getCV(CV_servoLowSpeed) * 100);
-	if (CV == CV_servoHighSpeed)
+			servo[i].SetDuration(LOW, value * 100);
+		break;
+	case CV_servoHighSpeed:
 		for (byte i = 0; i < numServos; i++)
-			servo[i].SetDuration(HIGH, cv.getCV(CV_servoHighSpeed) * 100);
+			servo[i].SetDuration(HIGH, value * 100);
+		break;
+	}
 }
 
 
-// ========================================================================================================
+// handle a DCC service mode instruction, returns true to acknowledge it
+bool XoverMgr::DCCServiceModeHandler(byte instType, unsigned int CV, byte Value)
+{
+	// writes are made as for program on main, and acknowledged once the cv holds the new value
+	const int16_t writeValue = cv.getWriteValue(instType, CV, Value);
+	if (writeValue < 0) return cv.verifyCV(instType, CV, Value);
+
+	DCCPomHandler(0, CVManager::CV_WRITE, CV, writeValue);
+	return cv.verifyCV(CVManager::CV_VERIFY, CV, writeValue);
+}
 
-XoverMgr *XoverMgr::currentInstance = 0;    // pointer to allow us to access member objects from callbacks
 
-												// servo/sensor callback wrappers
-void XoverMgr::WrapperButtonPress(bool ButtonState) { currentInstance->ButtonEventHandler(ButtonState); }
-void XoverMgr::WrapperOSAB(bool ButtonState) { currentInstance->OSABHandler(ButtonState); }
-void XoverMgr::WrapperOSCD(bool ButtonState) { currentInstance->OSCDHandler(ButtonState); }
-void XoverMgr::WrapperServoMoveDone() { currentInstance->ServoMoveDoneHandler(); }
+// ========================================================================================================
+// servo/sensor callback wrappers, with the manager instance as the context
+void XoverMgr::WrapperButtonPress(void* context, bool ButtonState) { static_cast<XoverMgr*>(context)->ButtonEventHandler(ButtonState); }
+void XoverMgr::WrapperOSAB(void* context, bool ButtonState) { static_cast<XoverMgr*>(context)->OSABHandler(ButtonState); }
+void XoverMgr::WrapperOSCD(void* context, bool ButtonState) { static_cast<XoverMgr*>(context)->OSCDHandler(ButtonState); }
+void XoverMgr::WrapperServoMoveDone(void* context) { static_cast<XoverMgr*>(context)->ServoMoveDoneHandler(); }
+void XoverMgr::WrapperEmergencyStop(void* context) { static_cast<XoverMgr*>(context)->EmergencyStopHandler(); }
+void XoverMgr::WrapperServoCVChange(void* context, byte cvNum, uint16_t value) { static_cast<XoverMgr*>(context)->ServoCVChanged(cvNum, value); }
 
 
 // ========================================================================================================
-// dcc processor callback wrappers
+// dcc events, dispatched by DCCdecoder::DispatchEvents
 
-void XoverMgr::WrapperDCCAccPacket(int boardAddress, int outputAddress, byte activate, byte data)
+void XoverMgr::DCCBasicAccEvent(int boardAddress, int outputAddress, byte activate, byte data)
 {
-	currentInstance->DCCAccCommandHandler(outputAddress, data);
+	DCCAccCommandHandler(outputAddress, data);
 }
 
-void XoverMgr::WrapperDCCExtPacket(int boardAddress, int outputAddress, byte data)
+void XoverMgr::DCCBasicAccPomEvent(int boardAddress, int outputAddress, byte instructionType, int cv, byte data)
 {
-	currentInstance->DCCExtCommandHandler(outputAddress, data);
+	DCCPomHandler(outputAddress, instructionType, cv, data);
 }
 
-void XoverMgr::WrapperDCCAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data)
+bool XoverMgr::DCCServiceModeEvent(byte instructionType, int cv, byte data)
 {
-	currentInstance->DCCPomHandler(outputAddress, instructionType, cv, data);
+	return DCCServiceModeHandler(instructionType, cv, data);
 }
 
-void XoverMgr::WrapperMaxBitErrors(byte errorCode) { currentInstance->TurnoutBase::MaxBitErrorHandler(); }
-void XoverMgr::WrapperMaxPacketErrors(byte errorCode) { currentInstance->TurnoutBase::MaxPacketErrorHandler(); }
-void XoverMgr::WrapperDCCDecodingError(byte errorCode) { currentInstance->TurnoutBase::DCCDecodingError(); }
-
 
 // timer callback wrappers
-void XoverMgr::WrapperResetTimer() { currentInstance->ResetTimerHandler(); }
-void XoverMgr::WrapperErrorTimer() { currentInstance->ErrorTimerHandler(); }
-void XoverMgr::WrapperServoTimer() { currentInstance->EndServoMove(); }
+void XoverMgr::WrapperResetTimer(void* context) { static_cast<XoverMgr*>(context)->ResetTimerHandler(); }
+void XoverMgr::WrapperErrorTimer(void* context) { static_cast<XoverMgr*>(context)->ErrorTimerHandler(); }
+void XoverMgr::WrapperServoTimer(void* context) { static_cast<XoverMgr*>(context)->EndServoMove(); }